@@ -0,0 +1,133 @@
+//
+//  byte_order.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__byte_order__
+#define __FileDisk__byte_order__
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+
+
+namespace fld
+{
+
+// Everything in our files is little-endian. On little-endian CPUs the codecs
+//  below are just a memcpy the compiler turns into a plain load/store, elsewhere
+//  they swap bytes.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static const bool   host_is_little_endian = false;
+#else
+static const bool   host_is_little_endian = true;
+#endif
+
+
+template<class T, size_t Size = sizeof(T)> struct byte_swapper;
+
+template<class T> struct byte_swapper<T,1> { static T swap( T inValue ) { return inValue; } };
+template<class T> struct byte_swapper<T,2> { static T swap( T inValue ) { return (T) __builtin_bswap16( (uint16_t) inValue ); } };
+template<class T> struct byte_swapper<T,4> { static T swap( T inValue ) { return (T) __builtin_bswap32( (uint32_t) inValue ); } };
+template<class T> struct byte_swapper<T,8> { static T swap( T inValue ) { return (T) __builtin_bswap64( (uint64_t) inValue ); } };
+
+
+template<class T, bool NeedsSwap = !host_is_little_endian>
+struct little_endian_codec
+{
+    static void store( char* outBytes, T inValue )  { memcpy( outBytes, &inValue, sizeof(inValue) ); }
+    static T    load( const char* inBytes )         { T value; memcpy( &value, inBytes, sizeof(value) ); return value; }
+};
+
+template<class T>
+struct little_endian_codec<T,true>
+{
+    static void store( char* outBytes, T inValue )  { inValue = byte_swapper<T>::swap( inValue ); memcpy( outBytes, &inValue, sizeof(inValue) ); }
+    static T    load( const char* inBytes )         { T value; memcpy( &value, inBytes, sizeof(value) ); return byte_swapper<T>::swap( value ); }
+};
+
+
+template<class T> inline void   store_le( char* outBytes, T inValue )   { little_endian_codec<T>::store( outBytes, inValue ); }
+template<class T> inline T      load_le( const char* inBytes )          { return little_endian_codec<T>::load( inBytes ); }
+
+template<class T> inline void   write_le( std::ostream& inFile, T inValue )
+{
+    char    bytes[sizeof(T)];
+    store_le( bytes, inValue );
+    inFile.write( bytes, sizeof(bytes) );
+}
+
+template<class T> inline bool   read_le( std::istream& inFile, T* outValue )
+{
+    char    bytes[sizeof(T)];
+    if( !inFile.read( bytes, sizeof(bytes) ) )
+        return false;
+    *outValue = load_le<T>( bytes );
+    return true;
+}
+
+
+inline size_t  varint_size( uint64_t inNumber )
+{
+    size_t  numBytes = 1;
+    while( inNumber >= 0x80 )
+    {
+        inNumber >>= 7;
+        numBytes++;
+    }
+    return numBytes;
+}
+
+
+// Low 7 bits first, high bit set on all but the last byte:
+inline void    write_varint( std::ostream& inFile, uint64_t inNumber )
+{
+    char    bytes[10];
+    size_t  numBytes = 0;
+    while( inNumber >= 0x80 )
+    {
+        bytes[numBytes++] = (char)((inNumber & 0x7f) | 0x80);
+        inNumber >>= 7;
+    }
+    bytes[numBytes++] = (char)inNumber;
+    inFile.write( bytes, numBytes );
+}
+
+
+inline bool    read_varint( std::istream& inFile, uint64_t* outNumber )
+{
+    *outNumber = 0;
+    for( int shift = 0; shift < 64; shift += 7 )
+    {
+        uint8_t     currByte = 0;
+        if( !inFile.read( (char*)&currByte, sizeof(currByte) ) )
+            return false;
+        *outNumber |= ((uint64_t)(currByte & 0x7f)) << shift;
+        if( (currByte & 0x80) == 0 )
+            return true;
+    }
+    
+    return false;   // Too long, file is damaged.
+}
+
+
+inline bool    read_varint( const char*& ioBytes, const char* inEnd, uint64_t* outNumber )
+{
+    *outNumber = 0;
+    for( int shift = 0; shift < 64 && ioBytes < inEnd; shift += 7 )
+    {
+        uint8_t     currByte = (uint8_t)*(ioBytes++);
+        *outNumber |= ((uint64_t)(currByte & 0x7f)) << shift;
+        if( (currByte & 0x80) == 0 )
+            return true;
+    }
+    
+    return false;   // Too long or truncated, file is damaged.
+}
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__byte_order__) */
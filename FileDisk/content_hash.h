@@ -0,0 +1,105 @@
+//
+//  content_hash.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__content_hash__
+#define __FileDisk__content_hash__
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include "byte_order.h"
+
+
+namespace fld
+{
+
+// 64-bit xxHash (XXH64) of a block of memory. Fast, but not cryptographic, so
+//  anyone relying on two blocks being identical because their hashes match
+//  should still compare the actual bytes.
+
+namespace xxh64_detail
+{
+    static const uint64_t   prime1 = 11400714785074694791ULL;
+    static const uint64_t   prime2 = 14029467366897019727ULL;
+    static const uint64_t   prime3 = 1609587929392839161ULL;
+    static const uint64_t   prime4 = 9650029242287828579ULL;
+    static const uint64_t   prime5 = 2870177450012600261ULL;
+
+    inline uint64_t rotate_left( uint64_t inValue, int inBits )     { return (inValue << inBits) | (inValue >> (64 -inBits)); }
+    inline uint64_t load64( const char* inBytes )                   { return load_le<uint64_t>( inBytes ); }   // Hashes are stored in files, so must be the same on all CPUs.
+    inline uint32_t load32( const char* inBytes )                   { return load_le<uint32_t>( inBytes ); }
+    inline uint64_t round( uint64_t inAccumulator, uint64_t inInput )  { return rotate_left( inAccumulator +inInput * prime2, 31 ) * prime1; }
+    inline uint64_t merge_round( uint64_t inAccumulator, uint64_t inValue ) { return (inAccumulator ^ round( 0, inValue )) * prime1 +prime4; }
+}
+
+
+inline uint64_t content_hash( const char* inData, size_t inLength, uint64_t inSeed = 0 )
+{
+    using namespace xxh64_detail;
+
+    const char*     curr = inData;
+    const char*     end = inData +inLength;
+    uint64_t        hash = 0;
+
+    if( inLength >= 32 )
+    {
+        uint64_t    v1 = inSeed +prime1 +prime2;
+        uint64_t    v2 = inSeed +prime2;
+        uint64_t    v3 = inSeed;
+        uint64_t    v4 = inSeed -prime1;
+        do
+        {
+            v1 = round( v1, load64( curr ) );
+            v2 = round( v2, load64( curr +8 ) );
+            v3 = round( v3, load64( curr +16 ) );
+            v4 = round( v4, load64( curr +24 ) );
+            curr += 32;
+        }
+        while( curr <= end -32 );
+
+        hash = rotate_left( v1, 1 ) +rotate_left( v2, 7 ) +rotate_left( v3, 12 ) +rotate_left( v4, 18 );
+        hash = merge_round( hash, v1 );
+        hash = merge_round( hash, v2 );
+        hash = merge_round( hash, v3 );
+        hash = merge_round( hash, v4 );
+    }
+    else
+        hash = inSeed +prime5;
+
+    hash += (uint64_t) inLength;
+
+    while( curr +8 <= end )
+    {
+        hash ^= round( 0, load64( curr ) );
+        hash = rotate_left( hash, 27 ) * prime1 +prime4;
+        curr += 8;
+    }
+    if( curr +4 <= end )
+    {
+        hash ^= (uint64_t)load32( curr ) * prime1;
+        hash = rotate_left( hash, 23 ) * prime2 +prime3;
+        curr += 4;
+    }
+    while( curr < end )
+    {
+        hash ^= ((uint64_t)(uint8_t)*curr) * prime5;
+        hash = rotate_left( hash, 11 ) * prime1;
+        curr++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__content_hash__) */
@@ -0,0 +1,105 @@
+//
+//  extent_cipher.cpp
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#include "extent_cipher.h"
+#include <algorithm>
+#if FILE_DISK_USE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
+
+namespace fld
+{
+
+#if FILE_DISK_USE_OPENSSL
+
+class aes_gcm_cipher : public extent_cipher
+{
+public:
+    explicit aes_gcm_cipher( const std::string& inKey )
+        : mEncryptContext(EVP_CIPHER_CTX_new()), mDecryptContext(EVP_CIPHER_CTX_new())
+    {
+        // Expand the key once, each block then only sets its nonce:
+        mValid = mEncryptContext && mDecryptContext
+                && EVP_EncryptInit_ex( mEncryptContext, EVP_aes_256_gcm(), nullptr, (const unsigned char*)inKey.data(), nullptr ) == 1
+                && EVP_DecryptInit_ex( mDecryptContext, EVP_aes_256_gcm(), nullptr, (const unsigned char*)inKey.data(), nullptr ) == 1;
+    }
+    
+    ~aes_gcm_cipher()
+    {
+        EVP_CIPHER_CTX_free( mEncryptContext );
+        EVP_CIPHER_CTX_free( mDecryptContext );
+    }
+    
+    bool    is_valid() const    { return mValid; }
+    
+    virtual bool    encrypt( const char* inData, char* outData, size_t inDataSize, const std::string& inAssociatedData, uint8_t* outNonce, uint8_t* outTag )
+    {
+        int     numBytes = 0;
+        if( RAND_bytes( outNonce, nonce_size ) != 1
+            || EVP_EncryptInit_ex( mEncryptContext, nullptr, nullptr, nullptr, outNonce ) != 1
+            || EVP_EncryptUpdate( mEncryptContext, nullptr, &numBytes, (const unsigned char*)inAssociatedData.data(), (int)inAssociatedData.size() ) != 1 )
+            return false;
+        for( size_t x = 0; x < inDataSize; x += chunk_size )  // OpenSSL takes int lengths.
+        {
+            int     chunkSize = (int) std::min( (size_t)chunk_size, inDataSize -x );
+            if( EVP_EncryptUpdate( mEncryptContext, (unsigned char*)outData +x, &numBytes, (const unsigned char*)inData +x, chunkSize ) != 1 )
+                return false;
+        }
+        unsigned char   finalBytes[16]; // GCM doesn't pad, so nothing ends up in here.
+        return EVP_EncryptFinal_ex( mEncryptContext, finalBytes, &numBytes ) == 1
+                && EVP_CIPHER_CTX_ctrl( mEncryptContext, EVP_CTRL_GCM_GET_TAG, tag_size, outTag ) == 1;
+    }
+    
+    virtual bool    decrypt( const char* inData, char* outData, size_t inDataSize, const std::string& inAssociatedData, const uint8_t* inNonce, const uint8_t* inTag )
+    {
+        int     numBytes = 0;
+        if( EVP_DecryptInit_ex( mDecryptContext, nullptr, nullptr, nullptr, inNonce ) != 1
+            || EVP_DecryptUpdate( mDecryptContext, nullptr, &numBytes, (const unsigned char*)inAssociatedData.data(), (int)inAssociatedData.size() ) != 1 )
+            return false;
+        for( size_t x = 0; x < inDataSize; x += chunk_size )
+        {
+            int     chunkSize = (int) std::min( (size_t)chunk_size, inDataSize -x );
+            if( EVP_DecryptUpdate( mDecryptContext, (unsigned char*)outData +x, &numBytes, (const unsigned char*)inData +x, chunkSize ) != 1 )
+                return false;
+        }
+        unsigned char   finalBytes[16];
+        return EVP_CIPHER_CTX_ctrl( mDecryptContext, EVP_CTRL_GCM_SET_TAG, tag_size, (void*)inTag ) == 1
+                && EVP_DecryptFinal_ex( mDecryptContext, finalBytes, &numBytes ) == 1;  // Checks the tag.
+    }
+    
+protected:
+    enum { chunk_size = 1 << 30 };
+    
+    EVP_CIPHER_CTX*     mEncryptContext;
+    EVP_CIPHER_CTX*     mDecryptContext;
+    bool                mValid;
+};
+
+#endif // FILE_DISK_USE_OPENSSL
+
+
+extent_cipher*  extent_cipher::new_aes_gcm( const std::string& inKey )
+{
+    if( inKey.size() != key_size )
+        return nullptr;
+    
+#if FILE_DISK_USE_OPENSSL
+    aes_gcm_cipher*     theCipher = new aes_gcm_cipher( inKey );
+    if( !theCipher->is_valid() )
+    {
+        delete theCipher;
+        return nullptr;
+    }
+    return theCipher;
+#else
+    return nullptr;
+#endif
+}
+
+} /* namespace fld */
@@ -0,0 +1,46 @@
+//
+//  extent_cipher.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__extent_cipher__
+#define __FileDisk__extent_cipher__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+
+namespace fld
+{
+
+// Authenticated encryption of one block of file data at a time. file_disk
+//  keeps the nonce and tag of each block in its map entry. The only
+//  implementation is AES-256-GCM via OpenSSL (which uses AES-NI/PCLMULQDQ or
+//  the ARMv8 crypto extensions where available), so build with
+//  FILE_DISK_USE_OPENSSL=1 and link libcrypto to get it.
+class extent_cipher
+{
+public:
+    enum
+    {
+        key_size = 32,
+        nonce_size = 12,
+        tag_size = 16
+    };
+    
+    virtual ~extent_cipher() {}
+    
+    // outData may be the same as inData. decrypt() fails if the data, tag or
+    //  inAssociatedData aren't the same as when the data was encrypted:
+    virtual bool    encrypt( const char* inData, char* outData, size_t inDataSize, const std::string& inAssociatedData, uint8_t* outNonce, uint8_t* outTag ) = 0;  // Picks a new random nonce.
+    virtual bool    decrypt( const char* inData, char* outData, size_t inDataSize, const std::string& inAssociatedData, const uint8_t* inNonce, const uint8_t* inTag ) = 0;
+    
+    static extent_cipher*   new_aes_gcm( const std::string& inKey );  // NULL if inKey isn't key_size bytes, or we weren't built with OpenSSL.
+};
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__extent_cipher__) */
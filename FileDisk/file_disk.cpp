@@ -8,9 +8,24 @@
 
 #include "file_disk.h"
 #include "index_set.h"
+#include "content_hash.h"
+#include "byte_order.h"
+#include "trace.h"
 #include <iostream>
 #include <sys/stat.h>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <limits.h>
+#if __APPLE__
+#include <copyfile.h>
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 
 using namespace std;
@@ -21,6 +36,105 @@ namespace fld
 
 const char* MAP_BLOCK_FILENAME = "";  // File name we give the map block in the map. This is an invalid file name, so should be fine.
 
+// 1.1: Map entries have a length byte followed by the name.
+// 1.2: Map entries start with varint lengths of the prefix shared with the previous entry's name, and the rest of the name.
+// 1.3: Map entries with has_content_hash have the 8-byte hash of their data after the flags.
+// 1.4: Map entries with is_inline have their data after the flags and hash.
+// 1.5: The entry count is followed by the offset of the name index and its number of buckets.
+//      The name index comes after the entries in the map block: numBuckets +1 offsets
+//      (relative to the index) where each bucket's entries start, then the buckets. Each
+//      entry is a varint name length, the name, and the absolute offset and size of the
+//      file's data (which for is_inline files is inside the map).
+// 1.6: Map entries with is_encrypted have the 12-byte nonce and 16-byte tag of their data after the hash.
+// 1.7: Free map entries may have is_sparse.
+// 1.8: The map header has the commit generation after the bucket count, and all map entries
+//      have a varint generation after the flags. is_deleted entries after the free blocks
+//      are names of deleted files, without data.
+// All numbers are little-endian, files written by older versions on big-endian CPUs can't be read.
+static const uint32_t   FILE_FORMAT_VERSION = 0x00000108;
+static const size_t     MAP_HEADER_SIZE = 4 * sizeof(uint64_t);    // Entry count, index offset, bucket count, generation.
+
+// A delta starts with the version, the generation it starts after and the one it brings
+//  the receiver to. Then come records that start with one of these, followed by the varint
+//  length of the file name and the name. Upserts then have the varint size and the data:
+static const uint32_t   DELTA_FORMAT_VERSION = 0x00000100;
+static const size_t     DELTA_READ_CHUNK_SIZE = 1 << 20;   // apply_delta() only allocates as much as it has actually read, so damaged sizes fail cleanly.
+enum
+{
+    delta_end = 0,
+    delta_upsert,
+    delta_delete
+};
+
+
+// One file's entry in the name index:
+struct index_entry
+{
+    std::string         name;
+    uint64_t            start;  // Absolute offset of the file's data.
+    uint64_t            size;
+    uint64_t            bucket;
+};
+
+
+// Deleted files are remembered as map entries with just a name and generation:
+static file_node    tombstone_node( const std::string& inName, uint64_t inGeneration )
+{
+    file_node   tombstone;
+    tombstone.set_name( inName );
+    tombstone.set_flags( file_node::is_deleted );
+    tombstone.set_generation( inGeneration );
+    return tombstone;
+}
+
+
+// A power of 2, so we can mask the hash instead of dividing, with about 4 entries per
+//  bucket, so looking up a file is one small read for the bucket bounds and one for the bucket:
+static uint64_t index_bucket_count( uint64_t inNumFiles )
+{
+    uint64_t    numBuckets = 1;
+    while( numBuckets * 4 < inNumFiles )
+        numBuckets *= 2;
+    return numBuckets;
+}
+
+
+static size_t   index_entry_size( const std::string& inName )
+{
+    return varint_size( inName.size() ) +inName.size() +2 * sizeof(uint64_t);
+}
+
+
+static size_t   index_size_on_disk( uint64_t inNumFiles, size_t inEntryBytes )
+{
+    return (index_bucket_count( inNumFiles ) +1) * sizeof(uint64_t) +inEntryBytes;
+}
+
+
+static void write_index( std::ostream& inFile, std::vector<index_entry>& ioEntries )
+{
+    uint64_t    numBuckets = index_bucket_count( ioEntries.size() );
+    for( index_entry& currEntry : ioEntries )
+        currEntry.bucket = content_hash( currEntry.name.data(), currEntry.name.size() ) & (numBuckets -1);
+    std::stable_sort( ioEntries.begin(), ioEntries.end(), []( const index_entry& inA, const index_entry& inB ) { return inA.bucket < inB.bucket; } );
+    
+    uint64_t    bucketOffset = (numBuckets +1) * sizeof(uint64_t);
+    size_t      x = 0;
+    for( uint64_t currBucket = 0; currBucket <= numBuckets; currBucket++ )
+    {
+        write_le( inFile, bucketOffset );
+        for( ; x < ioEntries.size() && ioEntries[x].bucket == currBucket; x++ )
+            bucketOffset += index_entry_size( ioEntries[x].name );
+    }
+    for( const index_entry& currEntry : ioEntries )
+    {
+        write_varint( inFile, currEntry.name.size() );
+        inFile.write( currEntry.name.data(), currEntry.name.size() );
+        write_le( inFile, currEntry.start );
+        write_le( inFile, currEntry.size );
+    }
+}
+
 
 //class block_streambuf : public streambuf
 //{
@@ -55,7 +169,7 @@ const char* MAP_BLOCK_FILENAME = "";  // File name we give the map block in the
 
 
 file_disk::file_disk()
-    : mVersion(0x00000101), mMapOffset(0), mMapFlags(0)
+    : mMapFlags(0), mFileDescriptor(-1), mDirectFileDescriptor(-1), mOpenFlags(0), mDataAlignment(1), mVersion(FILE_FORMAT_VERSION), mMapOffset(0), mIOPosition(0), mPreallocatedSize(0), mDeduplicate(false), mInlineThreshold(0), mInBatch(false), mCommittingBatch(false), mWriteBackRunning(false), mStopWriteBack(false), mDirtyBytes(0), mAccessPattern(access_normal), mLastReadEnd(UINT64_MAX), mSequentialReads(0), mReadAheadEnd(0), mReadAheadWindow(min_read_ahead), mMapIsPartial(false), mIndexOffset(0), mIndexBucketCount(0), mCipher(nullptr), mTrimThreshold(0), mTrace(nullptr), mTraceDepth(0), mGeneration(0), mChangedSinceCommit(false)
 {
     
 }
@@ -63,98 +177,468 @@ file_disk::file_disk()
 
 file_disk::~file_disk()
 {
+    stop_write_back();
+    abort();
+    if( mFileDescriptor >= 0 )
+        close( mFileDescriptor );
+    if( mDirectFileDescriptor >= 0 )
+        close( mDirectFileDescriptor );
+    delete mCipher;
+}
+
+
+bool    file_disk::open( const std::string& inPath, open_flags_t inFlags, const std::string& inKey )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    delete mCipher;
+    mCipher = nullptr;
+    if( inKey.size() > 0 )
+    {
+        mCipher = extent_cipher::new_aes_gcm( inKey );
+        if( !mCipher )
+            return false;
+    }
     
+    return open_file( inPath, inFlags );
 }
 
 
-bool    file_disk::open( const std::string& inPath )
+bool    file_disk::open_file( const std::string& inPath, open_flags_t inFlags )
 {
     mFilePath = inPath;
-    mFile.open( mFilePath.c_str(), ios::binary | ios::in | ios::out );
-    if( !mFile.is_open() )  // File doesn't exist?
+    mOpenFlags = inFlags;
+    mMapIsPartial = false;
+    bool    readOnly = (inFlags & read_only) != 0;
+    int     openMode = readOnly ? O_RDONLY : O_RDWR;
+    mFile.open( mFilePath.c_str(), readOnly ? (ios::binary | ios::in) : (ios::binary | ios::in | ios::out) );
+    if( !mFile.is_open() && !readOnly )  // File doesn't exist?
         mFile.open( mFilePath.c_str(), ios::binary | ios::in | ios::out | ios::trunc );    // Create it!
     if( !mFile.is_open() )
         return false;
+    if( mFileDescriptor >= 0 )
+        close( mFileDescriptor );
+    mFileDescriptor = ::open( mFilePath.c_str(), openMode );
+    if( mDirectFileDescriptor >= 0 )
+        close( mDirectFileDescriptor );
+    mDirectFileDescriptor = -1;
+    if( inFlags & direct_io )
+    {
+#if __APPLE__
+        mDirectFileDescriptor = ::open( mFilePath.c_str(), openMode );
+        if( mDirectFileDescriptor >= 0 && fcntl( mDirectFileDescriptor, F_NOCACHE, 1 ) == -1 )
+        {
+            close( mDirectFileDescriptor );
+            mDirectFileDescriptor = -1;
+        }
+#elif defined(O_DIRECT)
+        mDirectFileDescriptor = ::open( mFilePath.c_str(), openMode | O_DIRECT );
+#endif
+        if( mDirectFileDescriptor < 0 )
+            return false;   // File system doesn't support uncached I/O.
+        if( mDataAlignment < direct_io_alignment )
+            mDataAlignment = direct_io_alignment;
+    }
     mFile.seekg( 0, ios::end );
     mFileSize = mFile.tellg();
+    mPreallocatedSize = mFileSize;
     if( mFileSize == 0 )
         mMapFlags = map_needs_rewrite | offsets_dirty | data_dirty;
     
-    return load_map();
+    // Index entries don't have the nonce and tag needed to decrypt, so with a key we need the whole map:
+    return (readOnly && !mCipher) ? load_index() : load_map();
 }
 
 
 bool    file_disk::load_map()
 {
+    mBlocksByHash.clear();
+    mHashedBlocks.clear();
+    mTombstones.clear();
+    mGeneration = 0;
+    mChangedSinceCommit = false;
+    
     if( mFileSize > 0 )
     {
         mFile.seekg( 0, ios::beg );
-        mFile.read( (char*)&mVersion, sizeof(mVersion) );
-        if( (mVersion & 0x0000ff00) != 0x0100 )   // Major version not 1? Incompatible change.
+        read_le( mFile, &mVersion );
+        if( (mVersion & 0x0000ff00) != 0x0100 )   // Major version not 1? Incompatible change (or written big-endian).
             return false;
-        if( (mVersion & 0x000000ff) != 0x01 )   // Minor version not 1? Compatible change.
+        if( (mVersion & 0x000000ff) > (FILE_FORMAT_VERSION & 0x000000ff) )   // Minor version newer than ours? Compatible change.
         {
             cout << "New file format variant " << (mVersion & 0x000000ff) << " some data may be lost if you edit the file." << endl;
         }
-        mFile.read( (char*)&mMapOffset, sizeof(mMapOffset) );
+        read_le( mFile, &mMapOffset );
+        mMetrics.add( counter_bytes_read, sizeof(mVersion) +sizeof(mMapOffset) );
+        note_seek( mMapOffset );
         mFile.seekg( mMapOffset, ios::beg );
         uint64_t    numFiles = 0;
-        mFile.read( (char*)&numFiles, sizeof(numFiles) );
+        read_le( mFile, &numFiles );
+        if( (mVersion & 0x000000ff) >= 0x05 )
+        {
+            read_le( mFile, &mIndexOffset );
+            read_le( mFile, &mIndexBucketCount );
+        }
+        if( (mVersion & 0x000000ff) >= 0x08 )
+            read_le( mFile, &mGeneration );
+        std::string previousName;
         for( uint64_t x = 0; x < numFiles; x++ )
         {
             file_node   newNode;
-            if( newNode.read(mFile) )
+            if( !newNode.read( mFile, mVersion, previousName ) )
+                return false;   // Map is damaged, and all entries after this one depend on it.
+            if( newNode.flags() & file_node::is_free )
+                mFreeBlocks.push_back( newNode );
+            else if( newNode.flags() & file_node::is_deleted )
+                mTombstones[newNode.name()] = newNode.generation();
+            else
+                mFileMap[newNode.name()] = newNode;
+            if( (newNode.flags() & file_node::has_content_hash) && (newNode.flags() & file_node::is_free) == 0 )
             {
-                if( newNode.flags() & file_node::is_free )
-                    mFreeBlocks.push_back( newNode );
-                else
-                    mFileMap[newNode.name()] = newNode;
+                hashed_block&   theBlock = mHashedBlocks[newNode.start_offset()];
+                if( theBlock.ref_count++ == 0 )
+                {
+                    theBlock.content_hash = newNode.content_hash();
+                    theBlock.logical_size = newNode.logical_size();
+                    theBlock.physical_size = newNode.physical_size();
+                    mBlocksByHash.insert( std::make_pair( newNode.content_hash(), newNode.start_offset() ) );
+                }
             }
         }
+        uint64_t    mapBytes = (uint64_t)mFile.tellg() -mMapOffset;
+        mMetrics.add( counter_bytes_read, mapBytes );
+        mIOPosition = mMapOffset +mapBytes;
+        
+        // We don't write the unused end of blocks, so the last block may extend past the end of the file:
+        for( const auto& currNodeEntry : mFileMap )
+            mFileSize = std::max( (uint64_t)mFileSize, currNodeEntry.second.start_offset() +currNodeEntry.second.physical_size() );
+        for( const file_node& currNode : mFreeBlocks )
+            mFileSize = std::max( (uint64_t)mFileSize, currNode.start_offset() +currNode.physical_size() );
+    }
+    
+    count_all( mStatistics );
+    
+    return true;
+}
+
+
+bool    file_disk::load_index()
+{
+    char    header[sizeof(mVersion) +sizeof(mMapOffset)];
+    if( mFileSize < sizeof(header) || !read_at( 0, header, sizeof(header) ) )
+        return load_map();
+    mVersion = load_le<uint32_t>( header );
+    if( (mVersion & 0x0000ff00) != 0x0100 || (mVersion & 0x000000ff) < 0x05 )    // Incompatible or no index? load_map() knows what to do.
+        return load_map();
+    mMapOffset = load_le<uint64_t>( header +sizeof(mVersion) );
+    
+    char    mapHeader[MAP_HEADER_SIZE];
+    if( !read_at( mMapOffset, mapHeader, sizeof(mapHeader) ) )
+        return false;
+    mIndexOffset = load_le<uint64_t>( mapHeader +sizeof(uint64_t) );
+    mIndexBucketCount = load_le<uint64_t>( mapHeader +2 * sizeof(uint64_t) );
+    mGeneration = ((mVersion & 0x000000ff) >= 0x08) ? load_le<uint64_t>( mapHeader +3 * sizeof(uint64_t) ) : 0;
+    if( mIndexBucketCount == 0 || (mIndexBucketCount & (mIndexBucketCount -1)) != 0 )
+        return false;   // Damaged file.
+    mMapIsPartial = true;
+    
+    return true;
+}
+
+
+bool    file_disk::load_whole_map()
+{
+    if( !mMapIsPartial )
+        return true;
+    
+    mFileMap.clear();
+    mMapIsPartial = false;
+    return load_map();
+}
+
+
+file_node*  file_disk::find_node( const std::string& inFileName )
+{
+    auto fileItty = mFileMap.find( inFileName );
+    if( fileItty != mFileMap.end() )
+        return &fileItty->second;
+    if( !mMapIsPartial || inFileName.size() == 0 )
+        return nullptr;
+    
+    // Read where the file's hash bucket starts and ends, then the bucket:
+    uint64_t    bucket = content_hash( inFileName.data(), inFileName.size() ) & (mIndexBucketCount -1);
+    char        bucketBounds[2 * sizeof(uint64_t)];
+    if( !read_at( mIndexOffset +bucket * sizeof(uint64_t), bucketBounds, sizeof(bucketBounds) ) )
+        return nullptr;
+    uint64_t    bucketStart = load_le<uint64_t>( bucketBounds );
+    uint64_t    bucketEnd = load_le<uint64_t>( bucketBounds +sizeof(uint64_t) );
+    if( bucketEnd < bucketStart || (bucketEnd -bucketStart) > (1 << 30) )
+        return nullptr; // Damaged file.
+    std::vector<char>   entries( bucketEnd -bucketStart );
+    if( entries.size() == 0 || !read_at( mIndexOffset +bucketStart, entries.data(), entries.size() ) )
+        return nullptr;
+    
+    const char*     curr = entries.data();
+    const char*     end = curr +entries.size();
+    while( curr < end )
+    {
+        uint64_t    nameLength = 0;
+        if( !read_varint( curr, end, &nameLength ) || (uint64_t)(end -curr) < nameLength +2 * sizeof(uint64_t) )
+            return nullptr; // Damaged file.
+        bool        isMatch = nameLength == inFileName.size() && memcmp( curr, inFileName.data(), nameLength ) == 0;
+        curr += nameLength;
+        if( isMatch )
+        {
+            file_node&  newNode = mFileMap[inFileName];
+            newNode.set_name( inFileName );
+            newNode.set_start_offset( load_le<uint64_t>( curr ) );
+            newNode.set_logical_size( load_le<uint64_t>( curr +sizeof(uint64_t) ) );
+            newNode.set_physical_size( newNode.logical_size() );
+            return &newNode;
+        }
+        curr += 2 * sizeof(uint64_t);
+    }
+    
+    return nullptr;
+}
+
+
+size_t  file_disk::block_size_for_data_size( size_t inDataSize, bool inIsGrowing ) const
+{
+    size_t  blockSize = inDataSize;
+    
+    if( mGrowthPolicy.mode == growth_policy::geometric && inIsGrowing )
+    {
+        blockSize += (size_t)(inDataSize * mGrowthPolicy.geometric_slack);
+    }
+    else if( mGrowthPolicy.mode == growth_policy::size_classes && blockSize > 16 )
+    {
+        // Round up to the next of 4 steps between two powers of two, e.g. 64, 80, 96, 112, 128, 160...
+        //  That way, freed blocks are much more likely to fit the next allocation.
+        int     highestBit = 63 -__builtin_clzll( blockSize );
+        size_t  step = ((size_t)1) << (highestBit -2);
+        blockSize = ((blockSize +step -1) / step) * step;
+    }
+    
+    if( mGrowthPolicy.alignment > 1 )
+        blockSize = ((blockSize +mGrowthPolicy.alignment -1) / mGrowthPolicy.alignment) * mGrowthPolicy.alignment;
+    
+    return blockSize;
+}
+
+
+void    file_disk::set_trace( trace_recorder* inRecorder )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);   // The write-back thread may be in the middle of a call.
+    
+    mTrace = inRecorder;
+}
+
+
+void    file_disk::set_data_alignment( size_t inAlignment )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    if( inAlignment < 1 )
+        inAlignment = 1;
+    if( mDirectFileDescriptor >= 0 && (inAlignment % direct_io_alignment) != 0 )   // Uncached I/O needs at least sector alignment.
+        inAlignment = ((inAlignment +direct_io_alignment -1) / direct_io_alignment) * direct_io_alignment;
+    mDataAlignment = inAlignment;
+}
+
+
+bool    file_disk::free_block_fits( const file_node& inFreeNode, size_t desiredSize, bool inAligned ) const
+{
+    if( inFreeNode.physical_size() < desiredSize )
+        return false;
+    if( mCommittingBatch && mReusableFreeBlocks.count( inFreeNode.start_offset() ) == 0 )
+        return false;   // Freed by this commit, the map on disk may still use it.
+    if( inAligned && (inFreeNode.start_offset() % mDataAlignment) != 0 )
+        return false;   // Probably the padding in front of an aligned block. Fine for the map, but not for data.
+    
+    return true;
+}
+
+
+uint64_t    file_disk::allocate_at_end( size_t inPhysicalSize, bool inAligned )
+{
+    if( inAligned && (mFileSize % mDataAlignment) != 0 )
+    {
+        // Keep track of the padding as a free block, so all bytes in the file are accounted for
+        //  and the map can go there:
+        file_node   paddingNode;
+        paddingNode.set_start_offset( mFileSize );
+        paddingNode.set_physical_size( mDataAlignment -(mFileSize % mDataAlignment) );
+        paddingNode.set_logical_size( paddingNode.physical_size() );
+        paddingNode.set_flags( file_node::is_free );
+        mFreeBlocks.push_back( paddingNode );
+        count_node( paddingNode, 1 );
+        mMapFlags |= map_needs_rewrite;
+        mFileSize += paddingNode.physical_size();
+    }
+    
+    uint64_t    startOffset = mFileSize;
+    mFileSize += inPhysicalSize;
+    
+    if( mGrowthPolicy.preallocation_chunk > 0 && mFileSize > mPreallocatedSize )
+    {
+        // Reserve disk space for the next few blocks in one go, so appended blocks end up
+        //  contiguous on disk and the file system doesn't have to find room every time.
+        uint64_t    chunk = mGrowthPolicy.preallocation_chunk;
+        uint64_t    newPreallocatedSize = ((mFileSize +chunk -1) / chunk) * chunk;
+        if( preallocate( mPreallocatedSize, newPreallocatedSize -mPreallocatedSize ) )
+            mPreallocatedSize = newPreallocatedSize;
+    }
+    
+    return startOffset;
+}
+
+
+bool    file_disk::preallocate( uint64_t inOffset, uint64_t inNumBytes )
+{
+    if( mFileDescriptor < 0 || inNumBytes == 0 )
+        return false;
+    
+#if __APPLE__
+    // Allocate past the physical end of file. Try to get one contiguous extent first, then settle for any.
+    fstore_t    store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)inNumBytes, 0 };
+    if( fcntl( mFileDescriptor, F_PREALLOCATE, &store ) == -1 )
+    {
+        store.fst_flags = F_ALLOCATEALL;
+        if( fcntl( mFileDescriptor, F_PREALLOCATE, &store ) == -1 )
+            return false;
+    }
+    return true;
+#elif defined(FALLOC_FL_KEEP_SIZE)
+    // KEEP_SIZE so the file's length (and thus where open() thinks the file ends) stays as-is:
+    return fallocate( mFileDescriptor, FALLOC_FL_KEEP_SIZE, (off_t)inOffset, (off_t)inNumBytes ) == 0;
+#else
+    return false;
+#endif
+}
+
+
+bool    file_disk::punch_hole( uint64_t inOffset, uint64_t inNumBytes )
+{
+    if( mFileDescriptor < 0 || inNumBytes == 0 )
+        return false;
+    
+#if __APPLE__ && defined(F_PUNCHHOLE)
+    fpunchhole_t    hole = { 0, 0, (off_t)inOffset, (off_t)inNumBytes };
+    return fcntl( mFileDescriptor, F_PUNCHHOLE, &hole ) == 0;
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate( mFileDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)inOffset, (off_t)inNumBytes ) == 0;
+#else
+    return false;
+#endif
+}
+
+
+// The whole file system blocks inside a free block, which is what we can punch out of it:
+static bool hole_in_block( const file_node& inNode, uint64_t* outStart, uint64_t* outEnd )
+{
+    *outStart = ((inNode.start_offset() +file_disk::trim_alignment -1) / file_disk::trim_alignment) * file_disk::trim_alignment;
+    *outEnd = ((inNode.start_offset() +inNode.physical_size()) / file_disk::trim_alignment) * file_disk::trim_alignment;
+    return *outEnd > *outStart;
+}
+
+
+bool    file_disk::punch_free_blocks( uint64_t inMinSize )
+{
+    for( file_node& currNode : mFreeBlocks )
+    {
+        uint64_t    holeStart = 0, holeEnd = 0;
+        if( (currNode.flags() & file_node::is_sparse) || currNode.physical_size() < inMinSize || !hole_in_block( currNode, &holeStart, &holeEnd ) )
+            continue;
+        if( !punch_hole( holeStart, holeEnd -holeStart ) )
+            return false;
+        count_node( currNode, -1 );
+        currNode.set_flags( currNode.flags() | file_node::is_sparse );
+        count_node( currNode, 1 );
+        mMapFlags |= offsets_dirty; // Remembered on the next write().
     }
     
     return true;
 }
 
 
+bool    file_disk::trim( uint64_t inMinSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_trim, nullptr, 0, inMinSize );
+    
+    if( mInBatch || !write() )  // Free blocks may still be used by the map on disk until we commit.
+        return false;
+    
+    return punch_free_blocks( inMinSize );
+}
+
+
 void    file_disk::swap_node_for_free_node_of_size( file_node& ioNode, size_t desiredSize, size_t desiredSizeIfNotRecycled )
 {
     if( desiredSizeIfNotRecycled <= 0 )
         desiredSizeIfNotRecycled = desiredSize;
+    bool        isData = ioNode.name().compare(MAP_BLOCK_FILENAME) != 0;
 
-    for( file_node& currNode : mFreeBlocks )
+    uint64_t    numExamined = 0;
+    for( auto itty = mFreeBlocks.begin(); itty != mFreeBlocks.end(); itty++ )
     {
-        if( currNode.physical_size() >= desiredSize )
+        file_node&  currNode = *itty;
+        numExamined++;
+        if( free_block_fits( currNode, desiredSize, isData ) )
         {
-            file_node   tmp = ioNode;
-            ioNode = currNode;
-            currNode = tmp;
-            ioNode.set_name( currNode.name() );
-            file_node::node_flags_t    nodeFlags = file_node::is_free;
-            ioNode.set_flags( (currNode.flags() | file_node::offsets_dirty) & ~nodeFlags );
+            mMetrics.record_free_list_scan( numExamined );
+            // Exchange only the locations, name and cached data stay with ioNode,
+            //  the free node doesn't get a name so we don't leak it.
+            uint64_t    oldStartOffset = ioNode.start_offset();
+            uint64_t    oldPhysicalSize = ioNode.physical_size();
+            count_node( ioNode, -1 );
+            count_node( currNode, -1 );
+            ioNode.set_start_offset( currNode.start_offset() );
+            ioNode.set_physical_size( currNode.physical_size() );
             ioNode.set_logical_size( desiredSize );
-            ioNode.set_cached_data( currNode.cached_data() );
-            currNode.set_flags(file_node::is_free);
-            currNode.set_cached_data( nullptr );
+            ioNode.set_flags( ioNode.flags() | file_node::offsets_dirty );
+            currNode.set_start_offset( oldStartOffset );
+            currNode.set_physical_size( oldPhysicalSize );
+            currNode.set_logical_size( oldPhysicalSize );
+            currNode.set_flags( file_node::is_free );
+            count_node( ioNode, 1 );
             mMapFlags |= offsets_dirty;
+            if( oldPhysicalSize == 0 )  // Was an empty file? Don't keep a useless empty free block around.
+            {
+                mFreeBlocks.erase( itty );
+                mMapFlags |= map_needs_rewrite;
+            }
+            else
+                count_node( currNode, 1 );
             return;
         }
     }
     
+    mMetrics.record_free_list_scan( numExamined );
+    
     // If we get here, there's no free node large enough to hold our data, we need to allocate a new one:
     // So mark the old node as free space:
-    file_node   oldNode = ioNode;
-    oldNode.set_name("");   // Delete the name, would only take up unneeded space or leak confidential data.
-    oldNode.set_flags( file_node::is_free );
-    mFreeBlocks.push_back( oldNode );
-    mMapFlags |= map_needs_rewrite; // Make sure we write out the new free block entry.
+    if( ioNode.physical_size() > 0 )
+    {
+        file_node   oldNode;
+        oldNode.set_start_offset( ioNode.start_offset() );
+        oldNode.set_physical_size( ioNode.physical_size() );
+        oldNode.set_logical_size( ioNode.physical_size() );
+        oldNode.set_flags( file_node::is_free );
+        mFreeBlocks.push_back( oldNode );
+        count_node( oldNode, 1 );
+        mMapFlags |= map_needs_rewrite; // Make sure we write out the new free block entry.
+    }
     
     // Now allocate space at the end of the file for the new node:
-    ioNode.set_start_offset( mFileSize );
+    uint64_t    newStartOffset = allocate_at_end( desiredSizeIfNotRecycled, isData );
+    count_node( ioNode, -1 );
+    ioNode.set_start_offset( newStartOffset );
     ioNode.set_physical_size( desiredSizeIfNotRecycled );
-    ioNode.set_logical_size( desiredSizeIfNotRecycled );
+    ioNode.set_logical_size( desiredSize );
     ioNode.set_flags( ioNode.flags() | file_node::offsets_dirty );
-    mFileSize += desiredSizeIfNotRecycled;
+    count_node( ioNode, 1 );
 }
 
 
@@ -162,33 +646,42 @@ file_node&    file_disk::node_of_size_for_name( size_t desiredSize, const std::s
 {
     if( desiredSizeIfNotRecycled <= 0 )
         desiredSizeIfNotRecycled = desiredSize;
+    bool        isData = inName.compare(MAP_BLOCK_FILENAME) != 0;
     
+    uint64_t    numExamined = 0;
     for( auto itty = mFreeBlocks.begin(); itty != mFreeBlocks.end(); itty++ )
     {
         file_node& currNode = *itty;
-        if( currNode.physical_size() >= desiredSize )
+        numExamined++;
+        if( free_block_fits( currNode, desiredSize, isData ) )
         {
+            mMetrics.record_free_list_scan( numExamined );
             file_node   tmp = currNode;
             tmp.set_name( inName );
+            tmp.set_logical_size( desiredSize );
+            tmp.set_flags( file_node::name_dirty | file_node::offsets_dirty );
             
+            count_node( currNode, -1 );
             mFreeBlocks.erase( itty );
             mFileMap[inName] = tmp;
-            tmp.set_flags( file_node::name_dirty | file_node::offsets_dirty );
-            // No need to change mMapFlags, we removed a dirty entry and added a new one.
+            count_node( tmp, 1 );
+            mMapFlags |= map_needs_rewrite; // Entry count stays the same, but the name makes this entry larger.
             
             return mFileMap[inName];
         }
     }
 
+    mMetrics.record_free_list_scan( numExamined );
+
     // If we get here, there's no free node large enough to hold our data, we need to allocate a new one:
     file_node   tmp;
     tmp.set_name( inName );
-    tmp.set_start_offset( mFileSize );
+    tmp.set_start_offset( allocate_at_end( desiredSizeIfNotRecycled, isData ) );
     tmp.set_physical_size( desiredSizeIfNotRecycled );
-    tmp.set_logical_size( desiredSizeIfNotRecycled );
+    tmp.set_logical_size( desiredSize );
     tmp.set_flags( file_node::name_dirty | file_node::offsets_dirty );
-    mFileSize += desiredSize;
     mFileMap[inName] = tmp;
+    count_node( tmp, 1 );
     
     mMapFlags |= map_needs_rewrite; // Make sure we write out a new map with the extra entry.
             
@@ -198,70 +691,60 @@ file_node&    file_disk::node_of_size_for_name( size_t desiredSize, const std::s
 
 bool    file_disk::write()
 {
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_commit );
+    trace_scope     traced( mTrace, mTraceDepth, trace_write );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
     if( mFileSize == 0 )
     {
-        uint32_t    fileVersion = 0x00000101;
-        mFile.seekp(0,ios::beg);
-        mFile.write( (char*)&fileVersion, sizeof(fileVersion) );
-        mFile.write( (char*)&mMapOffset, sizeof(mMapOffset) );
+        uint32_t    fileVersion = FILE_FORMAT_VERSION;
+        char        header[sizeof(fileVersion) +sizeof(mMapOffset)];
+        store_le( header, fileVersion );
+        store_le( header +sizeof(fileVersion), mMapOffset );
+        if( !write_at( 0, header, sizeof(header) ) )
+            return false;
         mFileSize = sizeof(fileVersion) +sizeof(mMapOffset);
     }
     
-    // Write out the data for all blocks, creating new ones
-    //  as needed. While we're iterating, we also calculate
-    //  the size we'll need for the map.
-    size_t  mapSize = sizeof(uint64_t);
+    if( !write_dirty_data() )
+        return false;
     
-    // +++ to preserve file integrity in case of a full disk, we should really only write
-    //  new and resized blocks below, and wait with writing out blocks where data just
-    //  changed in place until we've written the map. After all, overwriting in-place is
-    //  much less likely to fail, while growing so large the disk is full is quite common,
-    //  so we'd only do some needless writing of free blocks, but keep a valid file.
+    if( mVersion < FILE_FORMAT_VERSION )    // Entries are larger in the current format, so the map may not fit its block anymore.
+        mMapFlags |= map_needs_rewrite;
     
-    for( std::map<std::string,file_node>::iterator currNodeEntry = mFileMap.begin(); currNodeEntry != mFileMap.end(); currNodeEntry++ )
-    {
-        file_node& currNode = currNodeEntry->second;
-        mapSize += currNode.node_size_on_disk();
-        
-        if( (currNode.flags() & data_dirty) && currNode.name().size() != 0 )
-        {
-            if( currNode.logical_size() > currNode.physical_size() )
-                swap_node_for_free_node_of_size( currNode, currNode.physical_size() );
-            
-            mFile.seekp( currNode.start_offset() );
-            mFile.write( (char*) currNode.cached_data(), currNode.physical_size() );
-            // Ensure we fill up the gap behind the block.
-            //  +++ Should optimize this to not clear data if we already have old data
-            //  in the file.
-            for( uint64_t x = currNode.physical_size(); x < currNode.logical_size(); x++ )
-            {
-                uint8_t nullByte = 0;
-                mFile.write( (char*)&nullByte, sizeof(nullByte) );
-            }
-            currNodeEntry->second.set_flags( currNode.flags() & ~file_node::data_dirty );
-        }
-    }
+    // Entries can also grow without a rewrite being requested, e.g. when a generation
+    //  needs another varint byte, so make sure an in-place update still fits:
+    std::map<std::string,file_node>::iterator   currMapEntryItty = mFileMap.find(MAP_BLOCK_FILENAME);
+    if( currMapEntryItty == mFileMap.end() || currMapEntryItty->second.physical_size() < map_size_on_disk() )
+        mMapFlags |= map_needs_rewrite;
     
     if( (mMapFlags & map_needs_rewrite) )
     {
+        // Now that all blocks have their final locations, we know how large the map
+        //  will be. Moving the map may add one more free block (the old map), and
+        //  creating it one more used one, so leave room for that.
         file_node   dummy;
         dummy.set_name(MAP_BLOCK_FILENAME);
-        file_node&  mapEntry = dummy;
+        size_t      mapSize = map_size_on_disk();
         std::map<std::string,file_node>::iterator mapEntryItty = mFileMap.find(MAP_BLOCK_FILENAME);  // Have a map?
         if( mapEntryItty == mFileMap.end() )
         {
-            mapEntry = node_of_size_for_name( mapSize, MAP_BLOCK_FILENAME, mapSize +mapEntry.node_size_on_disk() );
+            mapSize += dummy.node_size_on_disk();
+            node_of_size_for_name( mapSize, MAP_BLOCK_FILENAME, block_size_for_data_size( mapSize, true ) );
+            mapEntryItty = mFileMap.find(MAP_BLOCK_FILENAME);
         }
-        else
+        else if( mapEntryItty->second.physical_size() < mapSize )
         {
-            swap_node_for_free_node_of_size( mapEntryItty->second, mapSize, mapSize +mapEntry.node_size_on_disk() );
-            mapEntry = mapEntryItty->second;
+            swap_node_for_free_node_of_size( mapEntryItty->second, mapSize, block_size_for_data_size( mapSize +dummy.node_size_on_disk(), true ) );
         }
+        count_node( mapEntryItty->second, -1 );
+        mapEntryItty->second.set_logical_size( map_size_on_disk() );
+        count_node( mapEntryItty->second, 1 );
         
-        mMapOffset = mapEntry.start_offset();
-        mFile.seekp( mMapOffset );
-        uint64_t    numEntries = mFileMap.size() + mFreeBlocks.size();
-        mFile.write( (char*)&numEntries, sizeof(numEntries) );
+        mMapOffset = mapEntryItty->second.start_offset();
     }
 
     // +++ We should use a different collection that guarantees that
@@ -277,112 +760,700 @@ bool    file_disk::write()
     //  a second location, giving us a copy of the map. Then the
     //  point where things can fail is only when we write the new
     //  map offset in, which is highly unlikely.
-    mFile.seekp( mMapOffset +sizeof(uint64_t), ios::beg );
+    note_seek( mMapOffset +MAP_HEADER_SIZE );
+    mFile.seekp( mMapOffset +MAP_HEADER_SIZE, ios::beg );
+    uint64_t    mapBytesWritten = 0;
+    std::string previousName;
+    std::vector<index_entry>    indexEntries;
+    indexEntries.reserve( mFileMap.size() );
     for( std::map<std::string,file_node>::iterator currNodeEntry = mFileMap.begin(); currNodeEntry != mFileMap.end(); currNodeEntry++ )
     {
         file_node& currNode = currNodeEntry->second;
         currNode.set_flags( currNode.flags() & ~(file_node::offsets_dirty | file_node::name_dirty) );
-        currNode.write( mFile );
+        size_t      entrySize = currNode.node_size_on_disk( previousName );
+        if( currNodeEntry->first != MAP_BLOCK_FILENAME )
+        {
+            uint64_t    entryEnd = mMapOffset +MAP_HEADER_SIZE +mapBytesWritten +entrySize;
+            index_entry newEntry = { currNodeEntry->first, (currNode.flags() & file_node::is_inline) ? (entryEnd -currNode.logical_size()) : currNode.start_offset(), currNode.logical_size(), 0 };
+            indexEntries.push_back( newEntry );
+        }
+        mapBytesWritten += entrySize;
+        currNode.write( mFile, previousName );
     }
-    for( auto currNode : mFreeBlocks )
+    for( const file_node& currNode : mFreeBlocks )
+    {
+        mapBytesWritten += currNode.node_size_on_disk( previousName );
+        currNode.write( mFile, previousName );
+    }
+    for( const auto& currTombstone : mTombstones )
     {
-        currNode.write( mFile );
+        file_node   tombstone = tombstone_node( currTombstone.first, currTombstone.second );
+        mapBytesWritten += tombstone.node_size_on_disk( previousName );
+        tombstone.write( mFile, previousName );
     }
+    uint64_t    indexOffset = mMapOffset +MAP_HEADER_SIZE +mapBytesWritten;
+    uint64_t    numBuckets = index_bucket_count( indexEntries.size() );
+    write_index( mFile, indexEntries );
+    mapBytesWritten = (uint64_t)mFile.tellp() -mMapOffset -MAP_HEADER_SIZE;
+    mMetrics.add( counter_bytes_written, mapBytesWritten );
+    mIOPosition = mMapOffset +MAP_HEADER_SIZE +mapBytesWritten;
     
-    mFile.seekp( sizeof(uint32_t), ios::beg );    // Seek past version number to map offset.
-    mFile.write( (char*)&mMapOffset, sizeof(mMapOffset) );
+    uint64_t    numEntries = mFileMap.size() + mFreeBlocks.size() + mTombstones.size();
+    uint64_t    newGeneration = mChangedSinceCommit ? (mGeneration +1) : mGeneration;   // Changed files already have this generation.
+    char        mapHeader[MAP_HEADER_SIZE];
+    store_le( mapHeader, numEntries );
+    store_le( mapHeader +sizeof(uint64_t), indexOffset );
+    store_le( mapHeader +2 * sizeof(uint64_t), numBuckets );
+    store_le( mapHeader +3 * sizeof(uint64_t), newGeneration );
+    if( !write_at( mMapOffset, mapHeader, sizeof(mapHeader) ) )
+        return false;
+    
+    // Update the map offset, and the version in case this was an older file and the map was written in the new format:
+    mVersion = FILE_FORMAT_VERSION;
+    char        header[sizeof(mVersion) +sizeof(mMapOffset)];
+    store_le( header, mVersion );
+    store_le( header +sizeof(mVersion), mMapOffset );
+    if( !write_at( 0, header, sizeof(header) ) )
+        return false;
+    mFile.flush();  // Hand everything to the OS, so other file_disks opening this file see it.
+    if( mFile.fail() || mFile.bad() )
+        return false;
     
     mMapFlags &= ~(map_needs_rewrite | offsets_dirty | data_dirty);
+    mGeneration = newGeneration;
+    mChangedSinceCommit = false;
+    
+    // Now that the new map is on disk, nothing uses the free blocks anymore:
+    if( mTrimThreshold > 0 )
+        punch_free_blocks( mTrimThreshold );    // Only saves space, so not worth failing the commit over.
     
     return true;
 }
 
 
-bool    file_disk::add_file( const char* inFileName, char* inData, size_t dataSize, size_t blockSize )
+bool    file_disk::write_dirty_data()
 {
-    if( mFileSize == 0 )    // Totally new file?
+    // Write out the data for all blocks, creating new ones
+    //  as needed.
+    // +++ to preserve file integrity in case of a full disk, we should really only write
+    //  new and resized blocks below, and wait with writing out blocks where data just
+    //  changed in place until we've written the map. After all, overwriting in-place is
+    //  much less likely to fail, while growing so large the disk is full is quite common,
+    //  so we'd only do some needless writing of free blocks, but keep a valid file.
+    
+    for( std::map<std::string,file_node>::iterator currNodeEntry = mFileMap.begin(); currNodeEntry != mFileMap.end(); currNodeEntry++ )
     {
-        if( !write() )   // Make sure we have a TOC and have calculated the file size.
-            return false;
+        file_node& currNode = currNodeEntry->second;
+        
+        if( (currNode.flags() & file_node::data_dirty) && currNode.name().size() != 0 )
+        {
+            if( currNode.logical_size() > currNode.physical_size() )
+                swap_node_for_free_node_of_size( currNode, currNode.logical_size(), block_size_for_data_size( currNode.logical_size(), true ) );
+            
+            // mCachedData is only logical_size() bytes long, anything after that
+            //  in the block is slack we leave alone.
+            const char*         data = currNode.cached_data();
+            std::vector<char>   encryptedData;
+            if( mCipher )   // Encrypt a copy, so the cached data stays readable.
+            {
+                encryptedData.resize( currNode.logical_size() );
+                if( !mCipher->encrypt( data, encryptedData.data(), encryptedData.size(), currNode.name(), currNode.nonce(), currNode.tag() ) )
+                    return false;
+                data = encryptedData.data();
+            }
+            if( (mCipher != nullptr) != ((currNode.flags() & file_node::is_encrypted) != 0) )   // Nonce and tag appear in or vanish from the map entry.
+            {
+                currNode.set_flags( currNode.flags() ^ file_node::is_encrypted );
+                mMapFlags |= map_needs_rewrite;
+            }
+            if( !write_at( currNode.start_offset(), data, currNode.logical_size() ) )
+                return false;
+            currNode.set_flags( (currNode.flags() & ~file_node::data_dirty) | file_node::offsets_dirty );
+            if( mWriteBackRunning ) // Keep memory use bounded, read it back from disk if needed.
+            {
+                delete [] currNode.cached_data();
+                currNode.set_cached_data( nullptr );
+            }
+        }
     }
     
-    if( blockSize == 0 )
-        blockSize = dataSize;
+    if( mMapFlags & data_dirty )    // Sizes in the map may have changed, even if the data didn't move.
+        mMapFlags = (mMapFlags & ~data_dirty) | offsets_dirty;
+    mDirtyBytes = 0;
     
-    if( mFileMap.find( inFileName ) != mFileMap.end() ) // File of this name already exists?
-        return false;
+    return true;
+}
+
+
+void    file_disk::note_dirty_data( size_t inNumBytes )
+{
+    if( mDirtyBytes == 0 )
+        mOldestDirtyTime = std::chrono::steady_clock::now();
+    mDirtyBytes += inNumBytes;
+    mMapFlags |= data_dirty;
     
-    file_node&  newNode = node_of_size_for_name( blockSize, inFileName );
-    newNode.set_logical_size( dataSize );
-    if( inData )
+    if( mWriteBackRunning && mDirtyBytes >= mWriteBackPolicy.max_dirty_bytes )
     {
-        newNode.set_cached_data( inData );
-        newNode.set_flags( newNode.flags() | file_node::data_dirty );
-        mMapFlags |= data_dirty;
+        if( mDirtyBytes >= mWriteBackPolicy.max_dirty_bytes * 2 )   // Write-back thread can't keep up? Don't let RAM use grow without bounds.
+            write_dirty_data();
+        else
+            mWriteBackCondition.notify_one();
     }
-    
-    return true;
 }
 
 
-bool    file_disk::set_file_contents( const char* inFileName, char* inData, size_t dataSize )
+bool    file_disk::start_write_back( const struct write_back_policy& inPolicy )
 {
-    if( inFileName[0] == 0 )
-        return false; // Can't delete the file map.
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
     
-    auto fileItty = mFileMap.find(inFileName);
-    if( fileItty == mFileMap.end() )
+    if( mOpenFlags & read_only )
         return false;
     
-    if( dataSize > fileItty->second.physical_size() )
-    {
-        swap_node_for_free_node_of_size( fileItty->second, dataSize );
-    }
+    if( mWriteBackRunning )
+        return false;
     
-    if( fileItty->second.cached_data() )
-        delete [] fileItty->second.cached_data();
-    fileItty->second.set_cached_data( inData );
-    fileItty->second.set_logical_size( dataSize );
-    fileItty->second.set_flags( fileItty->second.flags() | file_node::data_dirty | file_node::offsets_dirty );
-    mMapFlags |= data_dirty;
+    mWriteBackPolicy = inPolicy;
+    mStopWriteBack = false;
+    mWriteBackRunning = true;
+    mWriteBackThread = std::thread( &file_disk::write_back_thread_main, this );
     
     return true;
 }
 
 
-bool    file_disk::write( const char* buf, size_t numBytes, file_node& inFileNode )
+bool    file_disk::stop_write_back()
 {
-    size_t  oldSize = inFileNode.logical_size();
-    size_t  dataSize = inFileNode.write_offs()+ numBytes;
-    if( dataSize > inFileNode.physical_size() )
     {
-        swap_node_for_free_node_of_size( inFileNode, dataSize );
+        std::lock_guard<std::recursive_mutex>  lock(mLock);
+        if( !mWriteBackRunning )
+            return true;
+        mStopWriteBack = true;
+        mWriteBackCondition.notify_one();
     }
+    mWriteBackThread.join();    // Outside the lock, or the thread could never wake up to see mStopWriteBack.
     
-    if( inFileNode.flags() & file_node::data_dirty )
-    {
-        mFile.seekp( inFileNode.start_offset(), ios::beg );
-        if( mFile.fail() || mFile.bad() )
-            return false;   // This block is invalid now. Un-swap the blocks to fix it?
-        mFile.write( (char*) inFileNode.cached_data(), oldSize );
-        if( mFile.fail() || mFile.bad() )
-            return false;   // This block is invalid now. Un-swap the blocks to fix it?
-        inFileNode.set_logical_size( oldSize );
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    mWriteBackRunning = false;
+    
+    return (mMapFlags == 0 || mFileSize == 0) ? true : write();
+}
+
+
+void    file_disk::discard_cached_data( file_node& ioNode )
+{
+    if( (ioNode.flags() & file_node::data_dirty) && mDirtyBytes >= ioNode.logical_size() )
+        mDirtyBytes -= ioNode.logical_size(); // Won't be written anymore.
+    if( ioNode.cached_data() )
+    {
+        delete [] ioNode.cached_data();
+        ioNode.set_cached_data( nullptr );
     }
+}
 
-    if( inFileNode.cached_data() )
-        delete [] inFileNode.cached_data();
-    inFileNode.set_cached_data( nullptr );
 
-    inFileNode.set_logical_size( dataSize );
-    inFileNode.set_flags( inFileNode.flags() | file_node::data_dirty | file_node::offsets_dirty );
+void    file_disk::write_back_thread_main()
+{
+    std::unique_lock<std::recursive_mutex>  lock(mLock);
+    auto    lastCommitTime = std::chrono::steady_clock::now();
+    
+    while( !mStopWriteBack )
+    {
+        // Sleep until the oldest dirty data is due, or the next commit, or someone wakes us:
+        auto    wakeTime = std::chrono::steady_clock::now() +std::chrono::seconds(1);
+        if( mWriteBackPolicy.commit_interval.count() > 0 )
+            wakeTime = lastCommitTime +mWriteBackPolicy.commit_interval;
+        if( mDirtyBytes > 0 )
+            wakeTime = std::min( wakeTime, mOldestDirtyTime +mWriteBackPolicy.max_dirty_age );
+        mWriteBackCondition.wait_until( lock, wakeTime );
+        if( mStopWriteBack )
+            break;
+        
+        auto    now = std::chrono::steady_clock::now();
+        if( mDirtyBytes > 0 && (mDirtyBytes >= mWriteBackPolicy.max_dirty_bytes || (now -mOldestDirtyTime) >= mWriteBackPolicy.max_dirty_age) )
+            write_dirty_data();
+        if( mWriteBackPolicy.commit_interval.count() > 0 && (now -lastCommitTime) >= mWriteBackPolicy.commit_interval )
+        {
+            if( mMapFlags != 0 && mFileSize > 0 && !mCommittingBatch )
+                write();
+            lastCommitTime = now;
+        }
+    }
+}
+
+
+size_t  file_disk::map_size_on_disk() const
+{
+    size_t      mapSize = MAP_HEADER_SIZE;
+    size_t      numIndexEntries = 0, indexEntryBytes = 0;
+    std::string previousName;
+    for( const auto& currNodeEntry : mFileMap )
+    {
+        mapSize += currNodeEntry.second.node_size_on_disk( previousName );
+        previousName = currNodeEntry.first;
+        if( currNodeEntry.first != MAP_BLOCK_FILENAME )
+        {
+            numIndexEntries++;
+            indexEntryBytes += index_entry_size( currNodeEntry.first );
+        }
+    }
+    for( const file_node& currNode : mFreeBlocks )
+    {
+        mapSize += currNode.node_size_on_disk( previousName );
+        previousName = currNode.name();
+    }
+    for( const auto& currTombstone : mTombstones )
+    {
+        mapSize += tombstone_node( currTombstone.first, currTombstone.second ).node_size_on_disk( previousName );
+        previousName = currTombstone.first;
+    }
+    mapSize += index_size_on_disk( numIndexEntries, indexEntryBytes );
+    
+    return mapSize;
+}
+
+
+bool    file_disk::add_file( const char* inFileName, char* inData, size_t dataSize, size_t blockSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_add );
+    trace_scope     traced( mTrace, mTraceDepth, trace_add, inFileName, 0, dataSize, blockSize );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    if( mInBatch )
+        return stage_change( batch_change::add, inFileName, inData, dataSize, blockSize );
+    
+    if( mFileSize == 0 )    // Totally new file?
+    {
+        if( !write() )   // Make sure we have a TOC and have calculated the file size.
+            return false;
+    }
+    
+    if( blockSize == 0 )
+        blockSize = dataSize;
+    
+    if( mFileMap.find( inFileName ) != mFileMap.end() ) // File of this name already exists?
+        return false;
+    
+    if( inData && dataSize > 0 && blockSize <= mInlineThreshold && !mCipher )
+    {
+        file_node&  newNode = mFileMap[inFileName];
+        newNode.set_name( inFileName );
+        newNode.set_cached_data( inData );
+        newNode.set_logical_size( dataSize );
+        newNode.set_flags( file_node::name_dirty | file_node::offsets_dirty | file_node::is_inline );
+        count_node( newNode, 1 );
+        note_change( newNode );
+        mMapFlags |= map_needs_rewrite;
+        return true;
+    }
+    
+    blockSize = block_size_for_data_size( blockSize, false );
+    
+    if( mDeduplicate && !mCipher && inData && dataSize > 0 )  // Encrypted copies of the same data differ.
+    {
+        file_node&  newNode = mFileMap[inFileName];
+        newNode.set_name( inFileName );
+        newNode.set_flags( file_node::name_dirty | file_node::offsets_dirty );
+        count_node( newNode, 1 );
+        note_change( newNode );
+        mMapFlags |= map_needs_rewrite;
+        return store_deduplicated( newNode, inData, dataSize, blockSize );
+    }
+    
+    file_node&  newNode = node_of_size_for_name( blockSize, inFileName );
+    count_node( newNode, -1 );
+    newNode.set_logical_size( dataSize );
+    count_node( newNode, 1 );
+    note_change( newNode );
+    if( inData )
+    {
+        newNode.set_cached_data( inData );
+        newNode.set_flags( newNode.flags() | file_node::data_dirty );
+        note_dirty_data( dataSize );
+    }
+    
+    return true;
+}
+
+
+bool    file_disk::set_file_contents( const char* inFileName, char* inData, size_t dataSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_set );
+    trace_scope     traced( mTrace, mTraceDepth, trace_set, inFileName, 0, dataSize );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    if( mInBatch )
+        return stage_change( batch_change::set, inFileName, inData, dataSize, 0 );
+    if( inFileName[0] == 0 )
+        return false; // Can't delete the file map.
+    
+    auto fileItty = mFileMap.find(inFileName);
+    if( fileItty == mFileMap.end() )
+        return false;
+    
+    file_node&  theNode = fileItty->second;
+    note_change( theNode );
+    release_block( theNode );  // Copy-on-write: Don't overwrite a block other files still use.
+    
+    if( inData && dataSize > 0 && dataSize <= mInlineThreshold && !mCipher )
+    {
+        free_block_of_node( theNode );
+        discard_cached_data( theNode );
+        theNode.set_cached_data( inData );
+        count_node( theNode, -1 );
+        theNode.set_logical_size( dataSize );
+        theNode.set_start_offset( 0 );
+        theNode.set_flags( (theNode.flags() & ~file_node::data_dirty) | file_node::is_inline | file_node::offsets_dirty );
+        count_node( theNode, 1 );
+        mMapFlags |= map_needs_rewrite;
+        return true;
+    }
+    if( theNode.flags() & file_node::is_inline )    // Too large to stay in the map? Needs a block now.
+    {
+        count_node( theNode, -1 );
+        theNode.set_flags( theNode.flags() & ~file_node::is_inline );
+        count_node( theNode, 1 );
+        mMapFlags |= map_needs_rewrite;
+    }
+    
+    if( mDeduplicate && !mCipher && inData && dataSize > 0 )  // Encrypted copies of the same data differ.
+    {
+        discard_cached_data( theNode );
+        theNode.set_flags( theNode.flags() & ~file_node::data_dirty );
+        free_block_of_node( theNode );  // Maybe the new contents go right back there.
+        return store_deduplicated( theNode, inData, dataSize, block_size_for_data_size( dataSize, true ) );
+    }
+    
+    if( dataSize > fileItty->second.physical_size() )
+    {
+        swap_node_for_free_node_of_size( fileItty->second, dataSize, block_size_for_data_size( dataSize, true ) );
+    }
+    
+    discard_cached_data( fileItty->second );
+    fileItty->second.set_cached_data( inData );
+    count_node( fileItty->second, -1 );
+    fileItty->second.set_logical_size( dataSize );
+    fileItty->second.set_flags( fileItty->second.flags() | file_node::data_dirty | file_node::offsets_dirty );
+    count_node( fileItty->second, 1 );
+    note_dirty_data( dataSize );
+    
+    return true;
+}
+
+
+bool    file_disk::append( const char* inFileName, const char* inData, size_t dataSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_append, inFileName, 0, dataSize );
+    
+    auto fileItty = mFileMap.find(inFileName);
+    if( inFileName[0] == 0 || fileItty == mFileMap.end() )
+        return false;
+    
+    return pwrite( inFileName, fileItty->second.logical_size(), inData, dataSize );
+}
+
+
+bool    file_disk::pwrite( const char* inFileName, uint64_t inOffset, const char* inData, size_t dataSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_write );
+    trace_scope     traced( mTrace, mTraceDepth, trace_pwrite, inFileName, inOffset, dataSize );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    if( inFileName[0] == 0 || mInBatch )
+        return false; // Can't write to the file map, or stage partial writes.
+    
+    auto fileItty = mFileMap.find(inFileName);
+    if( fileItty == mFileMap.end() )
+        return false;
+    
+    note_change( fileItty->second );
+    return write_node_range( fileItty->second, inOffset, inData, dataSize );
+}
+
+
+bool    file_disk::write_node_range( file_node& ioNode, uint64_t inOffset, const char* inData, size_t dataSize )
+{
+    if( !make_block_private( ioNode ) )
+        return false;
+    
+    uint64_t    oldSize = ioNode.logical_size();
+    uint64_t    newSize = std::max( oldSize, inOffset +dataSize );
+    bool        isInline = (ioNode.flags() & file_node::is_inline) != 0;
+    
+    if( isInline && (newSize > mInlineThreshold || mCipher) )
+    {
+        // Too large for the map now. Give it a block, it is in RAM already, so
+        //  treat it just like a new file:
+        count_node( ioNode, -1 );
+        ioNode.set_flags( (ioNode.flags() & ~file_node::is_inline) | file_node::data_dirty );
+        count_node( ioNode, 1 );
+        mMapFlags |= map_needs_rewrite;
+        note_dirty_data( oldSize );
+        isInline = false;
+    }
+    
+    if( (ioNode.flags() & (file_node::data_dirty | file_node::is_inline)) == 0 && (mCipher || (ioNode.flags() & file_node::is_encrypted)) )
+    {
+        // Encrypted blocks can only be written as a whole, so bring this one into RAM,
+        //  it gets encrypted and written on the next commit:
+        if( !ioNode.cached_data() )
+        {
+            char*   data = new char[oldSize];
+            if( !read_node_range( ioNode, 0, data, oldSize ) )
+            {
+                delete [] data;
+                return false;
+            }
+            ioNode.set_cached_data( data );
+        }
+        ioNode.set_flags( ioNode.flags() | file_node::data_dirty );
+        mMapFlags |= data_dirty;
+        note_dirty_data( oldSize );
+    }
+    
+    if( ioNode.flags() & (file_node::data_dirty | file_node::is_inline) )
+    {
+        // The whole block (or map entry) gets written on the next commit anyway,
+        //  so just update what we have in RAM:
+        if( newSize > oldSize )
+        {
+            if( !isInline && newSize > ioNode.physical_size() )
+                swap_node_for_free_node_of_size( ioNode, newSize, block_size_for_data_size( newSize, true ) );
+            char*   newData = new char[newSize];
+            memcpy( newData, ioNode.cached_data(), oldSize );
+            memset( newData +oldSize, 0, newSize -oldSize );
+            delete [] ioNode.cached_data();
+            ioNode.set_cached_data( newData );
+        }
+        memcpy( ioNode.cached_data() +inOffset, inData, dataSize );
+        count_node( ioNode, -1 );
+        ioNode.set_logical_size( newSize );
+        count_node( ioNode, 1 );
+        if( isInline )
+            mMapFlags |= map_needs_rewrite;
+        else
+            note_dirty_data( newSize -oldSize );
+        return true;
+    }
+    
+    if( ioNode.cached_data() )  // Clean copy from before the last write()? Would be outdated now.
+    {
+        delete [] ioNode.cached_data();
+        ioNode.set_cached_data( nullptr );
+    }
+    
+    if( newSize > ioNode.physical_size() )
+    {
+        // Move the block somewhere it fits, and copy the old contents over on disk,
+        //  without reading the whole thing into RAM. The old block is only in the
+        //  free list in RAM, so the map on disk stays valid until the next commit.
+        uint64_t    oldStartOffset = ioNode.start_offset();
+        swap_node_for_free_node_of_size( ioNode, newSize, block_size_for_data_size( newSize, true ) );
+        if( !copy_range( oldStartOffset, ioNode.start_offset(), std::min( oldSize, inOffset ) ) )
+            return false;
+    }
+    
+    if( inOffset > oldSize )    // Writing past the end? Fill the gap.
+    {
+        std::vector<char>   zeroes( inOffset -oldSize, 0 );
+        if( !write_at( ioNode.start_offset() +oldSize, zeroes.data(), zeroes.size() ) )
+            return false;
+    }
+    if( !write_at( ioNode.start_offset() +inOffset, inData, dataSize ) )
+        return false;
+    
+    count_node( ioNode, -1 );
+    ioNode.set_logical_size( newSize );
+    ioNode.set_flags( ioNode.flags() | file_node::offsets_dirty );
+    count_node( ioNode, 1 );
     mMapFlags |= offsets_dirty;
     
-    mFile.seekp( inFileNode.start_offset() +inFileNode.write_offs(), ios::beg );
-    if( mFile.fail() || mFile.bad() )
+    return true;
+}
+
+
+bool    file_disk::copy_range( uint64_t inFromOffset, uint64_t inToOffset, uint64_t inNumBytes )
+{
+    const uint64_t      chunkSize = 1024 * 1024;
+    std::vector<char>   buffer( std::min( chunkSize, inNumBytes ) );
+    for( uint64_t x = 0; x < inNumBytes; x += chunkSize )
+    {
+        size_t  numBytes = std::min( chunkSize, inNumBytes -x );
+        if( !read_at( inFromOffset +x, buffer.data(), numBytes ) )
+            return false;
+        if( !write_at( inToOffset +x, buffer.data(), numBytes ) )
+            return false;
+    }
+    
+    return true;
+}
+
+
+bool    file_disk::store_deduplicated( file_node& ioNode, char* inData, size_t dataSize, size_t blockSize )
+{
+    uint64_t    hash = fld::content_hash( inData, dataSize );
+    
+    // Hashes can collide, so only share a block if it really has the same bytes:
+    auto        candidates = mBlocksByHash.equal_range( hash );
+    for( auto itty = candidates.first; itty != candidates.second; itty++ )
+    {
+        hashed_block&   theBlock = mHashedBlocks[itty->second];
+        if( theBlock.logical_size != dataSize || !block_equals( itty->second, inData, dataSize ) )
+            continue;
+        
+        count_node( ioNode, -1 );
+        ioNode.set_start_offset( itty->second );
+        ioNode.set_physical_size( theBlock.physical_size );
+        ioNode.set_logical_size( dataSize );
+        ioNode.set_content_hash( hash );
+        ioNode.set_flags( ioNode.flags() | file_node::has_content_hash | file_node::offsets_dirty );
+        count_node( ioNode, 1 );
+        theBlock.ref_count++;
+        mMapFlags |= map_needs_rewrite;
+        delete [] inData;
+        
+        return true;
+    }
+    
+    // New contents. Write them right away, so later duplicates can compare against the disk:
+    count_node( ioNode, -1 );
+    ioNode.set_physical_size( 0 );
+    count_node( ioNode, 1 );
+    swap_node_for_free_node_of_size( ioNode, dataSize, std::max( blockSize, dataSize ) );
+    if( !write_at( ioNode.start_offset(), inData, dataSize ) )
         return false;
-    mFile.write( (char*) buf, numBytes );
-    if( mFile.fail() || mFile.bad() )
+    delete [] inData;
+    
+    count_node( ioNode, -1 );
+    ioNode.set_content_hash( hash );
+    ioNode.set_flags( ioNode.flags() | file_node::has_content_hash );
+    count_node( ioNode, 1 );
+    hashed_block    newBlock = { hash, dataSize, ioNode.physical_size(), 1 };
+    mHashedBlocks[ioNode.start_offset()] = newBlock;
+    count_block( newBlock, 1, mStatistics );
+    mBlocksByHash.insert( std::make_pair( hash, ioNode.start_offset() ) );
+    mMapFlags |= map_needs_rewrite;
+    
+    return true;
+}
+
+
+bool    file_disk::block_equals( uint64_t inOffset, const char* inData, size_t dataSize )
+{
+    const size_t        chunkSize = 64 * 1024;
+    std::vector<char>   buffer( std::min( chunkSize, dataSize ) );
+    for( size_t x = 0; x < dataSize; x += chunkSize )
+    {
+        size_t  numBytes = std::min( chunkSize, dataSize -x );
+        if( !read_at( inOffset +x, buffer.data(), numBytes ) )
+            return false;
+        if( memcmp( buffer.data(), inData +x, numBytes ) != 0 )
+            return false;
+    }
+    
+    return true;
+}
+
+
+void    file_disk::release_block( file_node& ioNode )
+{
+    if( (ioNode.flags() & file_node::has_content_hash) == 0 )
+        return;
+    
+    count_node( ioNode, -1 );
+    ioNode.set_flags( ioNode.flags() & ~file_node::has_content_hash );
+    mMapFlags |= map_needs_rewrite; // Entry loses its hash.
+    
+    auto    blockItty = mHashedBlocks.find( ioNode.start_offset() );
+    if( blockItty == mHashedBlocks.end() )
+    {
+        count_node( ioNode, 1 );
+        return;
+    }
+    if( blockItty->second.ref_count > 1 )
+    {
+        // Others still use it, so it's not ours to free or change:
+        blockItty->second.ref_count--;
+        ioNode.set_physical_size( 0 );
+        count_node( ioNode, 1 );
+        return;
+    }
+    
+    // Last user, the block is a normal block of ioNode's again:
+    count_block( blockItty->second, -1, mStatistics );
+    count_node( ioNode, 1 );
+    
+    auto    candidates = mBlocksByHash.equal_range( blockItty->second.content_hash );
+    for( auto itty = candidates.first; itty != candidates.second; itty++ )
+    {
+        if( itty->second == ioNode.start_offset() )
+        {
+            mBlocksByHash.erase( itty );
+            break;
+        }
+    }
+    mHashedBlocks.erase( blockItty );
+}
+
+
+bool    file_disk::make_block_private( file_node& ioNode )
+{
+    if( (ioNode.flags() & file_node::has_content_hash) == 0 )
+        return true;
+    
+    uint64_t    oldStartOffset = ioNode.start_offset();
+    release_block( ioNode );
+    if( ioNode.physical_size() == 0 && ioNode.logical_size() > 0 )    // Was shared? Make a copy.
+    {
+        swap_node_for_free_node_of_size( ioNode, ioNode.logical_size(), block_size_for_data_size( ioNode.logical_size(), true ) );
+        if( !copy_range( oldStartOffset, ioNode.start_offset(), ioNode.logical_size() ) )
+            return false;
+    }
+    
+    return true;
+}
+
+
+void    file_disk::free_block_of_node( file_node& ioNode )
+{
+    if( ioNode.physical_size() == 0 )
+        return;
+    
+    file_node   oldNode;
+    oldNode.set_start_offset( ioNode.start_offset() );
+    oldNode.set_physical_size( ioNode.physical_size() );
+    oldNode.set_logical_size( ioNode.physical_size() );
+    oldNode.set_flags( file_node::is_free );
+    mFreeBlocks.push_back( oldNode );
+    count_node( oldNode, 1 );
+    mMapFlags |= map_needs_rewrite;
+    count_node( ioNode, -1 );
+    ioNode.set_physical_size( 0 );
+    count_node( ioNode, 1 );
+}
+
+
+void    file_disk::note_change( file_node& ioNode )
+{
+    ioNode.set_generation( mGeneration +1 );
+    mTombstones.erase( ioNode.name() );    // Re-added after it was deleted?
+    mChangedSinceCommit = true;
+    mMapFlags |= offsets_dirty;
+}
+
+
+bool    file_disk::write( const char* buf, size_t numBytes, file_node& inFileNode )
+{
+    if( !write_node_range( inFileNode, inFileNode.write_offs(), buf, numBytes ) )
         return false;
     inFileNode.set_write_offs( inFileNode.write_offs() +numBytes );
     
@@ -392,240 +1463,1244 @@ bool    file_disk::write( const char* buf, size_t numBytes, file_node& inFileNod
 
 bool    file_disk::read( char* buf, size_t numBytes, file_node& inFileNode )
 {
-    if( inFileNode.read_offs() >= inFileNode.logical_size() )
+    metrics_timer   timer( mMetrics, op_read );
+    
+    if( (inFileNode.read_offs() + numBytes) > inFileNode.logical_size() )
         return false;
-    if( (inFileNode.read_offs() + numBytes) >= inFileNode.logical_size() )
+    if( !read_node_range( inFileNode, inFileNode.read_offs(), buf, numBytes ) )
         return false;
+    inFileNode.set_read_offs( inFileNode.read_offs() +numBytes );
+    
+    return true;
+}
+
 
+bool    file_disk::read_node_range( const file_node& inFileNode, uint64_t inOffset, char* outBuf, size_t inNumBytes )
+{
     if( inFileNode.cached_data() )
     {
-        memcpy( buf, inFileNode.cached_data() +inFileNode.read_offs(), numBytes );
+        mMetrics.add( counter_cache_hits, 1 );
+        memcpy( outBuf, inFileNode.cached_data() +inOffset, inNumBytes );
     }
-    else
+    else if( inFileNode.flags() & file_node::is_encrypted )
     {
-        mFile.seekg( inFileNode.start_offset() +inFileNode.read_offs(), ios::beg );
-        if( mFile.fail() || mFile.bad() )
+        mMetrics.add( counter_cache_misses, 1 );
+        if( inOffset == 0 && inNumBytes == inFileNode.logical_size() )
+            return read_decrypted( inFileNode, outBuf );
+        std::vector<char>   blockData( inFileNode.logical_size() );
+        if( !read_decrypted( inFileNode, blockData.data() ) )
             return false;
-        mFile.read( buf, numBytes );
-        if( mFile.fail() || mFile.bad() )
+        memcpy( outBuf, blockData.data() +inOffset, inNumBytes );
+    }
+    else
+    {
+        mMetrics.add( counter_cache_misses, 1 );
+        if( inNumBytes > 0 && !read_at( inFileNode.start_offset() +inOffset, outBuf, inNumBytes ) )
             return false;
     }
-    inFileNode.set_read_offs( inFileNode.read_offs() +numBytes );
     
     return true;
 }
 
 
-bool    file_disk::is_valid()
+bool    file_disk::read_decrypted( const file_node& inFileNode, char* outBuf )
+{
+    if( !mCipher )
+        return false;   // Opened without a key.
+    if( inFileNode.logical_size() > 0 && !read_at( inFileNode.start_offset(), outBuf, inFileNode.logical_size() ) )
+        return false;
+    
+    return mCipher->decrypt( outBuf, outBuf, inFileNode.logical_size(), inFileNode.name(), inFileNode.nonce(), inFileNode.tag() );
+}
+
+
+bool    file_disk::pread( const char* inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, size_t* outBytesRead )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_read );
+    trace_scope     traced( mTrace, mTraceDepth, trace_read, inFileName, inOffset, inNumBytes );
+    
+    if( outBytesRead )
+        *outBytesRead = 0;
+    if( inFileName[0] == 0 )
+        return false; // The file map isn't a file.
+    const file_node*    foundNode = find_node( inFileName );
+    if( !foundNode )
+        return false;
+    const file_node&    theNode = *foundNode;
+    if( inOffset > theNode.logical_size() )
+        return false;
+    
+    size_t  numBytes = (size_t) std::min( (uint64_t)inNumBytes, theNode.logical_size() -inOffset );
+    if( !read_node_range( theNode, inOffset, outBuf, numBytes ) )
+        return false;
+    if( outBytesRead )
+        *outBytesRead = numBytes;
+    
+    return true;
+}
+
+
+bool    file_disk::read_many( std::vector<read_request>& ioRequests )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_read );
+    trace_scope     traced( mTrace, mTraceDepth, ioRequests );
+    
+    // Anything we have in RAM we copy right away, the rest we collect so we
+    //  can read it in the order it is on disk:
+    struct pending_read
+    {
+        uint64_t        start;      // Absolute offset in our file.
+        size_t          length;
+        read_request*   request;
+        
+        bool operator < ( const pending_read& inOther ) const { return start < inOther.start; }
+    };
+    std::vector<pending_read>   pendingReads;
+    bool                        allSucceeded = true;
+    for( read_request& currRequest : ioRequests )
+    {
+        currRequest.bytes_read = 0;
+        currRequest.succeeded = false;
+        const file_node*    foundNode = (currRequest.name.size() == 0) ? nullptr : find_node( currRequest.name );
+        if( !foundNode || currRequest.offset > foundNode->logical_size() )
+        {
+            allSucceeded = false;
+            continue;
+        }
+        const file_node&    theNode = *foundNode;
+        size_t              numBytes = (size_t) std::min( (uint64_t)currRequest.length, theNode.logical_size() -currRequest.offset );
+        if( theNode.cached_data() || numBytes == 0 || (theNode.flags() & file_node::is_encrypted) )  // Encrypted blocks are read whole.
+        {
+            currRequest.succeeded = read_node_range( theNode, currRequest.offset, currRequest.buffer, numBytes );
+            currRequest.bytes_read = currRequest.succeeded ? numBytes : 0;
+            allSucceeded = allSucceeded && currRequest.succeeded;
+            continue;
+        }
+        pending_read    newRead = { theNode.start_offset() +currRequest.offset, numBytes, &currRequest };
+        pendingReads.push_back( newRead );
+    }
+    std::sort( pendingReads.begin(), pendingReads.end() );
+    
+    // Now merge reads that are close to each other into one larger read, as
+    //  skipping a few bytes is much cheaper than another seek:
+    std::vector<char>   runBuffer;
+    for( size_t runStart = 0; runStart < pendingReads.size(); )
+    {
+        uint64_t    runStartOffset = pendingReads[runStart].start;
+        uint64_t    runEndOffset = runStartOffset +pendingReads[runStart].length;
+        size_t      runEnd = runStart +1;
+        while( runEnd < pendingReads.size()
+                && pendingReads[runEnd].start <= runEndOffset +max_coalesce_gap
+                && (std::max( runEndOffset, pendingReads[runEnd].start +pendingReads[runEnd].length ) -runStartOffset) <= max_coalesced_read )
+        {
+            runEndOffset = std::max( runEndOffset, pendingReads[runEnd].start +pendingReads[runEnd].length );
+            runEnd++;
+        }
+        
+        mMetrics.add( counter_cache_misses, runEnd -runStart );
+        bool    runSucceeded = false;
+        if( runEnd == runStart +1 )  // Nothing to merge, read directly into the caller's buffer.
+        {
+            runSucceeded = read_at( runStartOffset, pendingReads[runStart].request->buffer, pendingReads[runStart].length );
+        }
+        else
+        {
+            runBuffer.resize( runEndOffset -runStartOffset );
+            runSucceeded = read_at( runStartOffset, runBuffer.data(), runBuffer.size() );
+            for( size_t x = runStart; runSucceeded && x < runEnd; x++ )
+                memcpy( pendingReads[x].request->buffer, runBuffer.data() +(pendingReads[x].start -runStartOffset), pendingReads[x].length );
+        }
+        for( size_t x = runStart; x < runEnd; x++ )
+        {
+            pendingReads[x].request->succeeded = runSucceeded;
+            pendingReads[x].request->bytes_read = runSucceeded ? pendingReads[x].length : 0;
+        }
+        allSucceeded = allSucceeded && runSucceeded;
+        
+        runStart = runEnd;
+    }
+    
+    return allSucceeded;
+}
+
+
+bool    file_disk::scan( const scan_callback& inCallback, size_t inWindowSize )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_read );
+    trace_scope     traced( mTrace, mTraceDepth, trace_scan, nullptr, 0, inWindowSize );
+    
+    if( !load_whole_map() )
+        return false;
+    
+    std::vector<const file_node*>   onDisk;
+    onDisk.reserve( mFileMap.size() );
+    for( const auto& currNodeEntry : mFileMap )
+    {
+        const file_node&    currNode = currNodeEntry.second;
+        if( currNodeEntry.first.compare(MAP_BLOCK_FILENAME) == 0 )
+            continue;
+        if( currNode.cached_data() || currNode.logical_size() == 0 ) // Inline, or not written yet? Nothing to read.
+        {
+            if( !inCallback( currNodeEntry.first, currNode.cached_data(), currNode.logical_size() ) )
+                return true;
+        }
+        else
+            onDisk.push_back( &currNode );
+    }
+    std::sort( onDisk.begin(), onDisk.end(), []( const file_node* inA, const file_node* inB ) { return inA->start_offset() < inB->start_offset(); } );
+    
+    std::vector<char>   window;
+    for( size_t runStart = 0; runStart < onDisk.size(); )
+    {
+        // Read as many neighboring blocks as fit in the window (a block larger than the
+        //  window gets read on its own):
+        uint64_t    runStartOffset = onDisk[runStart]->start_offset();
+        uint64_t    runEndOffset = runStartOffset +onDisk[runStart]->logical_size();
+        size_t      runEnd = runStart +1;
+        while( runEnd < onDisk.size()
+                && onDisk[runEnd]->start_offset() <= runEndOffset +max_coalesce_gap
+                && (std::max( runEndOffset, onDisk[runEnd]->start_offset() +onDisk[runEnd]->logical_size() ) -runStartOffset) <= inWindowSize )
+        {
+            runEndOffset = std::max( runEndOffset, onDisk[runEnd]->start_offset() +onDisk[runEnd]->logical_size() );
+            runEnd++;
+        }
+        
+        window.resize( runEndOffset -runStartOffset );
+        mMetrics.add( counter_cache_misses, runEnd -runStart );
+        if( !read_at( runStartOffset, window.data(), window.size() ) )
+            return false;
+        for( size_t x = runStart; x < runEnd; x++ )
+        {
+            char*   data = window.data() +(onDisk[x]->start_offset() -runStartOffset);
+            if( (onDisk[x]->flags() & file_node::is_encrypted)
+                && (!mCipher || !mCipher->decrypt( data, data, onDisk[x]->logical_size(), onDisk[x]->name(), onDisk[x]->nonce(), onDisk[x]->tag() )) )
+                return false;
+            if( !inCallback( onDisk[x]->name(), data, onDisk[x]->logical_size() ) )
+                return true;
+        }
+        
+        runStart = runEnd;
+    }
+    
+    return true;
+}
+
+
+bool    file_disk::is_valid()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    if( !load_whole_map() )
+        return false;
+    
+    bool                    foundMapBlock = false;
+    index_set<uint64_t>     occupiedByteRanges;
+    std::set<uint64_t>      seenHashedBlocks;
+    for( const auto& currNodeEntry : mFileMap )
+    {
+        const file_node& currNode = currNodeEntry.second;
+        
+        if( currNode.physical_size() < currNode.logical_size() && (currNode.flags() & file_node::is_inline) == 0 )
+            return false;
+        if( (currNode.start_offset() +currNode.physical_size()) > mFileSize )
+            return false;
+        if( currNode.start_offset() == mMapOffset && currNode.name().compare(MAP_BLOCK_FILENAME) == 0 )
+            foundMapBlock = true;
+        if( currNode.physical_size() == 0 )
+            continue;   // Empty file, doesn't occupy anything.
+        if( (currNode.flags() & file_node::has_content_hash) && !seenHashedBlocks.insert( currNode.start_offset() ).second )
+            continue;   // Deduplicated, we already counted this block for another file.
+        
+        if( occupiedByteRanges.append( currNode.start_offset() +1, currNode.start_offset() + currNode.physical_size() ) != index_set<uint64_t>::does_not_exist )
+            return false;   // Some blocks overlap :-o
+    }
+    
+    if( !foundMapBlock )
+        return false;
+    
+    for( const file_node& currNode : mFreeBlocks )
+    {
+        if( currNode.physical_size() < currNode.logical_size() )
+            return false;
+        if( (currNode.start_offset() +currNode.physical_size()) > mFileSize )
+            return false;
+        
+        if( occupiedByteRanges.append( currNode.start_offset() +1, currNode.start_offset() + currNode.physical_size() ) != index_set<uint64_t>::does_not_exist )
+            return false;   // Some blocks overlap :-o
+    }
+    
+    // The totals statistics() reports must match what's actually there:
+    statistics_state    recounted;
+    count_all( recounted );
+    if( memcmp( &recounted.totals, &mStatistics.totals, sizeof(recounted.totals) ) != 0
+        || recounted.index_entry_bytes != mStatistics.index_entry_bytes
+        || recounted.free_block_sizes != mStatistics.free_block_sizes )
+        return false;
+    
+    return true;
+}
+
+
+bool    file_disk::delete_file( const char* inFileName )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_delete );
+    trace_scope     traced( mTrace, mTraceDepth, trace_delete, inFileName );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    if( mInBatch )
+        return stage_change( batch_change::remove, inFileName, nullptr, 0, 0 );
+    if( inFileName[0] == 0 )
+        return false; // Can't delete the file map.
+    
+    auto fileItty = mFileMap.find(inFileName);
+    if( fileItty == mFileMap.end() )
+        return false;
+    
+    // Get rid of RAM data for this node and
+    //  move it to the free list:
+    file_node&  nodeToDelete = fileItty->second;
+    discard_cached_data( nodeToDelete );
+    release_block( nodeToDelete );  // If other files still use the block, this leaves us without one.
+    count_node( nodeToDelete, -1 );
+    nodeToDelete.set_flags( file_node::is_free );
+    nodeToDelete.set_name("");
+    if( nodeToDelete.physical_size() > 0 )
+    {
+        mFreeBlocks.push_back( nodeToDelete );
+        count_node( nodeToDelete, 1 );
+    }
+    mFileMap.erase( fileItty );
+    mTombstones[inFileName] = mGeneration +1;
+    mChangedSinceCommit = true;
+    mMapFlags |= map_needs_rewrite;
+    
+    return true;
+}
+
+
+bool    file_disk::list_files( std::vector<std::string>* outFileNames )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_list );
+    
+    if( !load_whole_map() )
+        return false;
+    
+    outFileNames->clear();
+    outFileNames->reserve( mFileMap.size() );
+    for( const auto& currNodeEntry : mFileMap )
+    {
+        if( currNodeEntry.first.compare(MAP_BLOCK_FILENAME) != 0 )
+            outFileNames->push_back( currNodeEntry.first );
+    }
+    
+    return true;
+}
+
+
+bool    file_disk::begin_batch()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_begin_batch );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    if( mInBatch )
+        return false;   // No nested batches.
+    
+    // Blocks freed by changes since the last write() are still used by the map on disk,
+    //  so commit() mustn't reuse them. Commit them now, so all free blocks are safe:
+    if( (mMapFlags != 0 || mChangedSinceCommit) && !write() )
+        return false;
+    
+    mInBatch = true;
+    
+    return true;
+}
+
+
+bool    file_disk::batch_has_file( const std::string& inFileName ) const
+{
+    auto    changeItty = mBatch.find( inFileName );
+    if( changeItty != mBatch.end() )
+        return changeItty->second.mode != batch_change::remove;
+    
+    return mFileMap.find( inFileName ) != mFileMap.end();
+}
+
+
+bool    file_disk::stage_change( batch_change::kind inMode, const std::string& inFileName, char* inData, size_t dataSize, size_t blockSize )
+{
+    if( inFileName.size() == 0 )
+        return false; // Can't change the file map.
+    if( batch_has_file( inFileName ) != (inMode != batch_change::add) )
+        return false; // Adding a file that exists, or changing/deleting one that doesn't.
+    
+    auto    changeItty = mBatch.find( inFileName );
+    if( changeItty == mBatch.end() )
+    {
+        batch_change    newChange = { inMode, inData, dataSize, blockSize };
+        mBatch[inFileName] = newChange;
+        return true;
+    }
+    
+    // Combine with what the batch already does to this file:
+    batch_change&   theChange = changeItty->second;
+    if( theChange.data )
+        delete [] theChange.data;
+    theChange.data = inData;
+    theChange.data_size = dataSize;
+    if( inMode == batch_change::add )           // Deleted, then re-added: Replaces the old file, with the new block size.
+    {
+        theChange.mode = batch_change::set;
+        theChange.block_size = blockSize;
+    }
+    else if( inMode == batch_change::remove && theChange.mode == batch_change::add )  // Added, then deleted: Nothing to do.
+        mBatch.erase( changeItty );
+    else if( inMode == batch_change::remove )
+        theChange.mode = batch_change::remove;
+    
+    return true;
+}
+
+
+bool    file_disk::commit()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_commit );
+    
+    if( !mInBatch )
+        return false;
+    mInBatch = false;
+    
+    // Make sure every change still applies before making any, so the batch is applied
+    //  completely or not at all:
+    for( const auto& currChange : mBatch )
+    {
+        bool    fileExists = mFileMap.find( currChange.first ) != mFileMap.end();
+        if( fileExists != (currChange.second.mode != batch_change::add) )
+        {
+            abort();
+            return false;
+        }
+    }
+    
+    // Blocks freed while applying the batch are still used by the map on disk, so
+    //  only reuse ones that were already free (begin_batch() committed everything before):
+    mCommittingBatch = true;
+    mReusableFreeBlocks.clear();
+    for( const file_node& currNode : mFreeBlocks )
+        mReusableFreeBlocks.insert( currNode.start_offset() );
+    size_t  fileSizeBefore = mFileSize;
+    size_t  dirtyBytesBefore = mDirtyBytes;
+    
+    bool    succeeded = true;
+    for( auto& currChange : mBatch )
+    {
+        batch_change&   theChange = currChange.second;
+        if( theChange.mode == batch_change::add )
+            succeeded = add_file( currChange.first.c_str(), theChange.data, theChange.data_size, theChange.block_size );
+        else if( theChange.mode == batch_change::set && theChange.block_size > 0 )  // Re-added with a block size, which only add_file() takes.
+            succeeded = delete_file( currChange.first.c_str() ) && add_file( currChange.first.c_str(), theChange.data, theChange.data_size, theChange.block_size );
+        else if( theChange.mode == batch_change::set )
+        {
+            // Don't overwrite the old contents in place, give it a new block:
+            file_node&  theNode = mFileMap[currChange.first];
+            release_block( theNode );
+            free_block_of_node( theNode );
+            succeeded = set_file_contents( currChange.first.c_str(), theChange.data, theChange.data_size );
+        }
+        else
+            succeeded = delete_file( currChange.first.c_str() );
+        if( !succeeded )
+            break;
+        theChange.data = nullptr;   // File owns it now.
+    }
+    
+    if( succeeded )
+    {
+        // Same for the map, write the new one somewhere else, then switch over to it by
+        //  writing the header:
+        auto    mapItty = mFileMap.find( MAP_BLOCK_FILENAME );
+        if( mapItty != mFileMap.end() )
+            free_block_of_node( mapItty->second );
+        mMapFlags |= map_needs_rewrite;
+        succeeded = write();
+    }
+    
+    mCommittingBatch = false;
+    mReusableFreeBlocks.clear();
+    if( !succeeded )
+    {
+        // The map on disk is still the one from begin_batch(), go back to that:
+        abort();    // Frees the data of changes we didn't get to.
+        mFileMap.clear();
+        mFreeBlocks.clear();
+        mFileSize = fileSizeBefore;
+        mDirtyBytes = dirtyBytesBefore;
+        mMapFlags = 0;
+        load_map();
+        return false;
+    }
+    mBatch.clear();
+    
+    return true;
+}
+
+
+void    file_disk::abort()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    trace_scope     traced( mTrace, mTraceDepth, trace_abort );
+    
+    for( auto& currChange : mBatch )
+    {
+        if( currChange.second.data )
+            delete [] currChange.second.data;
+    }
+    mBatch.clear();
+    mInBatch = false;
+}
+
+
+bool    file_disk::compact()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    metrics_timer   timer( mMetrics, op_compact );
+    trace_scope     traced( mTrace, mTraceDepth, trace_compact );
+    
+    if( mOpenFlags & read_only )
+        return false;
+    
+    // Generate a unique file name for the temp file in which we'll
+    //  write the compacted version of our file:
+    string      compactedPath(mFilePath);
+    size_t      x = 1;
+    while( true )
+    {
+        stringstream          uniquedPath;
+        uniquedPath << compactedPath << "." << x;
+        if( !ifstream(uniquedPath.str().c_str()).is_open() )  // File doesn't exist yet?
+        {
+            compactedPath = uniquedPath.str();
+            break;
+        }
+        if( x == 0 )    // Number wrapped? Means we couldn't find a file name.
+            return false;   // ABORT! ABORT!
+        x++;
+    }
+    
+    if( !write_copy( compactedPath ) )
+    {
+        remove( compactedPath.c_str() );
+        return false;
+    }
+    
+    // Now close the old file and then delete it, then rename the new file
+    //  to the old name:
+    mFile.close();
+    if( mFileDescriptor >= 0 )
+        close( mFileDescriptor );
+    mFileDescriptor = -1;
+    if( mDirectFileDescriptor >= 0 )
+        close( mDirectFileDescriptor );
+    mDirectFileDescriptor = -1;
+    remove( mFilePath.c_str() );
+    rename( compactedPath.c_str(), mFilePath.c_str() );
+    
+    mFileMap.clear();
+    mFreeBlocks.clear();
+    mDirtyBytes = 0;
+    
+    return open_file( mFilePath, mOpenFlags );
+}
+
+
+// Copies the first inNumBytes of inFromFD to the empty file inToFD, sharing the disk blocks
+//  between both files if the file system can do that, so it doesn't matter how large they are:
+static bool copy_file_data( int inFromFD, int inToFD, uint64_t inNumBytes )
+{
+#if defined(FICLONE)
+    if( ioctl( inToFD, FICLONE, inFromFD ) == 0 )
+        return true;
+#endif
+    
+    uint64_t    numCopied = 0;
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    // Can still share blocks on some file systems, or copy on the server for network volumes, and
+    //  at least doesn't have to copy everything into our memory and back:
+    loff_t      fromOffset = 0, toOffset = 0;
+    while( numCopied < inNumBytes )
+    {
+        ssize_t     numBytes = copy_file_range( inFromFD, &fromOffset, inToFD, &toOffset, (size_t) std::min( inNumBytes -numCopied, (uint64_t) SSIZE_MAX ), 0 );
+        if( numBytes <= 0 )
+            break;  // Not supported between these files, do the rest ourselves.
+        numCopied += numBytes;
+    }
+#elif __APPLE__
+    if( fcopyfile( inFromFD, inToFD, nullptr, COPYFILE_DATA ) == 0 )
+        return true;
+#endif
+    
+    std::vector<char>   buffer( 1024 * 1024 );
+    while( numCopied < inNumBytes )
+    {
+        ssize_t     numBytes = pread( inFromFD, buffer.data(), (size_t) std::min( inNumBytes -numCopied, (uint64_t) buffer.size() ), (off_t) numCopied );
+        if( numBytes <= 0 || pwrite( inToFD, buffer.data(), numBytes, (off_t) numCopied ) != numBytes )
+            return false;
+        numCopied += numBytes;
+    }
+    
+    return true;
+}
+
+
+bool    file_disk::clone_to( const std::string& inPath )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    // Changes that haven't been committed go into the clone as well, but a batch
+    //  can't be half-committed:
+    if( mInBatch || mFileDescriptor < 0 || inPath == mFilePath )
+        return false;
+    if( !(mOpenFlags & read_only) && !write() )
+        return false;
+    mFile.flush();
+    if( mFile.fail() )
+        return false;
+    
+    struct stat     fileInfo = {};
+    if( fstat( mFileDescriptor, &fileInfo ) != 0 )
+        return false;
+    
+#if __APPLE__
+    remove( inPath.c_str() );   // clonefile() doesn't replace existing files.
+    if( clonefile( mFilePath.c_str(), inPath.c_str(), 0 ) == 0 )
+        return true;
+#endif
+    int     cloneFD = ::open( inPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, fileInfo.st_mode & 0777 );
+    if( cloneFD < 0 )
+        return false;
+    bool    succeeded = copy_file_data( mFileDescriptor, cloneFD, fileInfo.st_size );
+    if( close( cloneFD ) != 0 )
+        succeeded = false;
+    if( !succeeded )
+        remove( inPath.c_str() );
+    
+    return succeeded;
+}
+
+
+uint64_t    file_disk::generation()
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    return mGeneration;
+}
+
+
+bool    file_disk::changes_since( uint64_t inGeneration, std::vector<file_change>* outChanges )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    outChanges->clear();
+    if( mInBatch || (!(mOpenFlags & read_only) && !write()) || !load_whole_map() )
+        return false;
+    
+    for( const auto& currNodeEntry : mFileMap )
+    {
+        if( currNodeEntry.second.generation() > inGeneration && currNodeEntry.first != MAP_BLOCK_FILENAME )
+        {
+            file_change     newChange = { currNodeEntry.first, currNodeEntry.second.generation(), false };
+            outChanges->push_back( newChange );
+        }
+    }
+    for( const auto& currTombstone : mTombstones )
+    {
+        if( currTombstone.second > inGeneration )
+        {
+            file_change     newChange = { currTombstone.first, currTombstone.second, true };
+            outChanges->push_back( newChange );
+        }
+    }
+    std::sort( outChanges->begin(), outChanges->end(), []( const file_change& inA, const file_change& inB ) { return inA.name < inB.name; } );
+    
+    return true;
+}
+
+
+bool    file_disk::write_delta( uint64_t inGeneration, std::ostream& outDelta )
 {
-    bool                    foundMapBlock = false;
-    index_set<uint64_t>     occupiedByteRanges;
-    for( auto currNodeEntry : mFileMap )
-    {
-        const file_node& currNode = currNodeEntry.second;
-        
-        if( currNode.physical_size() < 1 )
-            return false;
-        if( currNode.physical_size() < currNode.logical_size() )
-            return false;
-        if( (currNode.start_offset() +currNode.physical_size()) > mFileSize )
-            return false;
-        if( currNode.start_offset() == mMapOffset )
-            foundMapBlock = true;
-        
-        if( occupiedByteRanges.append( currNode.start_offset() +1, currNode.start_offset() + currNode.physical_size() ) != index_set<uint64_t>::does_not_exist )
-            return false;   // Some blocks overlap :-o
-    }
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
     
-    if( !foundMapBlock )
+    std::vector<file_change>    changes;
+    if( !changes_since( inGeneration, &changes ) )
         return false;
     
-    for( auto currNode : mFreeBlocks )
+    write_le( outDelta, DELTA_FORMAT_VERSION );
+    write_le( outDelta, inGeneration );
+    write_le( outDelta, mGeneration );
+    std::vector<char>   buffer;
+    for( const file_change& currChange : changes )
     {
-        if( currNode.physical_size() < currNode.logical_size() )
+        outDelta.put( currChange.deleted ? delta_delete : delta_upsert );
+        write_varint( outDelta, currChange.name.size() );
+        outDelta.write( currChange.name.data(), currChange.name.size() );
+        if( currChange.deleted )
+            continue;
+        
+        // One file at a time, so we don't need more RAM than the largest file:
+        const file_node*    theNode = find_node( currChange.name );
+        if( !theNode )
             return false;
-        if( (currNode.start_offset() +currNode.physical_size()) > mFileSize )
+        buffer.resize( theNode->logical_size() );
+        if( buffer.size() > 0 && !pread( currChange.name.c_str(), 0, buffer.size(), buffer.data() ) )
+            return false;
+        write_varint( outDelta, buffer.size() );
+        outDelta.write( buffer.data(), buffer.size() );
+        if( outDelta.fail() )
             return false;
-        
-        if( occupiedByteRanges.append( currNode.start_offset() +1, currNode.start_offset() + currNode.physical_size() ) != index_set<uint64_t>::does_not_exist )
-            return false;   // Some blocks overlap :-o
     }
+    outDelta.put( delta_end );
     
-    return true;
+    return !outDelta.fail();
 }
 
 
-bool    file_disk::delete_file( const char* inFileName )
+bool    file_disk::apply_delta( std::istream& inDelta )
 {
-    if( inFileName[0] == 0 )
-        return false; // Can't delete the file map.
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
     
-    auto fileItty = mFileMap.find(inFileName);
-    if( fileItty == mFileMap.end() )
+    if( (mOpenFlags & read_only) || mInBatch || !write() )  // Our own changes need a generation of their own.
         return false;
     
-    // Get rid of RAM data for this node and
-    //  move it to the free list:
-    file_node&  nodeToDelete = fileItty->second;
-    if( nodeToDelete.cached_data() )
+    uint32_t    version = 0;
+    uint64_t    fromGeneration = 0, toGeneration = 0;
+    if( !read_le( inDelta, &version ) || !read_le( inDelta, &fromGeneration ) || !read_le( inDelta, &toGeneration ) )
+        return false;
+    if( (version & 0xffffff00) != (DELTA_FORMAT_VERSION & 0xffffff00) || fromGeneration > mGeneration || fromGeneration > toGeneration )
+        return false;   // Not a delta we understand, or we're missing the changes before it.
+    
+    if( !begin_batch() )
+        return false;
+    bool    succeeded = true;
+    while( succeeded )
+    {
+        int         kind = inDelta.get();
+        uint64_t    nameLength = 0;
+        if( kind == delta_end )
+            break;
+        if( (kind != delta_upsert && kind != delta_delete) || !read_varint( inDelta, &nameLength ) || nameLength > (1 << 30) )
+        {
+            succeeded = false;  // Damaged or truncated.
+            break;
+        }
+        std::string     fileName( nameLength, '\0' );
+        inDelta.read( &fileName[0], nameLength );
+        if( kind == delta_delete )
+        {
+            if( inDelta && batch_has_file( fileName ) )    // We may have been past the generation it was deleted in already.
+                succeeded = delete_file( fileName.c_str() );
+            else
+                succeeded = !inDelta.fail();
+            continue;
+        }
+        
+        uint64_t    dataSize = 0;
+        if( !inDelta || !read_varint( inDelta, &dataSize ) || dataSize > SIZE_MAX )
+        {
+            succeeded = false;
+            break;
+        }
+        std::vector<char>   contents;
+        while( contents.size() < dataSize && inDelta )
+        {
+            size_t  chunkSize = (size_t)std::min( dataSize -contents.size(), (uint64_t)DELTA_READ_CHUNK_SIZE );
+            contents.resize( contents.size() +chunkSize );
+            inDelta.read( contents.data() +contents.size() -chunkSize, chunkSize );
+        }
+        if( !inDelta )
+        {
+            succeeded = false;
+            break;
+        }
+        char*   data = new char[dataSize];
+        std::copy( contents.begin(), contents.end(), data );
+        succeeded = batch_has_file( fileName ) ? set_file_contents( fileName.c_str(), data, dataSize ) : add_file( fileName.c_str(), data, dataSize );
+        if( !succeeded )
+            delete [] data;
+    }
+    if( !succeeded || toGeneration <= mGeneration )   // Failed, or nothing in it that we don't have.
     {
-        delete [] nodeToDelete.cached_data();
-        nodeToDelete.set_cached_data( nullptr );
+        abort();
+        return succeeded;
+    }
+    
+    // Give the changes, and thus the commit, the sender's generation:
+    uint64_t    previousGeneration = mGeneration;
+    mGeneration = toGeneration -1;
+    mChangedSinceCommit = true;
+    if( !commit() )
+    {
+        mGeneration = previousGeneration;
+        return false;
     }
-    nodeToDelete.set_flags( file_node::is_free );
-    nodeToDelete.set_name("");
-    mFreeBlocks.push_back( nodeToDelete );
-    mFileMap.erase( fileItty );
-    mMapFlags |= map_needs_rewrite;
     
     return true;
 }
 
 
-bool    file_disk::compact()
+void    file_disk::forget_deletions_before( uint64_t inGeneration )
 {
-    // Generate a unique file name for the temp file in which we'll
-    //  write the compacted version of our file:
-    string      compactedPath(mFilePath);
-    size_t      x = 1;
-    while( true )
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    for( auto itty = mTombstones.begin(); itty != mTombstones.end(); )
     {
-        stringstream          uniquedPath;
-        uniquedPath << compactedPath << "." << x;
-        if( !ifstream(uniquedPath.str().c_str()).is_open() )  // File doesn't exist yet?
+        if( itty->second < inGeneration )
         {
-            compactedPath = uniquedPath.str();
-            break;
+            itty = mTombstones.erase( itty );
+            mMapFlags |= map_needs_rewrite;
         }
-        if( x == 0 )    // Number wrapped? Means we couldn't find a file name.
-            return false;   // ABORT! ABORT!
-        x++;
+        else
+            itty++;
     }
+}
+
+
+bool    file_disk::write_copy( const std::string& inPath )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
     
-    fstream                 compactedFile( compactedPath.c_str(), ios::binary | ios::out | ios::trunc );
+    fstream                 compactedFile( inPath.c_str(), ios::binary | ios::out | ios::trunc );
     std::vector<file_node>  compactedBlocks;
+    std::vector<file_node>  paddingBlocks;  // Kept separately so they don't break up the name prefixes in the map.
+    std::map<uint64_t,uint64_t> movedHashedBlocks;  // Old start offset -> new start offset, so shared blocks stay shared.
+    if( !compactedFile.is_open() )
+        return false;
     
     // Write file header (version & map offset):
-    uint32_t        version = 0x00000101;
+    uint32_t        version = FILE_FORMAT_VERSION;
     uint64_t        mapOffset = sizeof(mapOffset) +sizeof(version);
-    uint64_t        mapSize = sizeof(uint64_t);
-    compactedFile.seekp(0, ios::beg);
-    compactedFile.write( (char*)&version, sizeof(version) );
-    compactedFile.write( (char*)&mapOffset, sizeof(mapOffset) );
-    
-    // Now loop over all blocks and write out their data. We create a
-    //  second block map during this with the new offsets in it.
-    //  We also calculate the size the map will need for these blocks
-    //  and advance the mapOffset offset so it will point right after
-    //  the last block's data.
-    for( auto currNodeEntry : mFileMap )
+    write_le( compactedFile, version );
+    write_le( compactedFile, mapOffset );
+    
+    // Now loop over all blocks in the order they're on disk and write out their
+    //  data, so we read and write sequentially. We create a second block map
+    //  during this with the new offsets in it. We also advance the mapOffset
+    //  offset so it will point right after the last block's data.
+    bool    scanned = scan( [&]( const std::string& inFileName, const char* inData, size_t inDataSize )
     {
-        if( currNodeEntry.second.name().compare(MAP_BLOCK_FILENAME) == 0 )    // Skip the map, we'll add a new one.
-            continue;
+        const file_node&    theNode = mFileMap.find( inFileName )->second;
+        if( theNode.flags() & file_node::is_inline )   // Data goes in the map.
+        {
+            compactedBlocks.push_back( theNode );
+            return true;
+        }
         
-        if( currNodeEntry.second.cached_data() != nullptr )
+        bool    isHashed = (theNode.flags() & file_node::has_content_hash) != 0 && !mCipher;   // Each file gets its own encrypted copy.
+        auto    movedItty = movedHashedBlocks.find( theNode.start_offset() );
+        if( isHashed && movedItty != movedHashedBlocks.end() )    // Another file already copied this block.
         {
-            compactedFile.write( currNodeEntry.second.cached_data(), currNodeEntry.second.logical_size() );
-            delete [] currNodeEntry.second.cached_data();
-            currNodeEntry.second.set_cached_data( nullptr );
+            file_node currNode = theNode;
+            currNode.set_start_offset( movedItty->second );
+            currNode.set_physical_size( currNode.logical_size() );
+            compactedBlocks.push_back( currNode );
+            return true;
         }
-        else
+        
+        if( (mapOffset % mDataAlignment) != 0 )    // Pad so the block starts aligned, and remember the padding as a free block.
+        {
+            file_node   paddingNode;
+            paddingNode.set_start_offset( mapOffset );
+            paddingNode.set_physical_size( mDataAlignment -(mapOffset % mDataAlignment) );
+            paddingNode.set_logical_size( paddingNode.physical_size() );
+            paddingNode.set_flags( file_node::is_free );
+            std::vector<char>   zeroes( paddingNode.physical_size(), 0 );
+            compactedFile.write( zeroes.data(), zeroes.size() );
+            paddingBlocks.push_back( paddingNode );
+            mapOffset += paddingNode.physical_size();
+        }
+        
+        file_node           currNode = theNode;
+        const char*         data = inData;
+        std::vector<char>   encryptedData;
+        if( mCipher )   // Re-encrypt with a new nonce, as the data may have been changed since it was last encrypted.
         {
-            size_t  numBytes = currNodeEntry.second.logical_size();
-            mFile.seekg( currNodeEntry.second.start_offset(), ios::beg );
-            for( size_t x = 0; x < numBytes; x++ )
+            encryptedData.resize( inDataSize );
+            if( !mCipher->encrypt( inData, encryptedData.data(), inDataSize, inFileName, currNode.nonce(), currNode.tag() ) )
             {
-                char    theCh = 0;
-                mFile.read( &theCh, sizeof(theCh) );
-                compactedFile.write( &theCh, sizeof(theCh) );
+                compactedFile.setstate( ios::failbit ); // So we notice scan() stopped early.
+                return false;
             }
+            currNode.set_flags( (currNode.flags() | file_node::is_encrypted) & ~file_node::has_content_hash );
+            data = encryptedData.data();
         }
+        compactedFile.write( data, inDataSize );
+        mMetrics.add( counter_bytes_written, inDataSize );
         
-        file_node currNode = currNodeEntry.second;
+        if( isHashed )
+            movedHashedBlocks[theNode.start_offset()] = mapOffset;
         currNode.set_start_offset( mapOffset );
         currNode.set_physical_size( currNode.logical_size() );
+        currNode.set_flags( currNode.flags() & ~file_node::data_dirty );
         compactedBlocks.push_back( currNode );
         mapOffset += currNode.logical_size();
-        mapSize += currNode.node_size_on_disk();
-    }
+        
+        return compactedFile.good();
+    } );
+    if( !scanned || !compactedFile.good() )
+        return false;
     
-    // Now build a node entry representing the area occupied by the map:
+    // Now build a node entry representing the area occupied by the map. The map's
+    //  name sorts first, so it goes first, followed by the blocks in name order,
+    //  then the padding. Apart from name, all other fields are constant length, so
+    //  we can determine the size now and immediately assign it to mapNode's fields:
+    std::sort( compactedBlocks.begin(), compactedBlocks.end(), []( const file_node& inA, const file_node& inB ) { return inA.name() < inB.name(); } );
     file_node   mapNode;
     mapNode.set_name( MAP_BLOCK_FILENAME );
-    mapSize += mapNode.node_size_on_disk(); // Apart from name, all other fields are constant length, so we can determine the size now and immediately assign it to mapNode's fields.
-    mapNode.set_start_offset( mapOffset );
-    mapNode.set_logical_size( mapSize );
-    mapNode.set_physical_size( mapSize );
-    compactedBlocks.push_back( mapNode );
+    compactedBlocks.insert( compactedBlocks.begin(), mapNode );
+    compactedBlocks.insert( compactedBlocks.end(), paddingBlocks.begin(), paddingBlocks.end() );
+    for( const auto& currTombstone : mTombstones )
+        compactedBlocks.push_back( tombstone_node( currTombstone.first, currTombstone.second ) );
+    // The map doesn't move, so we also know where each entry will end up in it, which
+    //  we need for the name index to point at the data of is_inline files:
+    uint64_t    mapSize = MAP_HEADER_SIZE;
+    std::string previousName;
+    std::vector<index_entry>    indexEntries;
+    size_t      indexEntryBytes = 0;
+    for( const file_node& currNode : compactedBlocks )
+    {
+        mapSize += currNode.node_size_on_disk( previousName );
+        previousName = currNode.name();
+        if( currNode.name() != MAP_BLOCK_FILENAME && (currNode.flags() & (file_node::is_free | file_node::is_deleted)) == 0 )
+        {
+            index_entry newEntry = { currNode.name(), (currNode.flags() & file_node::is_inline) ? (mapOffset +mapSize -currNode.logical_size()) : currNode.start_offset(), currNode.logical_size(), 0 };
+            indexEntries.push_back( newEntry );
+            indexEntryBytes += index_entry_size( currNode.name() );
+        }
+    }
+    uint64_t    indexOffset = mapOffset +mapSize;
+    uint64_t    numBuckets = index_bucket_count( indexEntries.size() );
+    mapSize += index_size_on_disk( indexEntries.size(), indexEntryBytes );
+    compactedBlocks[0].set_start_offset( mapOffset );
+    compactedBlocks[0].set_logical_size( mapSize );
+    compactedBlocks[0].set_physical_size( mapSize );
     
-    // Now write out the map as a count + node entries:
+    // Now write out the map as a count, the index position, node entries and the index:
     uint64_t numBlocks = compactedBlocks.size();
-    compactedFile.write( (char*) &numBlocks, sizeof(numBlocks) );
+    write_le( compactedFile, numBlocks );
+    write_le( compactedFile, indexOffset );
+    write_le( compactedFile, numBuckets );
+    write_le( compactedFile, mChangedSinceCommit ? (mGeneration +1) : mGeneration );  // Uncommitted changes are in the copy.
+    previousName.clear();
     for( const file_node& currNode : compactedBlocks )
     {
-        currNode.write( compactedFile );
+        currNode.write( compactedFile, previousName );
     }
+    write_index( compactedFile, indexEntries );
     
     // Now write out the map offset:
     compactedFile.seekp( sizeof(uint32_t), ios::beg );
-    compactedFile.write( (char*) &mapOffset, sizeof(mapOffset) );
-
-    // Now close the old file and then delete it, then rename the new file
-    //  to the old name:
-    mFile.close();
-    remove( mFilePath.c_str() );
+    write_le( compactedFile, mapOffset );
     compactedFile.close();
-    rename( compactedPath.c_str(), mFilePath.c_str() );
     
-    mFileMap.clear();
-    mFreeBlocks.clear();
-    
-    return open( mFilePath );
+    return !compactedFile.fail();
 }
 
 
 bool   file_disk::statistics( struct stats* outStatistics )
 {
-    memset( outStatistics, 0, sizeof(struct stats) );
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    if( !load_whole_map() )
+        return false;
     
+    *outStatistics = mStatistics.totals;
     outStatistics->header_bytes = sizeof(uint32_t) +sizeof(uint64_t);
+    if( (mVersion & 0x000000ff) >= 0x05 )
+        outStatistics->index_bytes = index_size_on_disk( outStatistics->num_files, mStatistics.index_entry_bytes );
+    if( !mStatistics.free_block_sizes.empty() )
+        outStatistics->largest_free_block = *mStatistics.free_block_sizes.rbegin();
     
-    for( auto currNodeEntry : mFileMap )
+    return true;
+}
+
+
+void    file_disk::count_node( const file_node& inNode, int inDirection, statistics_state& ioState ) const
+{
+    // Totals may wrap around while a node is in an odd state (e.g. it has no block yet
+    //  but already has its data size), but adding and removing it again cancels out:
+    uint64_t        sign = (inDirection < 0) ? UINT64_MAX : 1;  // Multiplying by UINT64_MAX negates.
+    struct stats&   totals = ioState.totals;
+    std::string     name = inNode.name();
+    
+    totals.name_bytes += sign * name.size();
+    if( inNode.flags() & file_node::is_free )
     {
-        const file_node& currNode = currNodeEntry.second;
-        if( (currNode.flags() & file_node::is_free) != 0 )
-            cout << "Internal error: free block in used list." << endl;
-        if( currNode.name().compare(MAP_BLOCK_FILENAME) == 0 )
+        totals.free_bytes += sign * inNode.physical_size();
+        totals.free_block_count += sign;
+        uint64_t    holeStart = 0, holeEnd = 0;
+        if( (inNode.flags() & file_node::is_sparse) && hole_in_block( inNode, &holeStart, &holeEnd ) )
+            totals.sparse_bytes += sign * (holeEnd -holeStart);
+        if( inDirection > 0 )
+            ioState.free_block_sizes.insert( inNode.physical_size() );
+        else
         {
-            outStatistics->map_bytes = currNode.logical_size();
+            auto    sizeItty = ioState.free_block_sizes.find( inNode.physical_size() );
+            if( sizeItty != ioState.free_block_sizes.end() )
+                ioState.free_block_sizes.erase( sizeItty );
         }
+    }
+    else if( name.compare(MAP_BLOCK_FILENAME) == 0 )
+    {
+        totals.map_bytes += sign * inNode.logical_size();
+        totals.free_bytes += sign * (inNode.physical_size() -inNode.logical_size());
+    }
+    else
+    {
+        totals.num_files += sign;
+        ioState.index_entry_bytes += sign * index_entry_size( name );
+        if( inNode.flags() & file_node::is_inline )
+            totals.inline_bytes += sign * inNode.logical_size();
+        else if( inNode.flags() & file_node::has_content_hash )
+            totals.dedup_bytes += sign * inNode.logical_size(); // count_block() takes back one file's worth, as the block itself is used.
         else
         {
-            outStatistics->used_bytes += currNode.logical_size();
-            outStatistics->num_files ++;
+            totals.used_bytes += sign * inNode.logical_size();
+            totals.free_bytes += sign * (inNode.physical_size() -inNode.logical_size());
         }
-        outStatistics->name_bytes += currNode.name().size();
-        outStatistics->free_bytes += currNode.physical_size() -currNode.logical_size();
     }
-    for( auto currNode : mFreeBlocks )
+}
+
+
+void    file_disk::count_block( const hashed_block& inBlock, int inDirection, statistics_state& ioState ) const
+{
+    uint64_t        sign = (inDirection < 0) ? UINT64_MAX : 1;
+    ioState.totals.used_bytes += sign * inBlock.logical_size;
+    ioState.totals.dedup_bytes -= sign * inBlock.logical_size;
+    ioState.totals.free_bytes += sign * (inBlock.physical_size -inBlock.logical_size);
+}
+
+
+void    file_disk::count_all( statistics_state& outState ) const
+{
+    outState = statistics_state();
+    for( const auto& currNodeEntry : mFileMap )
+        count_node( currNodeEntry.second, 1, outState );
+    for( const file_node& currNode : mFreeBlocks )
+        count_node( currNode, 1, outState );
+    for( const auto& currBlock : mHashedBlocks )
+        count_block( currBlock.second, 1, outState );
+}
+
+
+bool    file_disk::metrics( struct metrics_snapshot* outMetrics )
+{
+    mMetrics.snapshot( outMetrics );
+    
+    return true;
+}
+
+
+bool    file_disk::read_at( uint64_t inOffset, char* outBuf, size_t inNumBytes )
+{
+    if( mDirectFileDescriptor >= 0 )
+        return direct_read_at( inOffset, outBuf, inNumBytes );
+    
+    note_seek( inOffset );
+    mFile.seekg( inOffset, ios::beg );
+    if( mFile.fail() || mFile.bad() )
+        return false;
+    mFile.read( outBuf, inNumBytes );
+    if( mFile.fail() || mFile.bad() )
+        return false;
+    mIOPosition = inOffset +inNumBytes;
+    mMetrics.add( counter_bytes_read, inNumBytes );
+    note_read( inOffset, inNumBytes );
+    
+    return true;
+}
+
+
+bool    file_disk::write_at( uint64_t inOffset, const char* inBuf, size_t inNumBytes )
+{
+    if( mDirectFileDescriptor >= 0 )
+        return direct_write_at( inOffset, inBuf, inNumBytes );
+    
+    note_seek( inOffset );
+    mFile.seekp( inOffset, ios::beg );
+    if( mFile.fail() || mFile.bad() )
+        return false;
+    mFile.write( inBuf, inNumBytes );
+    if( mFile.fail() || mFile.bad() )
+        return false;
+    mIOPosition = inOffset +inNumBytes;
+    mMetrics.add( counter_bytes_written, inNumBytes );
+    
+    return true;
+}
+
+
+// Uncached I/O must start and end on sector boundaries and go to/from aligned
+//  memory, so we go through an aligned bounce buffer covering all affected sectors.
+struct aligned_buffer
+{
+    aligned_buffer( size_t inSize ) : mBytes(nullptr) { if( posix_memalign( (void**)&mBytes, file_disk::direct_io_alignment, inSize ) != 0 ) mBytes = nullptr; }
+    ~aligned_buffer()   { free( mBytes ); }
+    
+    char*   mBytes;
+};
+
+
+bool    file_disk::direct_read_at( uint64_t inOffset, char* outBuf, size_t inNumBytes )
+{
+    mFile.flush();  // Map entries are written through mFile's buffer, make sure the OS knows about them.
+    
+    uint64_t        alignedStart = inOffset -(inOffset % direct_io_alignment);
+    uint64_t        alignedEnd = ((inOffset +inNumBytes +direct_io_alignment -1) / direct_io_alignment) * direct_io_alignment;
+    aligned_buffer  bounceBuffer( alignedEnd -alignedStart );
+    if( !bounceBuffer.mBytes )
+        return false;
+    
+    note_seek( alignedStart );
+    ssize_t     amountRead = ::pread( mDirectFileDescriptor, bounceBuffer.mBytes, alignedEnd -alignedStart, alignedStart );
+    if( amountRead < 0 || (uint64_t)amountRead < (inOffset -alignedStart) +inNumBytes )
+        return false;   // Error, or read past the end of the file.
+    memcpy( outBuf, bounceBuffer.mBytes +(inOffset -alignedStart), inNumBytes );
+    mIOPosition = alignedEnd;
+    mMetrics.add( counter_bytes_read, amountRead );
+    
+    return true;
+}
+
+
+bool    file_disk::direct_write_at( uint64_t inOffset, const char* inBuf, size_t inNumBytes )
+{
+    mFile.flush();
+    
+    uint64_t        alignedStart = inOffset -(inOffset % direct_io_alignment);
+    uint64_t        alignedEnd = ((inOffset +inNumBytes +direct_io_alignment -1) / direct_io_alignment) * direct_io_alignment;
+    aligned_buffer  bounceBuffer( alignedEnd -alignedStart );
+    if( !bounceBuffer.mBytes )
+        return false;
+    
+    // If we only cover part of the first/last sector, we need to keep what else is in there:
+    memset( bounceBuffer.mBytes, 0, alignedEnd -alignedStart );
+    uint64_t    lastSectorStart = alignedEnd -direct_io_alignment;
+    bool        needFirstSector = (alignedStart != inOffset);
+    bool        needLastSector = ((inOffset +inNumBytes) != alignedEnd) && !(needFirstSector && lastSectorStart == alignedStart);
+    if( needFirstSector )
+    {
+        if( ::pread( mDirectFileDescriptor, bounceBuffer.mBytes, direct_io_alignment, alignedStart ) < 0 )
+            return false;
+        mMetrics.add( counter_bytes_read, direct_io_alignment );
+    }
+    if( needLastSector )
     {
-        if( (currNode.flags() & file_node::is_free) == 0 )
-            cout << "Internal error: used block in free list." << endl;
-        outStatistics->name_bytes += currNode.name().size();
-        outStatistics->free_bytes += currNode.physical_size();
+        if( ::pread( mDirectFileDescriptor, bounceBuffer.mBytes +(lastSectorStart -alignedStart), direct_io_alignment, lastSectorStart ) < 0 )
+            return false;
+        mMetrics.add( counter_bytes_read, direct_io_alignment );
+    }
+    memcpy( bounceBuffer.mBytes +(inOffset -alignedStart), inBuf, inNumBytes );
+    
+    note_seek( alignedStart );
+    ssize_t     amountWritten = ::pwrite( mDirectFileDescriptor, bounceBuffer.mBytes, alignedEnd -alignedStart, alignedStart );
+    if( amountWritten < 0 || (uint64_t)amountWritten != (alignedEnd -alignedStart) )
+        return false;
+    mIOPosition = alignedEnd;
+    mMetrics.add( counter_bytes_written, amountWritten );
+    
+    // The last sector may have been partially padding, but we don't want that to
+    //  count as part of the file, or open() would think the file is longer:
+    uint64_t    usedEnd = std::max( (uint64_t)mFileSize, inOffset +inNumBytes );
+    if( alignedEnd > usedEnd )
+    {
+        if( ftruncate( mDirectFileDescriptor, usedEnd ) != 0 )
+            return false;
     }
     
     return true;
 }
 
 
+void    file_disk::note_seek( uint64_t inOffset )
+{
+    if( inOffset != mIOPosition )   // fstream seeks for us anyway, but only count the ones that actually move the head.
+        mMetrics.add( counter_seeks, 1 );
+}
+
+
+void    file_disk::set_access_pattern( access_pattern inPattern )
+{
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    mAccessPattern = inPattern;
+    mSequentialReads = 0;
+    mReadAheadEnd = 0;
+    mReadAheadWindow = min_read_ahead;
+}
+
+
+void    file_disk::note_read( uint64_t inOffset, size_t inNumBytes )
+{
+    // Small skips forward (slack at the end of blocks, files we're not interested in) still count as sequential:
+    bool    isSequential = mLastReadEnd != UINT64_MAX && inOffset >= mLastReadEnd && (inOffset -mLastReadEnd) <= max_coalesce_gap;
+    mSequentialReads = isSequential ? (mSequentialReads +1) : 0;
+    mLastReadEnd = inOffset +inNumBytes;
+    
+    if( mAccessPattern == access_random || (mAccessPattern == access_normal && mSequentialReads < 2) )
+    {
+        mReadAheadEnd = 0;
+        mReadAheadWindow = min_read_ahead;
+        return;
+    }
+    if( mReadAheadEnd >= mLastReadEnd +(mReadAheadWindow / 2) )
+        return; // Still far enough ahead, don't bother the OS.
+    
+    uint64_t    startOffset = std::max( mReadAheadEnd, mLastReadEnd );
+    uint64_t    endOffset = std::min( mLastReadEnd +mReadAheadWindow, (uint64_t)mFileSize );
+    if( endOffset > startOffset && advise_will_need( startOffset, endOffset -startOffset ) )
+        mMetrics.add( counter_read_ahead_bytes, endOffset -startOffset );
+    mReadAheadEnd = endOffset;
+    mReadAheadWindow = std::min( mReadAheadWindow * 2, (uint64_t)max_read_ahead );
+}
+
+
+bool    file_disk::advise_will_need( uint64_t inOffset, uint64_t inNumBytes )
+{
+    if( mFileDescriptor < 0 )
+        return false;
+    
+    // Both of these just start reading into the OS's cache and return:
+#if __APPLE__
+    struct radvisory    advice = { (off_t)inOffset, (int)std::min( inNumBytes, (uint64_t)INT_MAX ) };
+    return fcntl( mFileDescriptor, F_RDADVISE, &advice ) != -1;
+#elif defined(POSIX_FADV_WILLNEED)
+    return posix_fadvise( mFileDescriptor, (off_t)inOffset, (off_t)inNumBytes, POSIX_FADV_WILLNEED ) == 0;
+#else
+    return false;
+#endif
+}
+
+
 void    file_disk::print( std::ostream& output )
 {
+    std::lock_guard<std::recursive_mutex>  lock(mLock);
+    
+    load_whole_map();
     output << "      Path: " << mFilePath << endl;
     output << " File size: " << mFileSize << endl;
     output << "Map Offset: " << mMapOffset << endl;
     output << " Map Flags: " << mMapFlags << endl;
     output << "   Version: " << hex << ((mVersion & 0xff00) >> 8) << "." << (mVersion & 0xff) << dec << endl;
+    output << "Generation: " << mGeneration << endl;
     int x = 0;
     for( auto currNodeEntry : mFileMap )
     {
@@ -637,7 +2712,8 @@ void    file_disk::print( std::ostream& output )
         output << "\t Start Offset: " << currNode.start_offset() << endl;
         output << "\t Logical Size: " << currNode.logical_size() << endl;
         output << "\tPhysical Size: " << currNode.physical_size() << endl;
-        output << "\t        Flags: " << ((currNode.flags() & file_node::data_dirty) ? "[data dirty] " : "") << ((currNode.flags() & file_node::offsets_dirty) ? "[offsets dirty] " : "") << ((currNode.flags() & file_node::name_dirty) ? "[name dirty] " : "") << ((currNode.flags() & file_node::is_free) ? "[free] " : "") << endl;
+        output << "\t   Generation: " << currNode.generation() << endl;
+        output << "\t        Flags: " << ((currNode.flags() & file_node::data_dirty) ? "[data dirty] " : "") << ((currNode.flags() & file_node::offsets_dirty) ? "[offsets dirty] " : "") << ((currNode.flags() & file_node::name_dirty) ? "[name dirty] " : "") << ((currNode.flags() & file_node::is_free) ? "[free] " : "") << ((currNode.flags() & file_node::has_content_hash) ? "[hashed] " : "") << ((currNode.flags() & file_node::is_inline) ? "[inline] " : "") << endl;
         
         x++;
     }
@@ -650,21 +2726,114 @@ void    file_disk::print( std::ostream& output )
         output << "\t        Flags: " << ((currNode.flags() & file_node::data_dirty) ? "[data dirty] " : "") << ((currNode.flags() & file_node::offsets_dirty) ? "[offsets dirty] " : "") << ((currNode.flags() & file_node::name_dirty) ? "[name dirty] " : "") << ((currNode.flags() & file_node::is_free) ? "[free] " : "") << endl;
         x++;
     }
+    for( const auto& currTombstone : mTombstones )
+    {
+        output << "[" << x << "] \"" << currTombstone.first << "\": [deleted]" << endl;
+        output << "\t   Generation: " << currTombstone.second << endl;
+        x++;
+    }
     output << endl;
 }
 
 
-bool    file_node::read( std::iostream& inFile )
+static size_t   shared_prefix_length( const std::string& inA, const std::string& inB )
+{
+    size_t  maxLength = std::min( inA.size(), inB.size() );
+    size_t  x = 0;
+    while( x < maxLength && inA[x] == inB[x] )
+        x++;
+    return x;
+}
+
+
+file_node&  file_node::operator =( const file_node& inOriginal )
 {
-    uint8_t     nameLen = 0;
+    if( this == &inOriginal )
+        return *this;
     
-    inFile.read( (char*)&nameLen, sizeof(nameLen) );
-    char        name[256] = {0};
-    inFile.read( name, nameLen );
-    inFile.read( (char*)&mStartOffs, sizeof(mStartOffs) );
-    inFile.read( (char*)&mLogicalSize, sizeof(mLogicalSize) );
-    inFile.read( (char*)&mPhysicalSize, sizeof(mPhysicalSize) );
-    inFile.read( (char*)&mFlags, sizeof(mFlags) );
+    char*   newData = nullptr;
+    if( inOriginal.mCachedData != nullptr )
+    {
+        newData = new char[inOriginal.mLogicalSize];
+        memcpy( newData, inOriginal.mCachedData, inOriginal.mLogicalSize );
+    }
+    if( mCachedData )
+        delete [] mCachedData;
+    mCachedData = newData;
+    mFlags = inOriginal.mFlags;
+    mStartOffs = inOriginal.mStartOffs;
+    mLogicalSize = inOriginal.mLogicalSize;
+    mPhysicalSize = inOriginal.mPhysicalSize;
+    mName = inOriginal.mName;
+    mReadOffs = 0;
+    mWriteOffs = 0;
+    mContentHash = inOriginal.mContentHash;
+    mGeneration = inOriginal.mGeneration;
+    memcpy( mNonce, inOriginal.mNonce, sizeof(mNonce) );
+    memcpy( mTag, inOriginal.mTag, sizeof(mTag) );
+    
+    return *this;
+}
+
+
+size_t  file_node::node_size_on_disk( const std::string& inPreviousName ) const
+{
+    size_t  prefixLength = shared_prefix_length( inPreviousName, mName );
+    return varint_size( prefixLength ) +varint_size( mName.size() -prefixLength ) +(mName.size() -prefixLength)
+            +sizeof(mStartOffs) +sizeof(mLogicalSize) +sizeof(mPhysicalSize) +sizeof(mFlags) +varint_size( mGeneration )
+            +((mFlags & has_content_hash) ? sizeof(mContentHash) : 0)
+            +((mFlags & is_encrypted) ? (sizeof(mNonce) +sizeof(mTag)) : 0)
+            +((mFlags & is_inline) ? mLogicalSize : 0);
+}
+
+
+bool    file_node::read( std::iostream& inFile, uint32_t inVersion, std::string& ioPreviousName )
+{
+    std::string     name;
+    if( (inVersion & 0xff) < 0x02 )    // 1.1 has a length byte and the full name.
+    {
+        uint8_t     nameLen = 0;
+        inFile.read( (char*)&nameLen, sizeof(nameLen) );
+        name.resize( nameLen );
+        inFile.read( &name[0], nameLen );
+    }
+    else    // 1.2 and later only store the part of the name that differs from the previous entry.
+    {
+        uint64_t    prefixLength = 0, suffixLength = 0;
+        if( !read_varint( inFile, &prefixLength ) || !read_varint( inFile, &suffixLength ) )
+            return false;
+        if( prefixLength > ioPreviousName.size() || suffixLength > (1 << 30) )
+            return false;   // Damaged file.
+        name.assign( ioPreviousName, 0, prefixLength );
+        name.resize( prefixLength +suffixLength );
+        inFile.read( &name[prefixLength], suffixLength );
+    }
+    read_le( inFile, &mStartOffs );
+    read_le( inFile, &mLogicalSize );
+    read_le( inFile, &mPhysicalSize );
+    read_le( inFile, &mFlags );
+    mGeneration = 0;
+    if( (inVersion & 0xff) >= 0x08 && !read_varint( inFile, &mGeneration ) )
+        return false;
+    if( mFlags & has_content_hash )
+        read_le( inFile, &mContentHash );
+    if( mFlags & is_encrypted )
+    {
+        inFile.read( (char*)mNonce, sizeof(mNonce) );
+        inFile.read( (char*)mTag, sizeof(mTag) );
+    }
+    if( mFlags & is_inline )
+    {
+        if( !inFile || mLogicalSize > (1 << 30) )
+            return false;   // Damaged file.
+        if( mCachedData )
+            delete [] mCachedData;
+        mCachedData = new char[mLogicalSize];
+        inFile.read( mCachedData, mLogicalSize );
+    }
+    if( !inFile )
+        return false;
+    ioPreviousName = name;
     if( (mFlags & is_free) == 0 )
         mName = name;   // Don't bother keeping around file names of free blocks, there shouldn't be any.
     mFlags &= ~(data_dirty | offsets_dirty | name_dirty);
@@ -673,16 +2842,28 @@ bool    file_node::read( std::iostream& inFile )
 }
 
 
-bool    file_node::write( std::iostream& inFile ) const
+bool    file_node::write( std::iostream& inFile, std::string& ioPreviousName ) const
 {
-    uint8_t     nameLen = mName.size();
-    inFile.write( (char*)&nameLen, sizeof(nameLen) );
-    inFile.write( mName.c_str(), nameLen );
-    inFile.write( (char*)&mStartOffs, sizeof(mStartOffs) );
-    inFile.write( (char*)&mLogicalSize, sizeof(mLogicalSize) );
-    inFile.write( (char*)&mPhysicalSize, sizeof(mPhysicalSize) );
+    size_t      prefixLength = shared_prefix_length( ioPreviousName, mName );
+    write_varint( inFile, prefixLength );
+    write_varint( inFile, mName.size() -prefixLength );
+    inFile.write( mName.data() +prefixLength, mName.size() -prefixLength );
+    write_le( inFile, mStartOffs );
+    write_le( inFile, mLogicalSize );
+    write_le( inFile, mPhysicalSize );
     node_flags_t    flags = mFlags & ~(data_dirty | offsets_dirty | name_dirty);
-    inFile.write( (char*)&flags, sizeof(mFlags) );
+    write_le( inFile, flags );
+    write_varint( inFile, mGeneration );
+    if( flags & has_content_hash )
+        write_le( inFile, mContentHash );
+    if( flags & is_encrypted )
+    {
+        inFile.write( (const char*)mNonce, sizeof(mNonce) );
+        inFile.write( (const char*)mTag, sizeof(mTag) );
+    }
+    if( flags & is_inline )
+        inFile.write( mCachedData, mLogicalSize );
+    ioPreviousName = mName;
     
     return true;
 }
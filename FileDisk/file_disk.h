@@ -10,15 +10,28 @@
 #define __FileDisk__file_disk__
 
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <fstream>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include "metrics.h"
+#include "extent_cipher.h"
 
 
 namespace fld
 {
 
+class trace_recorder;
+
+
 extern const char* MAP_BLOCK_FILENAME;  // File name we give the map block in the map. This is an invalid file name, so should be fine.
 
 
@@ -30,23 +43,31 @@ public:
         is_free = (1 << 0),         // Flag on unused blocks that are available for reuse.
         name_dirty = (1 << 1),      // Name of a node changed, need to write a new map. (Not written to disk)
         offsets_dirty = (1 << 2),   // Only offsets/sizes/flags changed, can update map in-place. (Not written to disk)
-        data_dirty = (1 << 3)       // Data changed or is new, write mCachedData to a free block or add a block to the end. (Not written to disk)
+        data_dirty = (1 << 3),      // Data changed or is new, write mCachedData to a free block or add a block to the end. (Not written to disk)
+        has_content_hash = (1 << 4),// mContentHash is valid and the block may be shared with other nodes of the same hash. Map entry has the hash after the flags.
+        is_inline = (1 << 5),       // Node has no block, its data is kept in mCachedData and stored in its map entry, after the flags and hash.
+        is_encrypted = (1 << 6),    // Block data is encrypted with the file_disk's extent_cipher. Map entry has the nonce and tag after the hash.
+        is_sparse = (1 << 7),       // Free block whose disk space trim() gave back to the file system. Reusing the block clears this.
+        is_deleted = (1 << 8)       // Not a block, but the name of a file deleted in generation(), so changes_since() can report it.
     };
     typedef uint32_t   node_flags_t;
     
-    file_node() : mFlags(0), mStartOffs(0), mLogicalSize(0), mPhysicalSize(0), mCachedData(nullptr), mReadOffs(0), mWriteOffs(0) {}
-    file_node( const file_node& inOriginal ) : mFlags(inOriginal.mFlags), mStartOffs(inOriginal.mStartOffs), mLogicalSize(inOriginal.mLogicalSize), mPhysicalSize(inOriginal.mPhysicalSize), mCachedData(nullptr), mName(inOriginal.mName), mReadOffs(0), mWriteOffs(0) { if( inOriginal.mCachedData != nullptr ) { mCachedData = new char[inOriginal.mLogicalSize]; memcpy(mCachedData, inOriginal.mCachedData, inOriginal.mLogicalSize); } }
+    file_node() : mFlags(0), mStartOffs(0), mLogicalSize(0), mPhysicalSize(0), mCachedData(nullptr), mReadOffs(0), mWriteOffs(0), mContentHash(0), mGeneration(0) { memset( mNonce, 0, sizeof(mNonce) ); memset( mTag, 0, sizeof(mTag) ); }
+    file_node( const file_node& inOriginal ) : mFlags(inOriginal.mFlags), mStartOffs(inOriginal.mStartOffs), mLogicalSize(inOriginal.mLogicalSize), mPhysicalSize(inOriginal.mPhysicalSize), mCachedData(nullptr), mName(inOriginal.mName), mReadOffs(0), mWriteOffs(0), mContentHash(inOriginal.mContentHash), mGeneration(inOriginal.mGeneration) { if( inOriginal.mCachedData != nullptr ) { mCachedData = new char[inOriginal.mLogicalSize]; memcpy(mCachedData, inOriginal.mCachedData, inOriginal.mLogicalSize); } memcpy( mNonce, inOriginal.mNonce, sizeof(mNonce) ); memcpy( mTag, inOriginal.mTag, sizeof(mTag) ); }
 //    file_node( file_node&& inOriginal ) : mFlags(inOriginal.mFlags), mStartOffs(inOriginal.mStartOffs), mLogicalSize(inOriginal.mLogicalSize), mPhysicalSize(inOriginal.mPhysicalSize), mCachedData(inOriginal.mCachedData), mName(inOriginal.mName) { inOriginal.mCachedData = nullptr; }
     ~file_node()    { if( mCachedData ) delete [] mCachedData; }
+    file_node&  operator =( const file_node& inOriginal );
     
-    bool    read( std::iostream& inFile );
-    bool    write( std::iostream& inFile ) const;
+    // Names in the map are front-coded, so these need the name of the entry before them in the map:
+    bool    read( std::iostream& inFile, uint32_t inVersion, std::string& ioPreviousName );
+    bool    write( std::iostream& inFile, std::string& ioPreviousName ) const;
     
     std::string     name() const                            { return mName; }
     void            set_name( const std::string &inString ) { mName = inString; }
     node_flags_t    flags() const                           { return mFlags; }
     void            set_flags( node_flags_t inFlags )       { mFlags = inFlags; }
-    size_t          node_size_on_disk() const               { return mName.size() +1 +sizeof(mStartOffs) +sizeof(mLogicalSize) +sizeof(mPhysicalSize) +sizeof(mFlags); }
+    size_t          node_size_on_disk( const std::string& inPreviousName ) const;
+    size_t          node_size_on_disk() const               { return node_size_on_disk( std::string() ); }  // Size if it was the first entry in the map.
     size_t          start_offset() const                    { return mStartOffs; }
     void            set_start_offset( size_t inSize )       { mStartOffs = inSize; }
     size_t          logical_size() const                    { return mLogicalSize; }
@@ -60,9 +81,17 @@ public:
     size_t          read_offs()                             { return mReadOffs; }
     void            set_write_offs( size_t inOffs )         { mWriteOffs = inOffs; }
     size_t          write_offs()                            { return mWriteOffs; }
+    uint64_t        content_hash() const                    { return mContentHash; }
+    void            set_content_hash( uint64_t inHash )     { mContentHash = inHash; }
+    uint8_t*        nonce()                                 { return mNonce; }  // extent_cipher::nonce_size bytes, valid if is_encrypted.
+    const uint8_t*  nonce() const                           { return mNonce; }
+    uint8_t*        tag()                                   { return mTag; }    // extent_cipher::tag_size bytes, valid if is_encrypted.
+    const uint8_t*  tag() const                             { return mTag; }
+    uint64_t        generation() const                      { return mGeneration; }
+    void            set_generation( uint64_t inGeneration ) { mGeneration = inGeneration; }
     
 protected:
-    std::string     mName;          // Name of the block (i.e. file-in-file). Max. 255 bytes.
+    std::string     mName;          // Name of the block (i.e. file-in-file).
     uint64_t        mStartOffs;     // Start offset into file where this block's data begins.
     uint64_t        mLogicalSize;   // Actual used amount of bytes on disk, or of mCachedData if data_dirty.
     uint64_t        mPhysicalSize;  // Number of bytes the block occupies on disk.
@@ -70,6 +99,10 @@ protected:
     char*           mCachedData;    // Cached data, an array of chars allocated using new.
     uint64_t        mReadOffs;
     uint64_t        mWriteOffs;
+    uint64_t        mContentHash;   // Hash of the data, if has_content_hash is set.
+    uint8_t         mNonce[extent_cipher::nonce_size];  // Nonce and authentication tag of the block's data, if is_encrypted is set.
+    uint8_t         mTag[extent_cipher::tag_size];
+    uint64_t        mGeneration;    // Commit generation in which the file's contents last changed.
 };
 
 
@@ -81,6 +114,59 @@ struct stats
     uint64_t    header_bytes; // How many bytes in file used for version, map offset.
     uint64_t    name_bytes;     // How many bytes in file map used for names (excl. length bytes).
     uint64_t    num_files;      // How many files inside this file_disk.
+    uint64_t    dedup_bytes;    // How many bytes of data we didn't have to store because files share identical blocks.
+    uint64_t    inline_bytes;   // How many bytes in file map used for data of small files stored in the map (part of map_bytes).
+    uint64_t    index_bytes;    // How many bytes in file map used for the name index read_only opens use (part of map_bytes).
+    uint64_t    sparse_bytes;   // How many bytes of free_bytes trim() gave back to the file system, so they don't take up disk space.
+    uint64_t    free_block_count;   // How many separate free blocks free_bytes is spread over.
+    uint64_t    largest_free_block; // The largest file that can be added without growing the file.
+};
+
+// How much room to reserve when a block is created or has to move because it grew:
+struct growth_policy
+{
+    enum kind
+    {
+        exact_size,     // Blocks are exactly as large as their data.
+        geometric,      // Blocks that have to move to grow get geometric_slack times their size as extra room.
+        size_classes    // All blocks are rounded up to one of 4 sizes per power of two, so free blocks are easier to reuse.
+    };
+    
+    growth_policy() : mode(exact_size), geometric_slack(0.5), alignment(1), preallocation_chunk(0) {}
+    
+    kind        mode;
+    double      geometric_slack;        // For geometric: 0.5 means a block that grows to 100 bytes gets 150.
+    size_t      alignment;              // Round all block sizes up to a multiple of this (e.g. 4096). 1 means no rounding.
+    size_t      preallocation_chunk;    // If not 0, reserve disk space at the end of the file in chunks this large (e.g. 64 MB).
+};
+
+// When the background write-back thread started by file_disk::start_write_back() writes things to disk:
+struct write_back_policy
+{
+    write_back_policy() : max_dirty_bytes(16 * 1024 * 1024), max_dirty_age(1000), commit_interval(5000) {}
+    
+    size_t                      max_dirty_bytes;    // Write out file data once this much has been changed. Callers block writing it themselves at twice that.
+    std::chrono::milliseconds   max_dirty_age;      // Write out file data at the latest this long after it was changed.
+    std::chrono::milliseconds   commit_interval;    // write() the map this often if anything changed. 0 means only when you call write().
+};
+
+// What file_disk::changes_since() reports for each file:
+struct file_change
+{
+    std::string     name;
+    uint64_t        generation; // Commit generation in which this last happened.
+    bool            deleted;    // If false, the file was added or its contents changed.
+};
+
+// One entry in a batch passed to file_disk::read_many():
+struct read_request
+{
+    std::string     name;
+    uint64_t        offset;     // Where in the file to start reading.
+    size_t          length;     // How many bytes to read at most.
+    char*           buffer;     // Caller-owned, at least length bytes large.
+    size_t          bytes_read; // Set by read_many(). Less than length if the file ends before offset +length.
+    bool            succeeded;  // Set by read_many(). False if there's no such file, offset was past its end, or I/O failed.
 };
 
 class file_disk
@@ -94,13 +180,77 @@ public:
     };
     typedef uint32_t   map_flags_t;
     
+    enum
+    {
+        direct_io = (1 << 0),           // Bypass the OS's file cache for block data (O_DIRECT/F_NOCACHE). Implies 4096-byte data alignment.
+        read_only = (1 << 1)            // Don't load the map, look up files in the name index as they're read. All changes fail.
+    };
+    typedef uint32_t   open_flags_t;
+    
+    enum
+    {
+        direct_io_alignment = 4096,     // Offsets/sizes used for uncached I/O are multiples of this.
+        max_coalesce_gap = 64 * 1024,   // read_many() reads over gaps up to this size between requested ranges instead of seeking.
+        max_coalesced_read = 4 * 1024 * 1024,   // read_many() doesn't merge reads beyond this size.
+        min_read_ahead = 128 * 1024,    // How far ahead we ask the OS to read once we notice sequential reads...
+        max_read_ahead = 8 * 1024 * 1024,   // ...doubling each time it catches up, up to this.
+        min_trim_size = 1024 * 1024,    // Default for trim(), smaller free blocks aren't worth fragmenting the file over.
+        trim_alignment = 4096           // Holes are punched in whole file system blocks, the partial ones at the edges of a free block stay allocated.
+    };
+    
+    enum access_pattern
+    {
+        access_normal,      // Read ahead once several reads in a row were in the order the data is on disk.
+        access_sequential,  // Always read ahead, e.g. for exports that go through all files in disk order.
+        access_random       // Never read ahead.
+    };
+    
 
     file_disk();
     ~file_disk();
     
-    bool            open( const std::string& inPath );
+    // With an inKey of extent_cipher::key_size bytes, file data is encrypted with AES-GCM
+    //  when it is written, and checked and decrypted when read. Encrypted blocks can only
+    //  be read and written as a whole, and aren't deduplicated or stored inline. Fails if
+    //  we were built without FILE_DISK_USE_OPENSSL.
+    bool            open( const std::string& inPath, open_flags_t inFlags = 0, const std::string& inKey = std::string() );
     bool            write();    // Commit all changes to this file to disk.
     bool            compact();
+    bool            write_copy( const std::string& inPath );    // Write a compacted copy in the current file format to inPath, in one pass through this file.
+    // Commits, then makes inPath a copy of this file as it is on disk. If the file system
+    //  supports it (btrfs, XFS, APFS...), both files share their disk blocks until either
+    //  changes them, so this takes about as long no matter how large the file is. Fails
+    //  during a batch.
+    bool            clone_to( const std::string& inPath );
+    
+    // Commits, then gives the disk space of free blocks of at least inMinSize bytes back
+    //  to the file system by punching holes in the file, without moving anything like
+    //  compact() does. When a block is reused, the file system allocates space for it
+    //  again as it gets written. Fails if the file system can't punch holes.
+    bool            trim( uint64_t inMinSize = min_trim_size );
+    void            set_trim_threshold( uint64_t inMinSize )    { mTrimThreshold = inMinSize; }  // If not 0, every write() trims free blocks of at least this size.
+    
+    // Between begin_batch() and commit(), add_file(), set_file_contents() and delete_file() are only
+    //  recorded and the file doesn't change (pread() etc. still see the old state). commit() then
+    //  applies them all and writes them out in one go, without overwriting anything the old map
+    //  refers to, so if it fails midway, the file still has none of the changes. pwrite() and
+    //  append() fail during a batch. begin_batch() first commits changes made before it.
+    bool            begin_batch();
+    bool            commit();
+    void            abort();    // Forget all changes since begin_batch().
+    
+    // Writes changed file data to disk and commits the map in a background thread, according
+    //  to inPolicy, so changed files don't pile up in RAM until you call write(). Once dirty
+    //  data has been written, its copy in RAM is freed. stop_write_back() does a final write().
+    //  All file_disk calls lock, so they can be made from any thread.
+    bool            start_write_back( const struct write_back_policy& inPolicy );
+    bool            stop_write_back();
+    
+    void            set_growth_policy( const struct growth_policy& inPolicy )  { mGrowthPolicy = inPolicy; }
+    void            set_data_alignment( size_t inAlignment );   // Make new blocks start at multiples of inAlignment bytes. 1 packs blocks right after each other.
+    void            set_deduplicate( bool inDeduplicate )       { mDeduplicate = inDeduplicate; }  // Files added/set with the same contents as an existing file share its block on disk.
+    void            set_inline_threshold( size_t inMaxSize )    { mInlineThreshold = inMaxSize; }  // Files of up to inMaxSize bytes are stored in the map instead of getting their own block. 0 turns this off.
+    void            set_access_pattern( access_pattern inPattern );  // Whether reads ask the OS to read ahead: always for sequential, never for random, or once reads look sequential.
 
 
     // blockSize is the size of the actual block you want, e.g. if you want to reserve some room for growth
@@ -109,24 +259,127 @@ public:
     //  inData. You may specify NULL for inData if dataSize == 0 and blockSize > 0.
     bool            add_file( const char* inFileName, char* inData, size_t dataSize, size_t blockSize = 0 );
     bool            set_file_contents( const char* inFileName, char* inData, size_t dataSize );
+    // Change part of a file without replacing all of it. Only the bytes passed in get written,
+    //  if the file has to grow and move, the old contents are copied over on disk.
+    //  The caller keeps ownership of inData.
+    bool            append( const char* inFileName, const char* inData, size_t dataSize );
+    bool            pwrite( const char* inFileName, uint64_t inOffset, const char* inData, size_t dataSize );   // Writing past the end fills the gap with zeroes.
+    
+    // Reading past the end of a file gives a short read, starting past the end fails.
+    bool            pread( const char* inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, size_t* outBytesRead = nullptr );
+    // Reads several ranges at once, sorted by where they are on disk and merged into as few reads as possible.
+    //  Returns false if any of the requests failed, see their succeeded fields.
+    bool            read_many( std::vector<read_request>& ioRequests );
+    // Calls inCallback for every file, in the order they are on disk, reading neighboring files
+    //  in one go and skipping the free space between them. inData points right into our read
+    //  buffer, so it is only valid until inCallback returns. Return false to stop early. Don't
+    //  change this file_disk from inCallback.
+    typedef std::function<bool( const std::string& inFileName, const char* inData, size_t inDataSize )>  scan_callback;
+    bool            scan( const scan_callback& inCallback, size_t inWindowSize = max_coalesced_read );
 
     bool            delete_file( const char* inFileName );
+    bool            list_files( std::vector<std::string>* outFileNames );   // Names of all files, sorted.
+    
+    // Every write() that commits changes increments the generation, and files remember the
+    //  generation in which they last changed, as do the names of deleted files. This lets a
+    //  replica catch up by applying only what changed since the generation it has. Like
+    //  clone_to(), changes_since() and write_delta() commit first and fail during a batch.
+    uint64_t        generation();   // Of the last commit that changed anything, 0 for new files.
+    bool            changes_since( uint64_t inGeneration, std::vector<file_change>* outChanges );   // Sorted by name.
+    bool            write_delta( uint64_t inGeneration, std::ostream& outDelta );   // The changes since inGeneration, with the contents of changed files.
+    // Applies a delta from write_delta() as one batch, so either all of it is committed or
+    //  nothing is. Afterwards, our generation is the one the delta was written at. Fails if
+    //  the delta starts at a later generation than ours, as we'd miss changes. Keeps the
+    //  changed files in RAM until they're committed.
+    bool            apply_delta( std::istream& inDelta );
+    void            forget_deletions_before( uint64_t inGeneration );  // Deleted names are kept forever otherwise. Replicas older than this need a full copy.
     
-    bool            statistics( struct stats* outStatistics );
+    bool            statistics( struct stats* outStatistics );  // Doesn't walk the map, so it's fine to poll this.
+    bool            metrics( struct metrics_snapshot* outMetrics );  // Latencies and I/O counters since this object was created, from all threads.
+    void            set_trace( trace_recorder* inRecorder );    // Log every call to inRecorder, for replay_trace(). The caller keeps ownership. nullptr stops logging.
     bool            is_valid(); // Only works if the file hasn't been modified since the last write/compact or has been freshly loaded and is non-empty.
     void            print( std::ostream& output );
     
     
 
 protected:
+    bool            open_file( const std::string& inPath, open_flags_t inFlags );  // open() minus setting up encryption, so compact() can reopen.
     bool            load_map();
+    bool            load_index();   // For read_only: Only read the header and where the name index is.
+    bool            load_whole_map();   // For read_only calls that need all files. Does nothing if the map is loaded already.
+    file_node*      find_node( const std::string& inFileName );   // mFileMap lookup that falls back to the name index if the map isn't loaded.
+    size_t          map_size_on_disk() const;  // Size of the map if we wrote it out right now.
+    size_t          block_size_for_data_size( size_t inDataSize, bool inIsGrowing ) const;
+    uint64_t        allocate_at_end( size_t inPhysicalSize, bool inAligned );   // Grows mFileSize, returns the start offset of the new space.
+    bool            free_block_fits( const file_node& inFreeNode, size_t desiredSize, bool inAligned ) const;
+    bool            write_dirty_data(); // Write out file data changed in RAM, but not the map.
+    void            note_dirty_data( size_t inNumBytes );
+    void            discard_cached_data( file_node& ioNode );   // Deletes ioNode's data in RAM. If it was dirty, it no longer counts towards mDirtyBytes.
+    void            write_back_thread_main();
+    bool            preallocate( uint64_t inOffset, uint64_t inNumBytes );
+    bool            punch_hole( uint64_t inOffset, uint64_t inNumBytes );
+    bool            punch_free_blocks( uint64_t inMinSize );  // Only safe right after write(), when the map on disk doesn't use any free blocks.
     void            swap_node_for_free_node_of_size( file_node& ioNode, size_t desiredSize, size_t desiredSizeIfNotRecycled = 0 );
     file_node&      node_of_size_for_name( size_t desiredSize, const std::string& inName, size_t desiredSizeIfNotRecycled = 0 );
     bool            write( const char* buf, size_t numBytes, file_node& inFileNode );
+    bool            write_node_range( file_node& ioNode, uint64_t inOffset, const char* inData, size_t dataSize );
+    bool            copy_range( uint64_t inFromOffset, uint64_t inToOffset, uint64_t inNumBytes );
+    bool            store_deduplicated( file_node& ioNode, char* inData, size_t dataSize, size_t blockSize );  // Takes over inData if it succeeds. ioNode must not have a block yet.
+    bool            block_equals( uint64_t inOffset, const char* inData, size_t dataSize );
+    void            release_block( file_node& ioNode );     // Stop sharing ioNode's block. If others still use it, ioNode ends up without a block.
+    bool            make_block_private( file_node& ioNode );// Give ioNode its own copy of its block if it is shared, so it can be modified.
+    void            free_block_of_node( file_node& ioNode );// Move ioNode's block to the free list, leaving ioNode without one.
+    void            note_change( file_node& ioNode );       // ioNode's contents changed or it was added, it'll be part of the next generation.
     bool            read( char* buf, size_t numBytes, file_node& inFileNode );
+    bool            read_node_range( const file_node& inFileNode, uint64_t inOffset, char* outBuf, size_t inNumBytes );
+    bool            read_decrypted( const file_node& inFileNode, char* outBuf );   // Reads the whole block of an is_encrypted node and checks its tag.
+    bool            read_at( uint64_t inOffset, char* outBuf, size_t inNumBytes );          // Raw I/O on mFile, all data I/O should go through these so it gets counted.
+    bool            write_at( uint64_t inOffset, const char* inBuf, size_t inNumBytes );
+    void            note_seek( uint64_t inOffset );
+    void            note_read( uint64_t inOffset, size_t inNumBytes );  // Detect sequential reads and read ahead.
+    bool            advise_will_need( uint64_t inOffset, uint64_t inNumBytes );
+    bool            direct_read_at( uint64_t inOffset, char* outBuf, size_t inNumBytes );   // read_at/write_at for direct_io.
+    bool            direct_write_at( uint64_t inOffset, const char* inBuf, size_t inNumBytes );
 
     friend class block_streambuf;
     
+    struct batch_change
+    {
+        enum kind { add, set, remove };
+        kind        mode;
+        char*       data;       // Owned by the batch until it is applied.
+        size_t      data_size;
+        size_t      block_size;
+    };
+    
+    bool            stage_change( batch_change::kind inMode, const std::string& inFileName, char* inData, size_t dataSize, size_t blockSize );
+    bool            batch_has_file( const std::string& inFileName ) const;  // Does inFileName exist once the batch is applied?
+    
+    struct hashed_block
+    {
+        uint64_t    content_hash;
+        uint64_t    logical_size;
+        uint64_t    physical_size;
+        uint32_t    ref_count;  // Number of nodes in mFileMap using this block.
+    };
+    
+    struct statistics_state
+    {
+        statistics_state() : index_entry_bytes(0) { memset( &totals, 0, sizeof(totals) ); }
+        
+        struct stats            totals;     // All but header_bytes, index_bytes and largest_free_block, which statistics() works out from the rest.
+        uint64_t                index_entry_bytes;  // How much the names of all files take up in the name index.
+        std::multiset<uint64_t> free_block_sizes;
+    };
+    
+    // Add (inDirection = 1) or remove (inDirection = -1) a node's bytes to/from the totals. Call
+    //  with -1 before changing a node in mFileMap or mFreeBlocks and with 1 afterwards, and
+    //  count_block() when a deduplicated block is created or deleted:
+    void            count_node( const file_node& inNode, int inDirection, statistics_state& ioState ) const;
+    void            count_node( const file_node& inNode, int inDirection )  { count_node( inNode, inDirection, mStatistics ); }
+    void            count_block( const hashed_block& inBlock, int inDirection, statistics_state& ioState ) const;
+    void            count_all( statistics_state& outState ) const;   // The slow way, by walking all nodes.
+    
 protected:
     size_t                          mFileSize;  // Size in bytes of the file/position at which we append new blocks.
     std::map<std::string,file_node> mFileMap;   // List of used blocks in the file, indexed by name.
@@ -134,8 +387,48 @@ protected:
     std::vector<file_node>          mFreeBlocks;// List of unused blocks in the file that we can re-use.
     std::fstream                    mFile;      // The actual binary file on disk where data is kept/persisted.
     std::string                     mFilePath;  // The path corresponding to mFile.
-    uint32_t                        mVersion;   // Only low 2 bytes used for major/minor file format version. Other 2 bytes used to detect endian-ness (If high byte is not 0, you're reading an (currently unsupported) non-native endian file).
+    int                             mFileDescriptor;    // Second handle on mFilePath for things fstream can't do, like preallocating.
+    int                             mDirectFileDescriptor;  // Uncached handle on mFilePath used for block data if opened with direct_io, otherwise -1.
+    open_flags_t                    mOpenFlags; // Flags passed to open(), so compact() can reopen the same way.
+    size_t                          mDataAlignment; // Start offsets of newly allocated blocks are a multiple of this.
+    uint32_t                        mVersion;   // Only low 2 bytes used for major/minor file format version. Other 2 bytes are 0 (If not, you're reading a file written by an old version on a big-endian CPU, which is unsupported).
     uint64_t                        mMapOffset; // Position of the block that contains the block map.
+    uint64_t                        mIOPosition;// Where the last read_at/write_at ended, so we can tell whether the next one needs a seek.
+    metrics_collector               mMetrics;   // Operation latencies and I/O counters.
+    struct growth_policy            mGrowthPolicy;
+    uint64_t                        mPreallocatedSize;  // How far we've already reserved disk space at the end of the file.
+    bool                            mDeduplicate;   // Look for identical blocks before allocating new ones?
+    std::unordered_multimap<uint64_t,uint64_t>  mBlocksByHash;  // Start offsets of blocks with has_content_hash, by hash.
+    std::map<uint64_t,hashed_block> mHashedBlocks;  // Blocks with has_content_hash, by start offset.
+    size_t                          mInlineThreshold;   // Files of up to this size get is_inline.
+    bool                            mInBatch;       // Between begin_batch() and commit()/abort()?
+    std::map<std::string,batch_change>  mBatch;     // Changes since begin_batch(), by file name. Only the combined effect of all changes to a file is kept.
+    bool                            mCommittingBatch;   // Inside commit(), only blocks in mReusableFreeBlocks may be reused.
+    std::set<uint64_t>              mReusableFreeBlocks;// Start offsets of blocks that were free before commit(), so the map on disk doesn't need them.
+    std::recursive_mutex            mLock;          // Held by all public calls, and the write-back thread while it's writing.
+    std::condition_variable_any     mWriteBackCondition;// Signaled on mLock when there's something for the write-back thread to do.
+    std::thread                     mWriteBackThread;
+    bool                            mWriteBackRunning;
+    bool                            mStopWriteBack; // Tells mWriteBackThread to exit.
+    struct write_back_policy        mWriteBackPolicy;
+    size_t                          mDirtyBytes;    // Roughly how much file data in RAM hasn't been written yet.
+    std::chrono::steady_clock::time_point   mOldestDirtyTime;   // When data first got dirty after the last write_dirty_data().
+    access_pattern                  mAccessPattern;
+    uint64_t                        mLastReadEnd;   // Where the last read_at ended, to detect sequential reads.
+    uint32_t                        mSequentialReads;   // How many read_at calls in a row went forward from mLastReadEnd.
+    uint64_t                        mReadAheadEnd;  // How far we've already asked the OS to read ahead.
+    uint64_t                        mReadAheadWindow;   // How far to read ahead next time.
+    bool                            mMapIsPartial;  // Opened read_only, mFileMap only has the files looked up via the index so far.
+    uint64_t                        mIndexOffset;   // Position of the name index in the map block.
+    uint64_t                        mIndexBucketCount;  // Number of hash buckets in the name index, a power of 2.
+    extent_cipher*                  mCipher;        // Encrypts data we write and decrypts is_encrypted blocks. NULL if opened without a key.
+    uint64_t                        mTrimThreshold; // write() punches holes for free blocks of at least this size. 0 to not trim.
+    trace_recorder*                 mTrace;         // Owned by whoever called set_trace().
+    unsigned                        mTraceDepth;    // How many traced calls we're in, so only the outermost is recorded.
+    uint64_t                        mGeneration;    // Of the last commit. Changes since have mGeneration +1.
+    bool                            mChangedSinceCommit;    // The next write() starts a new generation.
+    std::map<std::string,uint64_t>  mTombstones;    // Names of deleted files -> generation they were deleted in.
+    statistics_state                mStatistics;    // Kept up to date as nodes change, so statistics() doesn't need to walk the map.
 };
 
 } /* namespace file_disk*/
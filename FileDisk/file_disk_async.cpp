@@ -0,0 +1,134 @@
+//
+//  file_disk_async.cpp
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#include "file_disk_async.h"
+
+
+using namespace std;
+
+
+namespace fld
+{
+
+thread_pool_backend::thread_pool_backend( size_t inNumThreads )
+    : mStopping(false)
+{
+    for( size_t x = 0; x < std::max( inNumThreads, (size_t)1 ); x++ )
+        mThreads.push_back( std::thread( &thread_pool_backend::thread_main, this ) );
+}
+
+
+thread_pool_backend::~thread_pool_backend()
+{
+    {
+        std::lock_guard<std::mutex>     lock(mLock);
+        mStopping = true;
+        mJobsCondition.notify_all();
+    }
+    for( std::thread& currThread : mThreads )
+        currThread.join();
+}
+
+
+void    thread_pool_backend::submit( std::function<void()> inJob )
+{
+    std::lock_guard<std::mutex>     lock(mLock);
+    mJobs.push_back( std::move(inJob) );
+    mJobsCondition.notify_one();
+}
+
+
+void    thread_pool_backend::thread_main()
+{
+    std::unique_lock<std::mutex>    lock(mLock);
+    while( true )
+    {
+        mJobsCondition.wait( lock, [this]() { return mStopping || !mJobs.empty(); } );
+        if( mJobs.empty() )
+            break;  // Only stop once everything that was submitted has run.
+
+        std::function<void()>   currJob = std::move( mJobs.front() );
+        mJobs.pop_front();
+        lock.unlock();
+        currJob();
+        lock.lock();
+    }
+}
+
+
+void    async_file_disk::submit( const cancellation_token& inToken, const completion_handler& inCompletion, std::function<async_result()> inCall, std::function<void()> inCancel )
+{
+    {
+        std::lock_guard<std::mutex>     lock(mPendingLock);
+        mNumPending++;
+    }
+
+    mBackend.submit( [this,inToken,inCompletion,inCall,inCancel]()
+    {
+        async_result    result = { async_cancelled, 0 };
+        if( inToken.is_cancelled() )
+        {
+            if( inCancel )
+                inCancel();
+        }
+        else
+            result = inCall();
+        if( inCompletion )
+            inCompletion( result );
+
+        // Last thing we do, as the destructor may be waiting to delete us:
+        std::lock_guard<std::mutex>     lock(mPendingLock);
+        mNumPending--;
+        mPendingCondition.notify_all();
+    } );
+}
+
+
+void    async_file_disk::wait_for_pending()
+{
+    std::unique_lock<std::mutex>    lock(mPendingLock);
+    mPendingCondition.wait( lock, [this]() { return mNumPending == 0; } );
+}
+
+
+void    async_file_disk::async_read( const std::string& inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, const completion_handler& inCompletion, const cancellation_token& inToken )
+{
+    submit( inToken, inCompletion, [this,inFileName,inOffset,inNumBytes,outBuf]()
+    {
+        async_result    result = { async_failed, 0 };
+        if( mDisk.pread( inFileName.c_str(), inOffset, inNumBytes, outBuf, &result.bytes_read ) )
+            result.status = async_succeeded;
+        return result;
+    } );
+}
+
+
+void    async_file_disk::async_set_file_contents( const std::string& inFileName, char* inData, size_t dataSize, const completion_handler& inCompletion, const cancellation_token& inToken )
+{
+    submit( inToken, inCompletion, [this,inFileName,inData,dataSize]()
+    {
+        async_result    result = { async_failed, 0 };
+        if( mDisk.set_file_contents( inFileName.c_str(), inData, dataSize ) )
+            result.status = async_succeeded;
+        return result;
+    },
+    [inData]() { delete [] inData; } );
+}
+
+
+void    async_file_disk::async_write( const completion_handler& inCompletion, const cancellation_token& inToken )
+{
+    submit( inToken, inCompletion, [this]()
+    {
+        async_result    result = { async_failed, 0 };
+        if( mDisk.write() )
+            result.status = async_succeeded;
+        return result;
+    } );
+}
+
+} /* namespace fld */
@@ -0,0 +1,175 @@
+//
+//  file_disk_async.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__file_disk_async__
+#define __FileDisk__file_disk_async__
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include "file_disk.h"
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define FILE_DISK_HAS_COROUTINES    1
+#endif
+#endif
+
+
+namespace fld
+{
+
+// Where async_file_disk runs the file_disk calls it is asked to make. There is no io_uring
+//  backend: file_disk does its I/O synchronously while holding its lock, so a ring would only
+//  replace the hand-off to a thread, not the blocking I/O inside the call.
+class io_backend
+{
+public:
+    virtual ~io_backend()   {}
+
+    virtual void    submit( std::function<void()> inJob ) = 0;  // Run inJob at some point, on any thread.
+};
+
+
+// Runs jobs on a fixed number of threads, in the order they were submitted. Waits for
+//  all submitted jobs when destroyed.
+class thread_pool_backend : public io_backend
+{
+public:
+    explicit thread_pool_backend( size_t inNumThreads = 4 );
+    ~thread_pool_backend();
+
+    void    submit( std::function<void()> inJob ) override;
+
+protected:
+    void    thread_main();
+
+    thread_pool_backend( const thread_pool_backend& ) = delete;
+    thread_pool_backend& operator =( const thread_pool_backend& ) = delete;
+
+protected:
+    std::mutex                          mLock;      // Protects mJobs and mStopping.
+    std::condition_variable             mJobsCondition;
+    std::deque<std::function<void()>>   mJobs;
+    bool                                mStopping;
+    std::vector<std::thread>            mThreads;
+};
+
+
+// Hand the same token to several operations to be able to cancel them all at once.
+//  Operations that have already started when it is cancelled run to completion.
+class cancellation_token
+{
+public:
+    cancellation_token() : mCancelled( std::make_shared<std::atomic<bool>>( false ) ) {}
+
+    void    cancel()                { mCancelled->store( true ); }
+    bool    is_cancelled() const    { return mCancelled->load(); }
+
+protected:
+    std::shared_ptr<std::atomic<bool>>  mCancelled; // Shared by all copies.
+};
+
+
+enum async_status
+{
+    async_succeeded,
+    async_failed,       // The file_disk call returned false.
+    async_cancelled     // Never got to run.
+};
+
+
+struct async_result
+{
+    async_status    status;
+    size_t          bytes_read; // For async_read().
+};
+
+
+// Makes file_disk calls on an io_backend and reports back when they're done, so you
+//  can have many requests in flight without a blocked thread for each. As file_disk
+//  locks for every call, they still happen one at a time. The completion handler is
+//  called on the backend's thread. Destroying this waits for all pending calls, so
+//  don't do that from a completion handler.
+class async_file_disk
+{
+public:
+    typedef std::function<void( const async_result& inResult )>  completion_handler;
+
+    async_file_disk( file_disk& inDisk, io_backend& inBackend ) : mDisk(inDisk), mBackend(inBackend), mNumPending(0) {}
+    ~async_file_disk()  { wait_for_pending(); }
+
+    // outBuf must stay valid until inCompletion is called.
+    void    async_read( const std::string& inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, const completion_handler& inCompletion, const cancellation_token& inToken = cancellation_token() );
+    // inData changes hands like with file_disk::set_file_contents(). If the call gets cancelled, it is deleted.
+    void    async_set_file_contents( const std::string& inFileName, char* inData, size_t dataSize, const completion_handler& inCompletion, const cancellation_token& inToken = cancellation_token() );
+    void    async_write( const completion_handler& inCompletion, const cancellation_token& inToken = cancellation_token() );    // Commit, like file_disk::write().
+
+    void    wait_for_pending();
+
+#if FILE_DISK_HAS_COROUTINES
+    // co_await one of these to get the async_result. The call is only submitted once
+    //  awaited, and the coroutine resumes on the backend's thread.
+    class awaitable
+    {
+    public:
+        explicit awaitable( std::function<void( const completion_handler& )> inStart ) : mStart(std::move(inStart)), mResult{ async_failed, 0 } {}
+
+        bool            await_ready() const noexcept    { return false; }
+        void            await_suspend( std::coroutine_handle<> inCoroutine )
+        {
+            // The coroutine may be resumed, and this awaitable destroyed, before start() returns,
+            //  so don't call mStart itself:
+            std::function<void( const completion_handler& )>   start = mStart;
+            start( [this,inCoroutine]( const async_result& inResult ) { mResult = inResult; inCoroutine.resume(); } );
+        }
+        async_result    await_resume() const noexcept   { return mResult; }
+
+    protected:
+        std::function<void( const completion_handler& )>   mStart;
+        async_result                                        mResult;
+    };
+
+    awaitable   async_read( const std::string& inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, const cancellation_token& inToken = cancellation_token() )
+    {
+        return awaitable( [this,inFileName,inOffset,inNumBytes,outBuf,inToken]( const completion_handler& inCompletion ) { async_read( inFileName, inOffset, inNumBytes, outBuf, inCompletion, inToken ); } );
+    }
+    awaitable   async_set_file_contents( const std::string& inFileName, char* inData, size_t dataSize, const cancellation_token& inToken = cancellation_token() )
+    {
+        return awaitable( [this,inFileName,inData,dataSize,inToken]( const completion_handler& inCompletion ) { async_set_file_contents( inFileName, inData, dataSize, inCompletion, inToken ); } );
+    }
+    awaitable   async_write( const cancellation_token& inToken = cancellation_token() )
+    {
+        return awaitable( [this,inToken]( const completion_handler& inCompletion ) { async_write( inCompletion, inToken ); } );
+    }
+#endif
+
+protected:
+    void    submit( const cancellation_token& inToken, const completion_handler& inCompletion, std::function<async_result()> inCall, std::function<void()> inCancel = nullptr );
+
+    async_file_disk( const async_file_disk& ) = delete;
+    async_file_disk& operator =( const async_file_disk& ) = delete;
+
+protected:
+    file_disk&              mDisk;
+    io_backend&             mBackend;
+    std::mutex              mPendingLock;
+    std::condition_variable mPendingCondition;
+    size_t                  mNumPending;
+};
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__file_disk_async__) */
@@ -8,9 +8,17 @@
 
 #include <iostream>
 #include "file_disk.h"
+#include "sharded_file_disk.h"
+#include "trace.h"
+#include "file_disk_async.h"
+#include "byte_order.h"
 #include <iomanip>
 #include "index_set.h"
 #include <sstream>
+#include <string.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <future>
 
 
 using namespace std;
@@ -22,8 +30,13 @@ void    print_statistics( const struct stats& statistics )
     cout << "No. of files in file_disk: " << internal << setw(5) << statistics.num_files << endl;
     cout << "Used data:                 " << internal << setw(5) << statistics.used_bytes << " bytes" << endl;
     cout << "Wasted data:               " << internal << setw(5) << statistics.free_bytes << " bytes" << endl;
+    cout << "    of that sparse:        " << internal << setw(5) << statistics.sparse_bytes << " bytes" << endl;
+    cout << "    in free blocks:        " << internal << setw(5) << statistics.free_block_count << " (largest " << statistics.largest_free_block << " bytes)" << endl;
     cout << "Map size:                  " << internal << setw(5) << statistics.map_bytes << " bytes" << endl;
     cout << "    of that names:         " << internal << setw(5) << statistics.name_bytes << " bytes" << endl;
+    cout << "    of that inline data:   " << internal << setw(5) << statistics.inline_bytes << " bytes" << endl;
+    cout << "    of that name index:    " << internal << setw(5) << statistics.index_bytes << " bytes" << endl;
+    cout << "Saved by deduplication:    " << internal << setw(5) << statistics.dedup_bytes << " bytes" << endl;
     cout << "Header:                    " << internal << setw(5) << statistics.header_bytes << " bytes" << endl;
     cout << "=============================================" << endl;
     cout << "Total file size:           " << internal << setw(5) << (statistics.used_bytes + statistics.free_bytes + statistics.map_bytes +statistics.header_bytes) << " bytes" << endl << endl;
@@ -102,9 +115,1501 @@ void    test_indexes()
 }
 
 
+void    test_histogram()
+{
+    histogram   latencies;
+    for( uint64_t x = 1; x <= 1000; x++ )
+        latencies.record( x );
+    if( latencies.count() != 1000 )
+        cout << "error: Histogram lost values!" << endl;
+    if( latencies.sum() != 500500 )
+        cout << "error: Histogram sum is wrong!" << endl;
+    uint64_t    median = latencies.percentile( 50 );
+    if( median < 470 || median > 500 )
+        cout << "error: Histogram median " << median << " is off by more than a bucket!" << endl;
+    if( latencies.percentile( 100 ) < 960 )
+        cout << "error: Histogram maximum " << latencies.percentile( 100 ) << " is too small!" << endl;
+    for( uint64_t x = 0; x < 100000; x += 7 )
+    {
+        size_t  bucket = histogram::bucket_for_value( x );
+        if( histogram::lowest_value_in_bucket( bucket ) > x || (bucket +1 < histogram::bucket_count && histogram::lowest_value_in_bucket( bucket +1 ) <= x) )
+            cout << "error: Value " << x << " ended up in the wrong histogram bucket!" << endl;
+    }
+}
+
+
+size_t  free_bytes_after_growing( const struct growth_policy& inPolicy )
+{
+    remove( "growthtest.boff" );
+    file_disk   theFile;
+    theFile.set_growth_policy( inPolicy );
+    if( !theFile.open("growthtest.boff") )
+        cout << "error: Couldn't create growthtest.boff." << endl;
+    theFile.add_file( "log.txt", new char[100](), 100 );
+    theFile.add_file( "other.txt", new char[10](), 10 );
+    for( size_t x = 2; x <= 100; x++ )
+    {
+        theFile.set_file_contents( "log.txt", new char[x * 100](), x * 100 );
+        theFile.write();
+    }
+    if( !theFile.is_valid() )
+        cout << "error: Growing a file with growth policy " << inPolicy.mode << " corrupted the file_disk." << endl;
+    
+    struct stats    statistics;
+    theFile.statistics( &statistics );
+    remove( "growthtest.boff" );
+    return statistics.free_bytes;
+}
+
+
+void    test_growth_policy()
+{
+    struct growth_policy    exact;
+    struct growth_policy    geometric;
+    geometric.mode = growth_policy::geometric;
+    struct growth_policy    classes;
+    classes.mode = growth_policy::size_classes;
+    classes.alignment = 4096;
+    classes.preallocation_chunk = 1024 * 1024;
+    
+    size_t  exactWaste = free_bytes_after_growing( exact );
+    size_t  geometricWaste = free_bytes_after_growing( geometric );
+    if( geometricWaste >= exactWaste )
+        cout << "error: Geometric growth left " << geometricWaste << " free bytes, exact only " << exactWaste << "." << endl;
+    free_bytes_after_growing( classes );
+}
+
+
+void    test_aligned_layout( file_disk::open_flags_t inFlags )
+{
+    remove( "alignedtest.boff" );
+    {
+        file_disk   theFile;
+        theFile.set_data_alignment( 4096 );
+        if( !theFile.open( "alignedtest.boff", inFlags ) )
+        {
+            if( inFlags & file_disk::direct_io )
+                cout << "note: File system doesn't support uncached I/O, skipping direct_io test." << endl;
+            else
+                cout << "error: Couldn't create alignedtest.boff." << endl;
+            return;
+        }
+        for( int x = 0; x < 10; x++ )
+        {
+            stringstream    fileName;
+            fileName << "blob" << x;
+            size_t  dataSize = 1000 * (x +1);
+            char*   data = new char[dataSize];
+            memset( data, 'a' +x, dataSize );
+            theFile.add_file( fileName.str().c_str(), data, dataSize );
+        }
+        theFile.write();
+        if( !theFile.is_valid() )
+            cout << "error: Aligned layout produced an invalid file_disk." << endl;
+    }
+    
+    file_disk   reopenedFile;
+    if( !reopenedFile.open( "alignedtest.boff", inFlags ) || !reopenedFile.is_valid() )
+        cout << "error: Aligned file_disk was invalid after reopening." << endl;
+    struct stats    statistics;
+    reopenedFile.statistics( &statistics );
+    if( statistics.num_files != 10 || statistics.used_bytes != 55000 )
+        cout << "error: Aligned file_disk lost data: " << statistics.num_files << " files, " << statistics.used_bytes << " bytes." << endl;
+    remove( "alignedtest.boff" );
+}
+
+
+void    test_append()
+{
+    remove( "appendtest.boff" );
+    {
+        struct growth_policy    geometric;
+        geometric.mode = growth_policy::geometric;
+        file_disk   theFile;
+        theFile.set_growth_policy( geometric );
+        if( !theFile.open( "appendtest.boff" ) )
+            cout << "error: Couldn't create appendtest.boff." << endl;
+        theFile.add_file( "log.txt", nullptr, 0 );
+        theFile.write();
+        for( int x = 0; x < 500; x++ )
+        {
+            if( !theFile.append( "log.txt", "0123456789", 10 ) )
+                cout << "error: Couldn't append to log.txt." << endl;
+            if( (x % 50) == 0 )
+                theFile.write();
+        }
+        if( !theFile.pwrite( "log.txt", 4995, "ABCDEFGHIJ", 10 ) )
+            cout << "error: Couldn't overwrite end of log.txt." << endl;
+        if( theFile.append( "no_such_file.txt", "x", 1 ) )
+            cout << "error: Could append to a nonexistent file." << endl;
+        theFile.write();
+    }
+    
+    file_disk   reopenedFile;
+    if( !reopenedFile.open( "appendtest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: File_disk was invalid after appending." << endl;
+    struct stats    statistics;
+    reopenedFile.statistics( &statistics );
+    if( statistics.used_bytes != 5005 )
+        cout << "error: Appended file is " << statistics.used_bytes << " bytes, expected 5005." << endl;
+    char    tail[20] = {0};
+    size_t  bytesRead = 0;
+    if( !reopenedFile.pread( "log.txt", 4985, sizeof(tail), tail, &bytesRead ) || bytesRead != 20
+        || memcmp( tail, "5678901234ABCDEFGHIJ", 20 ) != 0 )
+        cout << "error: Appended data didn't survive: " << string( tail, bytesRead ) << endl;
+    remove( "appendtest.boff" );
+}
+
+
+void    test_read_many()
+{
+    remove( "readtest.boff" );
+    file_disk   theFile;
+    if( !theFile.open( "readtest.boff" ) )
+        cout << "error: Couldn't create readtest.boff." << endl;
+    for( int x = 0; x < 200; x++ )
+    {
+        stringstream    fileName;
+        fileName << "entry" << ((x * 37) % 200);   // So name order isn't disk order.
+        char*   data = new char[100];
+        memset( data, x, 100 );
+        theFile.add_file( fileName.str().c_str(), data, 100 );
+    }
+    theFile.write();
+    
+    std::vector<read_request>   requests;
+    std::vector<char>           buffers( 200 * 10 );
+    for( int x = 0; x < 200; x++ )
+    {
+        stringstream    fileName;
+        fileName << "entry" << x;
+        read_request    request = { fileName.str(), 45, 10, buffers.data() +(x * 10), 0, false };
+        requests.push_back( request );
+    }
+    struct metrics_snapshot before, after;
+    theFile.metrics( &before );
+    if( !theFile.read_many( requests ) )
+        cout << "error: read_many() failed." << endl;
+    theFile.metrics( &after );
+    for( int x = 0; x < 200; x++ )
+    {
+        int     expected = -1;
+        for( int y = 0; y < 200; y++ )
+            if( ((y * 37) % 200) == x )
+                expected = y;
+        if( requests[x].bytes_read != 10 || buffers[x * 10] != (char)expected || buffers[x * 10 +9] != (char)expected )
+            cout << "error: read_many() read the wrong data for " << requests[x].name << "." << endl;
+    }
+    if( after.counters[counter_seeks] -before.counters[counter_seeks] > 1 )
+        cout << "error: read_many() didn't merge adjacent reads, " << (after.counters[counter_seeks] -before.counters[counter_seeks]) << " seeks." << endl;
+    
+    char    buf[100];
+    size_t  bytesRead = 0;
+    if( !theFile.pread( "entry0", 90, sizeof(buf), buf, &bytesRead ) || bytesRead != 10 )
+        cout << "error: Short pread() at end of file failed." << endl;
+    if( theFile.pread( "entry0", 101, 1, buf ) )
+        cout << "error: pread() past end of file succeeded." << endl;
+    remove( "readtest.boff" );
+}
+
+
+void    test_long_names()
+{
+    remove( "nametest.boff" );
+    std::vector<string>     names;
+    size_t                  totalNameBytes = 0;
+    {
+        file_disk   theFile;
+        if( !theFile.open( "nametest.boff" ) )
+            cout << "error: Couldn't create nametest.boff." << endl;
+        for( int x = 0; x < 100; x++ )
+        {
+            stringstream    fileName;
+            fileName << "/assets/" << string( 300, 'd' ) << "/textures/level" << (x / 10) << "/texture_" << x << ".png";
+            names.push_back( fileName.str() );
+            totalNameBytes += fileName.str().size();
+            char*   data = new char[4];
+            memcpy( data, &x, sizeof(x) );
+            if( !theFile.add_file( fileName.str().c_str(), data, sizeof(x) ) )
+                cout << "error: Couldn't add file with " << fileName.str().size() << " byte name." << endl;
+        }
+        theFile.write();
+    }
+    
+    file_disk   reopenedFile;
+    if( !reopenedFile.open( "nametest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: File_disk with long names was invalid after reopening." << endl;
+    for( int x = 0; x < 100; x++ )
+    {
+        int     value = -1;
+        if( !reopenedFile.pread( names[x].c_str(), 0, sizeof(value), (char*)&value ) || value != x )
+            cout << "error: Lost file with long name " << names[x] << "." << endl;
+    }
+    struct stats    statistics;
+    reopenedFile.statistics( &statistics );
+    if( (statistics.map_bytes -statistics.index_bytes) >= totalNameBytes / 4 )  // The name index has full names, but isn't needed to load the map.
+        cout << "error: Map with long names is " << (statistics.map_bytes -statistics.index_bytes) << " bytes, names are only " << totalNameBytes << " bytes." << endl;
+    remove( "nametest.boff" );
+}
+
+
+// Hand-craft a version 1.1 file with "a.txt" in it, and optionally "b.txt" stored after the map:
+void    make_version_1_1_file( const char* inPath, bool inFileAfterMap )
+{
+    remove( inPath );
+    fstream         oldFile( inPath, ios::binary | ios::out | ios::trunc );
+    uint32_t        version = 0x00000101;
+    uint64_t        mapOffset = 12 +5;
+    uint64_t        numEntries = inFileAfterMap ? 3 : 2;
+    uint64_t        mapSize = 8 + 29 + 34 + (inFileAfterMap ? 34 : 0);
+    oldFile.write( (char*)&version, sizeof(version) );
+    oldFile.write( (char*)&mapOffset, sizeof(mapOffset) );
+    oldFile.write( "Hello", 5 );
+    oldFile.write( (char*)&numEntries, sizeof(numEntries) );
+    uint64_t        mapFields[3] = { mapOffset, mapSize, mapSize };
+    uint64_t        fileFields[3] = { 12, 5, 5 };
+    uint32_t        flags = 0;
+    oldFile.write( "\0", 1 );
+    oldFile.write( (char*)mapFields, sizeof(mapFields) );
+    oldFile.write( (char*)&flags, sizeof(flags) );
+    oldFile.write( "\x05" "a.txt", 6 );
+    oldFile.write( (char*)fileFields, sizeof(fileFields) );
+    oldFile.write( (char*)&flags, sizeof(flags) );
+    if( inFileAfterMap )
+    {
+        uint64_t    secondFileFields[3] = { mapOffset +mapSize, 5, 5 };
+        oldFile.write( "\x05" "b.txt", 6 );
+        oldFile.write( (char*)secondFileFields, sizeof(secondFileFields) );
+        oldFile.write( (char*)&flags, sizeof(flags) );
+        oldFile.write( "World", 5 );
+    }
+}
+
+
+void    test_old_format()
+{
+    make_version_1_1_file( "oldformat.boff", false );
+    
+    file_disk   theFile;
+    char        buf[5] = {0};
+    if( !theFile.open( "oldformat.boff" ) || !theFile.is_valid() )
+        cout << "error: Couldn't open version 1.1 file." << endl;
+    if( !theFile.pread( "a.txt", 0, 5, buf ) || memcmp( buf, "Hello", 5 ) != 0 )
+        cout << "error: Couldn't read file from version 1.1 file." << endl;
+    theFile.append( "a.txt", " World", 6 );
+    theFile.write();
+    
+    file_disk   upgradedFile;
+    char        buf2[11] = {0};
+    if( !upgradedFile.open( "oldformat.boff" ) || !upgradedFile.is_valid() )
+        cout << "error: Couldn't reopen upgraded version 1.1 file." << endl;
+    if( !upgradedFile.pread( "a.txt", 0, 11, buf2 ) || memcmp( buf2, "Hello World", 11 ) != 0 )
+        cout << "error: Couldn't read file from upgraded version 1.1 file." << endl;
+    remove( "oldformat.boff" );
+    
+    // What the convert command does:
+    remove( "oldformat.converted.boff" );
+    if( !theFile.write_copy( "oldformat.converted.boff" ) )
+        cout << "error: Couldn't convert version 1.1 file." << endl;
+    char        header[4] = {0};
+    ifstream( "oldformat.converted.boff", ios::binary ).read( header, sizeof(header) );
+    file_disk   convertedFile;
+    if( load_le<uint32_t>( header ) < 0x0102 || !convertedFile.open( "oldformat.converted.boff" ) || !convertedFile.is_valid()
+        || !convertedFile.pread( "a.txt", 0, 11, buf2 ) || memcmp( buf2, "Hello World", 11 ) != 0 )
+        cout << "error: Converted version 1.1 file is broken." << endl;
+    remove( "oldformat.converted.boff" );
+    
+    // The map of the new format is larger, so it mustn't be written over what comes after the old one:
+    make_version_1_1_file( "oldformat.boff", true );
+    file_disk   unchangedFile;
+    if( !unchangedFile.open( "oldformat.boff" ) || !unchangedFile.write() )
+        cout << "error: Couldn't commit unchanged version 1.1 file." << endl;
+    file_disk   rewrittenFile;
+    size_t      bytesRead = 0;
+    memset( buf2, 0, sizeof(buf2) );
+    if( !rewrittenFile.open( "oldformat.boff" ) || !rewrittenFile.is_valid()
+        || !rewrittenFile.pread( "b.txt", 0, sizeof(buf2), buf2, &bytesRead ) || bytesRead != 5 || memcmp( buf2, "World", 5 ) != 0 )
+        cout << "error: Upgrading the map of a version 1.1 file overwrote the file after it." << endl;
+    remove( "oldformat.boff" );
+}
+
+
+void    test_byte_order()
+{
+    char    bytes[8] = {0};
+    store_le( bytes, (uint64_t) 0x0102030405060708ULL );
+    if( memcmp( bytes, "\x08\x07\x06\x05\x04\x03\x02\x01", 8 ) != 0 )
+        cout << "error: store_le wrote the wrong byte order." << endl;
+    if( load_le<uint64_t>( bytes ) != 0x0102030405060708ULL || load_le<uint32_t>( bytes ) != 0x05060708 || load_le<uint16_t>( bytes ) != 0x0708 )
+        cout << "error: load_le read the wrong byte order." << endl;
+    
+    // The path big-endian CPUs take:
+    little_endian_codec<uint32_t,true>::store( bytes, 0x01020304 );
+    if( little_endian_codec<uint32_t,true>::load( bytes ) != 0x01020304 || little_endian_codec<uint32_t,false>::load( bytes ) != (host_is_little_endian ? 0x04030201U : 0x01020304U) )
+        cout << "error: Byte swapping codec is broken." << endl;
+}
+
+
+static char*    new_block( const char* inString )
+{
+    char*   data = new char[strlen(inString)];
+    memcpy( data, inString, strlen(inString) );
+    return data;
+}
+
+
+void    test_dedup()
+{
+    remove( "deduptest.boff" );
+    const char*     payload = "The same texture, used by three different levels.";
+    size_t          payloadSize = strlen(payload);
+    {
+        file_disk   theFile;
+        if( !theFile.open( "deduptest.boff" ) )
+            cout << "error: Couldn't create deduptest.boff." << endl;
+        theFile.set_deduplicate( true );
+        theFile.add_file( "level1.png", new_block( payload ), payloadSize );
+        theFile.add_file( "level2.png", new_block( payload ), payloadSize );
+        theFile.add_file( "level3.png", new_block( payload ), payloadSize );
+        theFile.add_file( "other.png", new_block( "Something else entirely." ), 24 );
+        theFile.write();
+        
+        struct stats    statistics;
+        theFile.statistics( &statistics );
+        if( statistics.dedup_bytes != payloadSize * 2 || statistics.used_bytes != payloadSize +24 )
+            cout << "error: Deduplication saved " << statistics.dedup_bytes << " bytes, used " << statistics.used_bytes << " bytes." << endl;
+        if( !theFile.is_valid() )
+            cout << "error: File_disk with shared blocks is invalid." << endl;
+        
+        // Copy-on-write, the other two must keep the old contents:
+        theFile.set_file_contents( "level2.png", new_block( "Changed." ), 8 );
+        theFile.pwrite( "level3.png", 0, "THE", 3 );
+        theFile.delete_file( "level1.png" );
+        theFile.write();
+    }
+    
+    file_disk   reopenedFile;
+    char        buf[64] = {0};
+    size_t      bytesRead = 0;
+    if( !reopenedFile.open( "deduptest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: File_disk with shared blocks invalid after reopening." << endl;
+    if( !reopenedFile.pread( "level2.png", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 8 || memcmp( buf, "Changed.", 8 ) != 0 )
+        cout << "error: set_file_contents on a shared block failed." << endl;
+    if( !reopenedFile.pread( "level3.png", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != payloadSize || memcmp( buf, "THE same", 8 ) != 0 )
+        cout << "error: pwrite on a shared block failed." << endl;
+    
+    // Blocks written with deduplication stay shared when compacted, even with it off:
+    reopenedFile.add_file( "level4.png", new_block( "Changed." ), 8 );
+    reopenedFile.set_deduplicate( true );
+    reopenedFile.add_file( "level5.png", new_block( "Changed." ), 8 );
+    reopenedFile.write();
+    reopenedFile.compact();
+    struct stats    statistics;
+    reopenedFile.statistics( &statistics );
+    if( statistics.dedup_bytes != 8 || !reopenedFile.is_valid() )
+        cout << "error: Compacting lost shared blocks (" << statistics.dedup_bytes << " bytes saved)." << endl;
+    if( !reopenedFile.pread( "level5.png", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 8 || memcmp( buf, "Changed.", 8 ) != 0 )
+        cout << "error: Shared block damaged by compacting." << endl;
+    remove( "deduptest.boff" );
+}
+
+
+void    test_inline()
+{
+    remove( "inlinetest.boff" );
+    {
+        file_disk   theFile;
+        if( !theFile.open( "inlinetest.boff" ) )
+            cout << "error: Couldn't create inlinetest.boff." << endl;
+        theFile.set_inline_threshold( 16 );
+        for( int x = 0; x < 50; x++ )
+        {
+            stringstream    fileName;
+            fileName << "tiny" << x;
+            char*   data = new char[sizeof(x)];
+            memcpy( data, &x, sizeof(x) );
+            theFile.add_file( fileName.str().c_str(), data, sizeof(x) );
+        }
+        theFile.add_file( "large", new_block( "Far too long to go in the map." ), 30 );
+        theFile.write();
+        
+        struct stats    statistics;
+        theFile.statistics( &statistics );
+        if( statistics.inline_bytes != 50 * sizeof(int) || statistics.used_bytes != 30 || statistics.num_files != 51 )
+            cout << "error: Expected 200 inline bytes and 30 used, got " << statistics.inline_bytes << " and " << statistics.used_bytes << "." << endl;
+        
+        theFile.append( "tiny1", "1234567890ABCDEF", 16 );  // Grows past the threshold.
+        theFile.set_file_contents( "large", new_block( "Small now." ), 10 );
+        theFile.delete_file( "tiny2" );
+        theFile.write();
+    }
+    
+    file_disk   reopenedFile;
+    char        buf[32] = {0};
+    size_t      bytesRead = 0;
+    if( !reopenedFile.open( "inlinetest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: File_disk with inline files invalid after reopening." << endl;
+    int         value = -1;
+    if( !reopenedFile.pread( "tiny42", 0, sizeof(value), (char*)&value ) || value != 42 )
+        cout << "error: Lost inline file." << endl;
+    if( !reopenedFile.pread( "tiny1", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 20 || memcmp( buf +4, "1234567890ABCDEF", 16 ) != 0 )
+        cout << "error: Inline file grown past the threshold was damaged." << endl;
+    if( !reopenedFile.pread( "large", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 10 || memcmp( buf, "Small now.", 10 ) != 0 )
+        cout << "error: File shrunk below the threshold was damaged." << endl;
+    if( reopenedFile.pread( "tiny2", 0, sizeof(buf), buf ) )
+        cout << "error: Deleted inline file still there." << endl;
+    reopenedFile.compact();
+    if( !reopenedFile.is_valid() || !reopenedFile.pread( "tiny7", 0, sizeof(value), (char*)&value ) || value != 7 )
+        cout << "error: Lost inline file compacting." << endl;
+    remove( "inlinetest.boff" );
+}
+
+
+void    test_batch()
+{
+    remove( "batchtest.boff" );
+    file_disk   theFile;
+    if( !theFile.open( "batchtest.boff" ) )
+        cout << "error: Couldn't create batchtest.boff." << endl;
+    theFile.add_file( "keep", new_block( "Original." ), 9 );
+    theFile.add_file( "change", new_block( "Old contents." ), 13 );
+    theFile.add_file( "goner", new_block( "Delete me." ), 10 );
+    theFile.write();
+    struct stats    statsBefore;
+    theFile.statistics( &statsBefore );
+    
+    // Aborting leaves no trace:
+    theFile.begin_batch();
+    theFile.add_file( "new", new_block( "Never written." ), 14 );
+    theFile.set_file_contents( "change", new_block( "Never written either." ), 21 );
+    theFile.delete_file( "goner" );
+    char*       duplicate = new_block( "Duplicate." );
+    if( theFile.add_file( "keep", duplicate, 10 ) )
+        cout << "error: Batch let us add a file twice." << endl;
+    else
+        delete [] duplicate;    // Caller keeps ownership if adding fails.
+    theFile.abort();
+    struct stats    statsAfter;
+    theFile.statistics( &statsAfter );
+    char        buf[64] = {0};
+    size_t      bytesRead = 0;
+    if( statsAfter.free_bytes != statsBefore.free_bytes || statsAfter.num_files != statsBefore.num_files
+        || theFile.pread( "new", 0, sizeof(buf), buf ) || !theFile.pread( "goner", 0, sizeof(buf), buf ) )
+        cout << "error: Aborted batch changed the file." << endl;
+    
+    // Many changes cost one commit:
+    metrics_snapshot    metricsBefore;
+    theFile.metrics( &metricsBefore );
+    theFile.begin_batch();
+    for( int x = 0; x < 10000; x++ )
+    {
+        stringstream    fileName;
+        fileName << "batched" << x;
+        char*   data = new char[sizeof(x)];
+        memcpy( data, &x, sizeof(x) );
+        theFile.add_file( fileName.str().c_str(), data, sizeof(x) );
+    }
+    theFile.set_file_contents( "change", new_block( "New contents." ), 13 );
+    theFile.delete_file( "goner" );
+    theFile.add_file( "goner", new_block( "Back again." ), 11 );
+    if( theFile.pread( "batched7", 0, sizeof(buf), buf ) )
+        cout << "error: Batch changed the file before commit." << endl;
+    if( !theFile.commit() )
+        cout << "error: Couldn't commit batch." << endl;
+    metrics_snapshot    metricsAfter;
+    theFile.metrics( &metricsAfter );
+    if( metricsAfter.latencies[op_commit].count() != metricsBefore.latencies[op_commit].count() +1 )
+        cout << "error: Batch took " << (metricsAfter.latencies[op_commit].count() -metricsBefore.latencies[op_commit].count()) << " writes." << endl;
+    
+    file_disk   reopenedFile;
+    int         value = -1;
+    if( !reopenedFile.open( "batchtest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: File_disk invalid after committing a batch." << endl;
+    if( !reopenedFile.pread( "batched9999", 0, sizeof(value), (char*)&value ) || value != 9999 )
+        cout << "error: Lost file added in a batch." << endl;
+    if( !reopenedFile.pread( "change", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 13 || memcmp( buf, "New contents.", 13 ) != 0 )
+        cout << "error: Lost change made in a batch." << endl;
+    if( !reopenedFile.pread( "goner", 0, sizeof(buf), buf, &bytesRead ) || bytesRead != 11 || memcmp( buf, "Back again.", 11 ) != 0 )
+        cout << "error: Lost file re-added in a batch." << endl;
+    
+    // Blocks freed before a batch are only safe to reuse once that is committed:
+    theFile.delete_file( "keep" );
+    theFile.begin_batch();
+    file_disk   committedFile;
+    if( !committedFile.open( "batchtest.boff" ) || committedFile.pread( "keep", 0, sizeof(buf), buf ) )
+        cout << "error: begin_batch() didn't commit earlier changes." << endl;
+    theFile.add_file( "reuse", new_block( "Original." ), 9 );
+    if( !theFile.commit() || !theFile.is_valid() || !theFile.pread( "reuse", 0, sizeof(buf), buf ) )
+        cout << "error: Couldn't commit batch after earlier changes." << endl;
+    remove( "batchtest.boff" );
+    
+    // Deleting and re-adding a file in a batch uses the block size it was re-added with:
+    remove( "batchblocksize.boff" );
+    file_disk   blockSizeFile;
+    blockSizeFile.open( "batchblocksize.boff" );
+    blockSizeFile.add_file( "grows", new_block( "tiny" ), 4 );
+    blockSizeFile.write();
+    blockSizeFile.statistics( &statsBefore );
+    blockSizeFile.begin_batch();
+    blockSizeFile.delete_file( "grows" );
+    blockSizeFile.add_file( "grows", new_block( "tiny" ), 4, 100000 );
+    blockSizeFile.commit();
+    blockSizeFile.statistics( &statsAfter );
+    if( statsAfter.free_bytes < statsBefore.free_bytes +100000 -4 || !blockSizeFile.is_valid() )
+        cout << "error: Re-added file didn't get the block size it was added with." << endl;
+    remove( "batchblocksize.boff" );
+}
+
+
+void    test_write_back()
+{
+    remove( "writeback.boff" );
+    file_disk   theFile;
+    if( !theFile.open( "writeback.boff" ) )
+        cout << "error: Couldn't create writeback.boff." << endl;
+    theFile.write();
+    write_back_policy   policy;
+    policy.max_dirty_bytes = 4096;
+    policy.max_dirty_age = std::chrono::milliseconds(10);
+    policy.commit_interval = std::chrono::milliseconds(30);
+    theFile.start_write_back( policy );
+    for( int x = 0; x < 100; x++ )
+    {
+        stringstream    fileName;
+        fileName << "file" << x;
+        char*   data = new char[1000];
+        memset( data, x, 1000 );
+        theFile.add_file( fileName.str().c_str(), data, 1000 );
+    }
+    
+    // Nobody called write(), the thread should have done it for us:
+    std::this_thread::sleep_for( std::chrono::milliseconds(200) );
+    {
+        file_disk   otherFile;
+        char        buf[1000] = {0};
+        if( !otherFile.open( "writeback.boff" ) || !otherFile.is_valid() )
+            cout << "error: File_disk invalid after write-back." << endl;
+        if( !otherFile.pread( "file99", 0, sizeof(buf), buf ) || buf[0] != 99 || buf[999] != 99 )
+            cout << "error: File wasn't written back." << endl;
+    }
+    
+    char        buf[1000] = {0};
+    if( !theFile.pread( "file50", 0, sizeof(buf), buf ) || buf[0] != 50 || buf[999] != 50 )
+        cout << "error: Couldn't read file after its data was written back." << endl;
+    theFile.pwrite( "file50", 0, "X", 1 );
+    if( !theFile.stop_write_back() )
+        cout << "error: Final write after write-back failed." << endl;
+    file_disk   reopenedFile;
+    if( !reopenedFile.open( "writeback.boff" ) || !reopenedFile.pread( "file50", 0, sizeof(buf), buf ) || buf[0] != 'X' || buf[1] != 50 )
+        cout << "error: Change lost stopping write-back." << endl;
+    remove( "writeback.boff" );
+}
+
+
+void    test_sharded()
+{
+    const size_t    numShards = 4;
+    for( size_t x = 0; x < numShards; x++ )
+    {
+        stringstream    shardPath;
+        shardPath << "shardtest.boff.shard" << x;
+        remove( shardPath.str().c_str() );
+    }
+    {
+        sharded_file_disk   theFile;
+        if( !theFile.open( "shardtest.boff", numShards ) )
+            cout << "error: Couldn't create sharded file_disk." << endl;
+        std::vector<std::thread>    writers;
+        for( int t = 0; t < 4; t++ )
+        {
+            writers.push_back( std::thread( [&theFile,t]()
+            {
+                for( int x = t * 250; x < (t +1) * 250; x++ )
+                {
+                    stringstream    fileName;
+                    fileName << "file" << x;
+                    char*   data = new char[sizeof(x)];
+                    memcpy( data, &x, sizeof(x) );
+                    if( !theFile.add_file( fileName.str().c_str(), data, sizeof(x) ) )
+                        cout << "error: Couldn't add " << fileName.str() << " to sharded file_disk." << endl;
+                }
+            } ) );
+        }
+        for( std::thread& currThread : writers )
+            currThread.join();
+        if( !theFile.write() )
+            cout << "error: Couldn't write sharded file_disk." << endl;
+    }
+    
+    sharded_file_disk   reopenedFile;
+    if( !reopenedFile.open( "shardtest.boff", numShards ) || !reopenedFile.is_valid() )
+        cout << "error: Sharded file_disk invalid after reopening." << endl;
+    std::vector<std::string>    fileNames;
+    struct stats                statistics;
+    reopenedFile.list_files( &fileNames );
+    reopenedFile.statistics( &statistics );
+    if( fileNames.size() != 1000 || statistics.num_files != 1000 || !std::is_sorted( fileNames.begin(), fileNames.end() ) )
+        cout << "error: Sharded file_disk lists " << fileNames.size() << " files, counts " << statistics.num_files << "." << endl;
+    for( size_t x = 0; x < numShards; x++ )
+    {
+        if( reopenedFile.shard(x).list_files( &fileNames ) && fileNames.size() == 0 )
+            cout << "error: Shard " << x << " is empty." << endl;
+    }
+    int     value = -1;
+    if( !reopenedFile.pread( "file777", 0, sizeof(value), (char*)&value ) || value != 777 )
+        cout << "error: Lost file in sharded file_disk." << endl;
+    
+    // Free blocks are counted across all shards, the largest is the largest of any shard:
+    for( int x = 0; x < 1000; x += 10 )
+    {
+        stringstream    fileName;
+        fileName << "file" << x;
+        reopenedFile.delete_file( fileName.str().c_str() );
+    }
+    reopenedFile.write();
+    uint64_t    freeBlockCount = 0;
+    uint64_t    largestFreeBlock = 0;
+    for( size_t x = 0; x < numShards; x++ )
+    {
+        struct stats    shardStatistics;
+        reopenedFile.shard(x).statistics( &shardStatistics );
+        freeBlockCount += shardStatistics.free_block_count;
+        largestFreeBlock = std::max( largestFreeBlock, shardStatistics.largest_free_block );
+    }
+    reopenedFile.statistics( &statistics );
+    if( freeBlockCount == 0 || statistics.free_block_count != freeBlockCount || statistics.largest_free_block != largestFreeBlock )
+        cout << "error: Sharded file_disk counts " << statistics.free_block_count << " free blocks, largest " << statistics.largest_free_block
+            << ", shards have " << freeBlockCount << ", largest " << largestFreeBlock << "." << endl;
+    for( size_t x = 0; x < numShards; x++ )
+    {
+        stringstream    shardPath;
+        shardPath << "shardtest.boff.shard" << x;
+        remove( shardPath.str().c_str() );
+    }
+}
+
+
+// How many bytes were prefetched reading all files in the order they are on disk:
+static uint64_t read_ahead_bytes_reading_all( file_disk::access_pattern inPattern )
+{
+    file_disk   theFile;
+    theFile.open( "readahead.boff" );
+    theFile.set_access_pattern( inPattern );
+    char        buf[10000];
+    for( int x = 0; x < 100; x++ )
+    {
+        stringstream    fileName;
+        fileName << "file" << (x / 10) << (x % 10);
+        if( !theFile.pread( fileName.str().c_str(), 0, sizeof(buf), buf ) )
+            cout << "error: Couldn't read " << fileName.str() << "." << endl;
+    }
+    metrics_snapshot    metrics;
+    theFile.metrics( &metrics );
+    return metrics.counters[counter_read_ahead_bytes];
+}
+
+
+void    test_read_ahead()
+{
+    remove( "readahead.boff" );
+    {
+        file_disk   theFile;
+        theFile.open( "readahead.boff" );
+        for( int x = 0; x < 100; x++ )  // Names sort in the same order as the blocks are on disk.
+        {
+            stringstream    fileName;
+            fileName << "file" << (x / 10) << (x % 10);
+            char*   data = new char[10000];
+            memset( data, x, 10000 );
+            theFile.add_file( fileName.str().c_str(), data, 10000 );
+        }
+        theFile.write();
+    }
+    
+    if( read_ahead_bytes_reading_all( file_disk::access_normal ) == 0 )
+        cout << "error: Sequential reads weren't detected." << endl;
+    if( read_ahead_bytes_reading_all( file_disk::access_random ) != 0 )
+        cout << "error: Read ahead despite access_random." << endl;
+    remove( "readahead.boff" );
+}
+
+
+void    test_scan()
+{
+    remove( "scantest.boff" );
+    file_disk   theFile;
+    theFile.open( "scantest.boff" );
+    for( int x = 99; x >= 0; x-- )  // Names sort the other way round from how they are on disk.
+    {
+        stringstream    fileName;
+        fileName << "file" << (x / 10) << (x % 10);
+        char*   data = new char[1000 +x];
+        memset( data, x, 1000 +x );
+        theFile.add_file( fileName.str().c_str(), data, 1000 +x );
+    }
+    theFile.write();
+    theFile.delete_file( "file50" );    // Leaves a gap to skip.
+    theFile.write();
+    
+    file_disk   reopenedFile;
+    reopenedFile.open( "scantest.boff" );
+    metrics_snapshot    metricsBefore;
+    reopenedFile.metrics( &metricsBefore );
+    int         expected = 99;
+    bool        scanned = reopenedFile.scan( [&expected]( const std::string& inFileName, const char* inData, size_t inDataSize )
+    {
+        if( expected == 50 )
+            expected--;
+        stringstream    fileName;
+        fileName << "file" << (expected / 10) << (expected % 10);
+        if( inFileName != fileName.str() || inDataSize != (size_t)(1000 +expected) || inData[0] != expected || inData[inDataSize -1] != expected )
+            cout << "error: Scan returned " << inFileName << " where we expected " << fileName.str() << "." << endl;
+        expected--;
+        return true;
+    } );
+    if( !scanned || expected != -1 )
+        cout << "error: Scan stopped at file " << expected << "." << endl;
+    metrics_snapshot    metricsAfter;
+    reopenedFile.metrics( &metricsAfter );
+    if( metricsAfter.counters[counter_seeks] -metricsBefore.counters[counter_seeks] > 1 )
+        cout << "error: Scan seeked " << (metricsAfter.counters[counter_seeks] -metricsBefore.counters[counter_seeks]) << " times." << endl;
+    
+    int         numScanned = 0;
+    reopenedFile.scan( [&numScanned]( const std::string&, const char*, size_t ) { return ++numScanned < 3; } );
+    if( numScanned != 3 )
+        cout << "error: Couldn't stop scan early." << endl;
+    remove( "scantest.boff" );
+}
+
+
+void    test_read_only_index()
+{
+    remove( "indextest.boff" );
+    remove( "indextest_copy.boff" );
+    {
+        file_disk   theFile;
+        theFile.open( "indextest.boff" );
+        theFile.set_inline_threshold( 16 );
+        for( int x = 0; x < 1000; x++ )
+        {
+            stringstream    fileName;
+            fileName << "file" << x;
+            size_t  dataSize = (x % 10 == 0) ? 8 : 100;  // Every 10th file is inline.
+            char*   data = new char[dataSize];
+            memset( data, x % 256, dataSize );
+            theFile.add_file( fileName.str().c_str(), data, dataSize );
+        }
+        theFile.write();
+        theFile.delete_file( "file500" );
+        theFile.write();
+        theFile.write_copy( "indextest_copy.boff" );
+    }
+    
+    const char*     paths[] = { "indextest.boff", "indextest_copy.boff" };
+    for( const char* currPath : paths )
+    {
+        file_disk   readOnlyFile;
+        if( !readOnlyFile.open( currPath, file_disk::read_only ) )
+            cout << "error: Couldn't open " << currPath << " read-only." << endl;
+        for( int x : { 0, 1, 499, 501, 990, 999 } )
+        {
+            stringstream    fileName;
+            fileName << "file" << x;
+            char    buffer[100] = {};
+            size_t  bytesRead = 0;
+            size_t  dataSize = (x % 10 == 0) ? 8 : 100;
+            if( !readOnlyFile.pread( fileName.str().c_str(), 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != dataSize
+                || buffer[0] != (char)(x % 256) || buffer[dataSize -1] != (char)(x % 256) )
+                cout << "error: Couldn't read " << fileName.str() << " from " << currPath << " via the index." << endl;
+        }
+        char    buffer[100];
+        if( readOnlyFile.pread( "file500", 0, sizeof(buffer), buffer ) || readOnlyFile.pread( "file1000", 0, sizeof(buffer), buffer ) )
+            cout << "error: Read nonexistent file from " << currPath << " via the index." << endl;
+        metrics_snapshot    metricsAfter;
+        readOnlyFile.metrics( &metricsAfter );
+        uint64_t    bytesRead = metricsAfter.counters[counter_bytes_read];
+        if( bytesRead > 8 * 1024 )   // Opening and 8 lookups, the map alone is over 20KB.
+            cout << "error: Opening " << currPath << " and index lookups read " << bytesRead << " bytes." << endl;
+        
+        char*   data = new_block( "nope" );
+        if( readOnlyFile.add_file( "new", data, 4 ) || readOnlyFile.delete_file( "file1" ) || readOnlyFile.write() )
+            cout << "error: Could change " << currPath << " opened read-only." << endl;
+        delete [] data;
+        
+        struct stats    statistics;
+        if( !readOnlyFile.statistics( &statistics ) || statistics.num_files != 999 || !readOnlyFile.is_valid() )
+            cout << "error: Couldn't load the whole map of " << currPath << " opened read-only." << endl;
+    }
+    remove( "indextest.boff" );
+    remove( "indextest_copy.boff" );
+}
+
+
+void    test_encryption()
+{
+    remove( "cryptotest.boff" );
+    std::string     key( extent_cipher::key_size, 'k' );
+    extent_cipher*  cipher = extent_cipher::new_aes_gcm( key );
+    if( !cipher )   // Built without OpenSSL.
+    {
+        file_disk   theFile;
+        if( theFile.open( "cryptotest.boff", 0, key ) )
+            cout << "error: Opened with a key without encryption support." << endl;
+        remove( "cryptotest.boff" );
+        return;
+    }
+    delete cipher;
+    
+    std::string     secret;
+    while( secret.size() < 100000 )
+        secret += "TOP SECRET ";
+    {
+        file_disk   theFile;
+        if( !theFile.open( "cryptotest.boff", 0, key ) )
+            cout << "error: Couldn't open cryptotest.boff with a key." << endl;
+        theFile.set_inline_threshold( 64 );
+        theFile.add_file( "secret", new_block( secret.c_str() ), secret.size() );
+        theFile.add_file( "small", new_block( "TOP SECRET" ), 10 );
+        theFile.write();
+        secret.replace( 5, 6, "XXXXXX" );
+        theFile.pwrite( "secret", 5, "XXXXXX", 6 );
+        secret += "TOP SECRET";
+        theFile.append( "secret", "TOP SECRET", 10 );
+        theFile.write();
+    }
+    
+    ifstream        rawFile( "cryptotest.boff", ios::binary );
+    std::string     rawContents( (istreambuf_iterator<char>(rawFile)), istreambuf_iterator<char>() );
+    if( rawContents.find( "SECRET" ) != std::string::npos )
+        cout << "error: Encrypted file contains plaintext." << endl;
+    
+    {
+        file_disk   theFile;
+        theFile.open( "cryptotest.boff", 0, key );
+        std::vector<char>   buffer( secret.size() );
+        size_t              bytesRead = 0;
+        if( !theFile.pread( "secret", 0, buffer.size(), buffer.data(), &bytesRead ) || std::string( buffer.data(), bytesRead ) != secret )
+            cout << "error: Couldn't read back encrypted file." << endl;
+        char                part[10];
+        std::vector<read_request>   requests( 2 );
+        requests[0].name = "secret";
+        requests[0].offset = 3;
+        requests[0].length = 10;
+        requests[0].buffer = part;
+        requests[1].name = "small";
+        requests[1].offset = 0;
+        requests[1].length = 10;
+        requests[1].buffer = buffer.data();
+        if( !theFile.read_many( requests ) || memcmp( part, secret.data() +3, 10 ) != 0 || memcmp( buffer.data(), "TOP SECRET", 10 ) != 0 )
+            cout << "error: Couldn't read parts of encrypted files." << endl;
+        if( !theFile.compact() || !theFile.pread( "secret", 0, buffer.size(), buffer.data(), &bytesRead ) || std::string( buffer.data(), bytesRead ) != secret )
+            cout << "error: Couldn't read encrypted file after compacting." << endl;
+    }
+    
+    {
+        file_disk   theFile;
+        theFile.open( "cryptotest.boff", file_disk::read_only, key );
+        std::vector<char>   buffer( secret.size() );
+        size_t              bytesRead = 0;
+        if( !theFile.pread( "secret", 0, buffer.size(), buffer.data(), &bytesRead ) || std::string( buffer.data(), bytesRead ) != secret
+            || !theFile.pread( "small", 0, 10, buffer.data() ) || memcmp( buffer.data(), "TOP SECRET", 10 ) != 0 )
+            cout << "error: Couldn't read back encrypted file opened read-only." << endl;
+    }
+    
+    std::vector<char>   buffer( secret.size() );
+    file_disk   keylessFile;
+    keylessFile.open( "cryptotest.boff" );
+    std::vector<std::string>    fileNames;
+    if( keylessFile.pread( "secret", 0, buffer.size(), buffer.data() ) || !keylessFile.list_files( &fileNames ) || fileNames.size() != 2 )
+        cout << "error: Read encrypted file without a key, or couldn't list it." << endl;
+    file_disk   wrongKeyFile;
+    wrongKeyFile.open( "cryptotest.boff", 0, std::string( extent_cipher::key_size, 'x' ) );
+    if( wrongKeyFile.pread( "secret", 0, buffer.size(), buffer.data() ) )
+        cout << "error: Read encrypted file with the wrong key." << endl;
+    
+    {
+        // compact() put the blocks right after the header, so this is inside the first one:
+        fstream     tamperedFile( "cryptotest.boff", ios::binary | ios::in | ios::out );
+        char        currByte = 0;
+        tamperedFile.seekg( 17 );
+        tamperedFile.read( &currByte, 1 );
+        currByte ^= 1;
+        tamperedFile.seekp( 17 );
+        tamperedFile.write( &currByte, 1 );
+    }
+    file_disk   tamperedFile;
+    tamperedFile.open( "cryptotest.boff", 0, key );
+    if( tamperedFile.pread( "secret", 0, buffer.size(), buffer.data() ) && tamperedFile.pread( "small", 0, 10, buffer.data() ) )
+        cout << "error: Didn't notice encrypted data was changed." << endl;
+    remove( "cryptotest.boff" );
+}
+
+
+// FileDisk bench <scratch file>: How much encryption slows down writing and reading
+//  large files. The reads come from the OS's cache, so this is the worst case.
+static void run_encryption_benchmark( const char* inPath )
+{
+    const size_t        blobSize = 16 * 1024 * 1024, numBlobs = 16;
+    std::vector<char>   blob( blobSize );
+    for( size_t x = 0; x < blobSize; x++ )
+        blob[x] = (char)(x * 7);
+    const char*         labels[] = { "plain", "aes-256-gcm" };
+    std::string         keys[] = { std::string(), std::string( extent_cipher::key_size, 'k' ) };
+    for( int mode = 0; mode < 2; mode++ )
+    {
+        remove( inPath );
+        file_disk   writtenFile;
+        if( !writtenFile.open( inPath, 0, keys[mode] ) )
+        {
+            cout << labels[mode] << ": not available in this build." << endl;
+            continue;
+        }
+        chrono::steady_clock::time_point    writeStart = chrono::steady_clock::now();
+        for( size_t x = 0; x < numBlobs; x++ )
+        {
+            char*   data = new char[blobSize];
+            memcpy( data, blob.data(), blobSize );
+            writtenFile.add_file( ("blob" +to_string(x)).c_str(), data, blobSize );
+        }
+        writtenFile.write();
+        double      writeSeconds = chrono::duration<double>( chrono::steady_clock::now() -writeStart ).count();
+        
+        file_disk   readFile;
+        readFile.open( inPath, 0, keys[mode] );
+        chrono::steady_clock::time_point    readStart = chrono::steady_clock::now();
+        for( size_t x = 0; x < numBlobs; x++ )
+        {
+            if( !readFile.pread( ("blob" +to_string(x)).c_str(), 0, blobSize, blob.data() ) )
+                cout << "error: Couldn't read blob " << x << "." << endl;
+        }
+        double      readSeconds = chrono::duration<double>( chrono::steady_clock::now() -readStart ).count();
+        
+        double      totalMB = (blobSize * numBlobs) / (1024.0 * 1024.0);
+        cout << labels[mode] << ": write " << (totalMB / writeSeconds) << " MB/s, read " << (totalMB / readSeconds) << " MB/s" << endl;
+    }
+    remove( inPath );
+}
+
+
+void    test_trim()
+{
+    remove( "trimtest.boff" );
+    const size_t    blobSize = 2 * 1024 * 1024;
+    file_disk   theFile;
+    theFile.open( "trimtest.boff" );
+    growth_policy   policy;
+    policy.mode = growth_policy::geometric;    // Leave the map room for the names of the deleted files, so it doesn't move into a freed blob.
+    theFile.set_growth_policy( policy );
+    for( int x = 0; x < 4; x++ )
+    {
+        char*   data = new char[blobSize];
+        memset( data, 'a' +x, blobSize );
+        theFile.add_file( ("blob" +to_string(x)).c_str(), data, blobSize );
+    }
+    theFile.write();
+    theFile.delete_file( "blob1" );
+    theFile.delete_file( "blob2" );
+    struct stat     sizeBefore = {};
+    stat( "trimtest.boff", &sizeBefore );
+    if( !theFile.trim() )
+    {
+        cout << "note: File system can't punch holes, skipping trim test." << endl;
+        remove( "trimtest.boff" );
+        return;
+    }
+    struct stat     sizeAfter = {};
+    stat( "trimtest.boff", &sizeAfter );
+    struct stats    statistics;
+    theFile.statistics( &statistics );
+    if( statistics.sparse_bytes < 2 * (blobSize -file_disk::trim_alignment) || statistics.free_bytes < statistics.sparse_bytes )
+        cout << "error: Trimmed " << statistics.sparse_bytes << " of " << statistics.free_bytes << " free bytes." << endl;
+    // The map may grow into the rest of its block as it now lists the deleted files, but holes mustn't cut the file short:
+    if( sizeAfter.st_size < sizeBefore.st_size || (sizeBefore.st_blocks -sizeAfter.st_blocks) * 512 < (off_t)(blobSize * 3 / 2) )
+        cout << "error: Trimming only freed " << ((sizeBefore.st_blocks -sizeAfter.st_blocks) * 512) << " bytes on disk." << endl;
+    
+    // Reusing a trimmed block gets disk space for it again:
+    char*   data = new char[blobSize];
+    memset( data, 'z', blobSize );
+    theFile.add_file( "reused", data, blobSize );
+    theFile.write();
+    theFile.statistics( &statistics );
+    if( statistics.sparse_bytes >= 2 * (blobSize -file_disk::trim_alignment) || statistics.sparse_bytes == 0 )
+        cout << "error: " << statistics.sparse_bytes << " bytes still sparse after reusing a trimmed block." << endl;
+    
+    file_disk   reopenedFile;
+    reopenedFile.open( "trimtest.boff" );
+    struct stats    reopenedStatistics;
+    reopenedFile.statistics( &reopenedStatistics );
+    std::vector<char>   buffer( blobSize );
+    if( reopenedStatistics.sparse_bytes != statistics.sparse_bytes || !reopenedFile.is_valid() )
+        cout << "error: Sparse blocks weren't remembered." << endl;
+    const char*     names[] = { "blob0", "blob3", "reused" };
+    const char      contents[] = { 'a', 'd', 'z' };
+    for( int x = 0; x < 3; x++ )
+    {
+        if( !reopenedFile.pread( names[x], 0, blobSize, buffer.data() ) || buffer[0] != contents[x] || buffer[blobSize -1] != contents[x] )
+            cout << "error: Lost " << names[x] << " after trimming." << endl;
+    }
+    remove( "trimtest.boff" );
+}
+
+
+void    test_statistics()
+{
+    remove( "statstest.boff" );
+    file_disk   theFile;
+    theFile.open( "statstest.boff" );
+    theFile.set_deduplicate( true );
+    const char*     payload = "Some file contents that are long enough not to be inlined in the map.";
+    theFile.add_file( "first", new_block( payload ), strlen(payload) );
+    theFile.add_file( "copy", new_block( payload ), strlen(payload) );
+    theFile.add_file( "tiny", new_block( "x" ), 1 );
+    theFile.add_file( "big", new char[4096](), 4096 );
+    theFile.add_file( "small", new char[100](), 100, 1024 );
+    theFile.write();
+    if( !theFile.is_valid() )
+        cout << "error: Statistics went out of sync adding files." << endl;
+    
+    theFile.pwrite( "small", 0, std::vector<char>( 700, 's' ).data(), 700 );
+    theFile.set_file_contents( "tiny", new char[2048](), 2048 );
+    theFile.set_file_contents( "copy", new_block( "now different" ), 13 );
+    theFile.delete_file( "big" );
+    if( !theFile.is_valid() )
+        cout << "error: Statistics went out of sync changing files." << endl;
+    
+    struct stats    statistics;
+    theFile.statistics( &statistics );
+    if( statistics.num_files != 4 || statistics.free_block_count == 0 || statistics.largest_free_block < 4096 )
+        cout << "error: Statistics say " << statistics.num_files << " files, " << statistics.free_block_count << " free blocks, largest " << statistics.largest_free_block << " bytes." << endl;
+    
+    theFile.write();
+    file_disk   reopenedFile;
+    reopenedFile.open( "statstest.boff" );
+    struct stats    writtenStatistics, reopenedStatistics;
+    theFile.statistics( &writtenStatistics );
+    reopenedFile.statistics( &reopenedStatistics );
+    if( memcmp( &writtenStatistics, &reopenedStatistics, sizeof(writtenStatistics) ) != 0 || !theFile.is_valid() )
+        cout << "error: Statistics kept while writing differ from the file's." << endl;
+    remove( "statstest.boff" );
+}
+
+
+void    test_trace()
+{
+    remove( "tracetest.boff" );
+    remove( "tracetest.trace" );
+    remove( "replaytest.boff" );
+    struct stats    recordedStatistics;
+    {
+        trace_recorder  recorder;
+        file_disk       theFile;
+        theFile.open( "tracetest.boff" );
+        if( !recorder.open( "tracetest.trace" ) )
+            cout << "error: Couldn't create tracetest.trace." << endl;
+        theFile.set_trace( &recorder );
+        for( int x = 0; x < 20; x++ )
+            theFile.add_file( ("file" +to_string(x)).c_str(), new char[100 * (x +1)](), 100 * (x +1), (x % 4 == 0) ? 4096 : 0 );
+        theFile.write();
+        char    buffer[512] = {};
+        theFile.pwrite( "file3", 50, buffer, 200 );
+        theFile.append( "file4", buffer, 512 );
+        theFile.set_file_contents( "file5", new char[10](), 10 );
+        theFile.delete_file( "file6" );
+        theFile.pread( "file7", 0, sizeof(buffer), buffer );
+        theFile.pread( "no such file", 0, sizeof(buffer), buffer );    // Fails in the replay, too.
+        std::vector<read_request>   requests( 2 );
+        char    otherBuffer[512] = {};
+        requests[0].name = "file8"; requests[0].length = sizeof(buffer); requests[0].buffer = buffer;
+        requests[1].name = "file9"; requests[1].offset = 10; requests[1].length = sizeof(otherBuffer); requests[1].buffer = otherBuffer;
+        theFile.read_many( requests );
+        theFile.begin_batch();
+        theFile.add_file( "batched", new char[300](), 300 );
+        theFile.delete_file( "file10" );
+        theFile.commit();   // Calls add_file() and delete_file() itself, those mustn't be recorded again.
+        theFile.scan( []( const std::string&, const char*, size_t ) { return true; } );
+        theFile.write();
+        theFile.statistics( &recordedStatistics );
+        theFile.set_trace( nullptr );
+        theFile.delete_file( "file11" );   // Not recorded anymore.
+    }
+    
+    file_disk       replayedFile;
+    replayedFile.open( "replaytest.boff" );
+    replay_result   result;
+    if( !replay_trace( "tracetest.trace", replayedFile, false, &result ) )
+        cout << "error: Couldn't replay tracetest.trace." << endl;
+    if( result.num_calls != 34 || result.num_failed != 1 || result.latencies[trace_add].count() != 21 || result.recorded_latencies[trace_read_many].count() != 1 )
+        cout << "error: Replayed " << result.num_calls << " calls of which " << result.num_failed << " failed." << endl;
+    // The map differs as names are made up, but all file data ends up where it was:
+    if( result.statistics.num_files != recordedStatistics.num_files || result.statistics.used_bytes != recordedStatistics.used_bytes
+        || result.statistics.free_block_count != recordedStatistics.free_block_count || !replayedFile.is_valid() )
+        cout << "error: Replay has " << result.statistics.num_files << " files, " << result.statistics.used_bytes << " bytes used, "
+                << result.statistics.free_block_count << " free blocks, recorded " << recordedStatistics.num_files << ", "
+                << recordedStatistics.used_bytes << ", " << recordedStatistics.free_block_count << "." << endl;
+    if( result.bytes_read != 3 * 512 + result.statistics.used_bytes )  // pread(), read_many() and scan().
+        cout << "error: Replay read " << result.bytes_read << " bytes." << endl;
+    remove( "tracetest.boff" );
+    remove( "tracetest.trace" );
+    remove( "replaytest.boff" );
+}
+
+
+#if FILE_DISK_HAS_COROUTINES
+// Just enough of a coroutine type to co_await in a test. Starts right away and
+//  nobody waits for it:
+struct detached_task
+{
+    struct promise_type
+    {
+        detached_task       get_return_object()     { return detached_task(); }
+        std::suspend_never  initial_suspend()       { return {}; }
+        std::suspend_never  final_suspend() noexcept{ return {}; }
+        void                return_void()           {}
+        void                unhandled_exception()   { std::terminate(); }
+    };
+};
+
+
+static detached_task    read_then_write( async_file_disk& ioDisk, std::atomic<int>& ioNumDone )
+{
+    char            buffer[16] = {};
+    async_result    result = co_await ioDisk.async_read( "file1", 0, sizeof(buffer), buffer );
+    if( result.status != async_succeeded || result.bytes_read != sizeof(buffer) || buffer[0] != '1' )
+        cout << "error: co_await async_read() failed." << endl;
+    result = co_await ioDisk.async_set_file_contents( "file1", new_block( "changed by a coroutine" ), 22 );
+    if( result.status == async_succeeded )
+        result = co_await ioDisk.async_write();
+    if( result.status != async_succeeded )
+        cout << "error: co_await async_set_file_contents() or async_write() failed." << endl;
+    ioNumDone++;
+}
+#endif
+
+
+void    test_async()
+{
+    remove( "asynctest.boff" );
+    file_disk   theFile;
+    theFile.open( "asynctest.boff" );
+    const size_t    numFiles = 10;
+    for( size_t x = 0; x < numFiles; x++ )
+    {
+        char*   data = new char[1000];
+        memset( data, '0' +x, 1000 );
+        theFile.add_file( ("file" +to_string(x)).c_str(), data, 1000 );
+    }
+    theFile.write();
+    
+    {
+        thread_pool_backend     backend( 2 );
+        async_file_disk         asyncFile( theFile, backend );
+        
+        // Keep both threads busy until everything is queued:
+        std::promise<void>      startSignal;
+        std::shared_future<void> started = startSignal.get_future().share();
+        backend.submit( [started]() { started.wait(); } );
+        backend.submit( [started]() { started.wait(); } );
+        
+        // Many more reads in flight than there are threads:
+        const size_t        numReads = 2000;
+        std::vector<char>   buffers( numReads * 10 );
+        std::atomic<size_t> numSucceeded(0), numBytesRead(0);
+        for( size_t x = 0; x < numReads; x++ )
+        {
+            asyncFile.async_read( "file" +to_string(x % numFiles), x % 900, 10, buffers.data() +x * 10, [&numSucceeded,&numBytesRead]( const async_result& inResult )
+            {
+                if( inResult.status == async_succeeded )
+                    numSucceeded++;
+                numBytesRead += inResult.bytes_read;
+            } );
+        }
+        
+        // Cancelled while waiting in the queue:
+        cancellation_token  token;
+        std::atomic<int>    numCancelled(0);
+        auto                countCancelled = [&numCancelled]( const async_result& inResult ) { if( inResult.status == async_cancelled ) numCancelled++; };
+        asyncFile.async_set_file_contents( "file2", new_block( "never written" ), 13, countCancelled, token );
+        asyncFile.async_write( countCancelled, token );
+        token.cancel();
+        
+        startSignal.set_value();
+        asyncFile.async_set_file_contents( "file3", new_block( "written" ), 7, nullptr );
+        std::atomic<int>    numWritten(0);
+        asyncFile.async_write( [&numWritten]( const async_result& inResult ) { if( inResult.status == async_succeeded ) numWritten++; } );
+        asyncFile.wait_for_pending();
+        
+        if( numSucceeded != numReads || numBytesRead != numReads * 10 || buffers[10 * 3] != '3' || buffers[10 * (numReads -1) +9] != '0' +((numReads -1) % numFiles) )
+            cout << "error: " << numSucceeded << " of " << numReads << " async reads succeeded." << endl;
+        if( numCancelled != 2 || numWritten != 1 )
+            cout << "error: " << numCancelled << " cancelled and " << numWritten << " async writes." << endl;
+        
+#if FILE_DISK_HAS_COROUTINES
+        std::atomic<int>    numCoroutinesDone(0);
+        read_then_write( asyncFile, numCoroutinesDone );
+        asyncFile.wait_for_pending();
+        if( numCoroutinesDone != 1 )
+            cout << "error: Coroutine didn't finish." << endl;
+#endif
+    }
+    
+    file_disk   reopenedFile;
+    reopenedFile.open( "asynctest.boff" );
+    char        buffer[1000] = {};
+    size_t      bytesRead = 0;
+    if( !reopenedFile.pread( "file2", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 1000
+        || !reopenedFile.pread( "file3", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 7 || memcmp( buffer, "written", 7 ) != 0 )
+        cout << "error: Async changes didn't end up in the file." << endl;
+    remove( "asynctest.boff" );
+}
+
+
+void    test_clone()
+{
+    remove( "clonesource.boff" );
+    remove( "clone.boff" );
+    file_disk   theFile;
+    theFile.open( "clonesource.boff" );
+    theFile.add_file( "committed", new_block( "committed before cloning" ), 24 );
+    theFile.write();
+    theFile.add_file( "uncommitted", new_block( "not committed yet" ), 17 );
+    if( !theFile.clone_to( "clone.boff" ) )
+        cout << "error: Couldn't clone clonesource.boff." << endl;
+    theFile.begin_batch();
+    if( theFile.clone_to( "clone.boff" ) )
+        cout << "error: Cloned in the middle of a batch." << endl;
+    theFile.abort();
+    
+    // Both go their own ways from here:
+    file_disk   clonedFile;
+    clonedFile.open( "clone.boff" );
+    clonedFile.set_file_contents( "committed", new_block( "changed in the clone" ), 20 );
+    clonedFile.write();
+    theFile.delete_file( "uncommitted" );
+    theFile.write();
+    
+    file_disk   reopenedFile;
+    reopenedFile.open( "clonesource.boff" );
+    char        buffer[64] = {};
+    size_t      bytesRead = 0;
+    if( !clonedFile.is_valid() || !clonedFile.pread( "uncommitted", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 17 || memcmp( buffer, "not committed yet", 17 ) != 0 )
+        cout << "error: Clone is missing uncommitted changes." << endl;
+    if( !clonedFile.pread( "committed", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 20 || memcmp( buffer, "changed in the clone", 20 ) != 0 )
+        cout << "error: Clone didn't keep its own changes." << endl;
+    if( !reopenedFile.is_valid() || reopenedFile.pread( "uncommitted", 0, sizeof(buffer), buffer )
+        || !reopenedFile.pread( "committed", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 24 || memcmp( buffer, "committed before cloning", 24 ) != 0 )
+        cout << "error: Changes to the clone showed up in the original." << endl;
+    remove( "clonesource.boff" );
+    remove( "clone.boff" );
+}
+
+
+void    test_delta()
+{
+    remove( "deltasource.boff" );
+    remove( "deltareplica.boff" );
+    file_disk   theFile;
+    theFile.open( "deltasource.boff" );
+    if( theFile.generation() != 0 )
+        cout << "error: New file doesn't start at generation 0." << endl;
+    theFile.add_file( "unchanged", new_block( "stays the same" ), 14 );
+    theFile.add_file( "changed", new_block( "first version" ), 13 );
+    theFile.add_file( "deleted", new_block( "goes away" ), 9 );
+    theFile.write();
+    theFile.write();    // Nothing changed, so no new generation.
+    if( theFile.generation() != 1 )
+        cout << "error: Expected generation 1 after first commit, got " << theFile.generation() << "." << endl;
+    
+    // Bring a replica up to generation 1:
+    file_disk           replica;
+    replica.open( "deltareplica.boff" );
+    std::stringstream   firstDelta;
+    if( !theFile.write_delta( 0, firstDelta ) || !replica.apply_delta( firstDelta ) || replica.generation() != 1 )
+        cout << "error: Couldn't apply delta from generation 0." << endl;
+    
+    theFile.set_file_contents( "changed", new_block( "second version" ), 14 );
+    theFile.delete_file( "deleted" );
+    theFile.add_file( "added", new_block( "new in 2" ), 8 );
+    theFile.write();
+    
+    std::vector<file_change>    changes;
+    char                        buffer[64] = {};
+    size_t                      bytesRead = 0;
+    if( !theFile.changes_since( 1, &changes ) || changes.size() != 3
+        || changes[0].name != "added" || changes[0].deleted || changes[0].generation != 2
+        || changes[1].name != "changed" || changes[1].deleted
+        || changes[2].name != "deleted" || !changes[2].deleted || changes[2].generation != 2 )
+        cout << "error: changes_since() didn't report the right changes." << endl;
+    
+    // A size that's damaged or larger than what follows mustn't make us allocate it:
+    std::stringstream   damagedDelta;
+    char                deltaHeader[sizeof(uint32_t) +2 * sizeof(uint64_t)];
+    store_le( deltaHeader, (uint32_t)0x100 );
+    store_le( deltaHeader +sizeof(uint32_t), (uint64_t)0 );
+    store_le( deltaHeader +sizeof(uint32_t) +sizeof(uint64_t), (uint64_t)5 );
+    damagedDelta.write( deltaHeader, sizeof(deltaHeader) );
+    damagedDelta.put( 1 );  // Changed file.
+    write_varint( damagedDelta, 7 );
+    damagedDelta.write( "damaged", 7 );
+    write_varint( damagedDelta, UINT64_MAX / 2 );
+    damagedDelta.write( "short", 5 );
+    if( replica.apply_delta( damagedDelta ) || replica.generation() != 1 || replica.pread( "damaged", 0, 1, buffer ) )
+        cout << "error: Applied a damaged delta." << endl;
+    
+    std::stringstream   tooNewDelta;
+    theFile.write_delta( 2, tooNewDelta );
+    if( replica.apply_delta( tooNewDelta ) )
+        cout << "error: Applied a delta that skips a generation." << endl;
+    
+    std::stringstream   secondDelta;
+    if( !theFile.write_delta( 1, secondDelta ) || !replica.apply_delta( secondDelta ) || replica.generation() != 2 )
+        cout << "error: Couldn't apply delta from generation 1." << endl;
+    
+    file_disk   reopenedReplica;
+    reopenedReplica.open( "deltareplica.boff" );
+    if( !reopenedReplica.is_valid() || reopenedReplica.generation() != 2 || reopenedReplica.pread( "deleted", 0, sizeof(buffer), buffer )
+        || !reopenedReplica.pread( "changed", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 14 || memcmp( buffer, "second version", 14 ) != 0
+        || !reopenedReplica.pread( "added", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 8 || memcmp( buffer, "new in 2", 8 ) != 0
+        || !reopenedReplica.pread( "unchanged", 0, sizeof(buffer), buffer, &bytesRead ) || bytesRead != 14 || memcmp( buffer, "stays the same", 14 ) != 0 )
+        cout << "error: Replica doesn't match the source after applying deltas." << endl;
+    
+    // Deleted names are remembered across reopening until we forget them:
+    file_disk   reopenedFile;
+    reopenedFile.open( "deltasource.boff" );
+    changes.clear();
+    if( !reopenedFile.changes_since( 1, &changes ) || changes.size() != 3 || !changes[2].deleted )
+        cout << "error: Deleted names weren't saved." << endl;
+    reopenedFile.forget_deletions_before( 3 );
+    changes.clear();
+    if( !reopenedFile.changes_since( 1, &changes ) || changes.size() != 2 || !reopenedFile.is_valid() )
+        cout << "error: forget_deletions_before() didn't forget." << endl;
+    remove( "deltasource.boff" );
+    remove( "deltareplica.boff" );
+}
+
+
+// Puts the map in a free block it exactly fills, right before 200 small files, and
+//  returns its size. The block is the size the map needs if inHoleSize is 0.
+uint64_t    make_tightly_packed_map( const char* inPath, uint64_t inHoleSize )
+{
+    remove( inPath );
+    file_disk   theFile;
+    theFile.open( inPath );
+    uint64_t    holeSize = inHoleSize ? inHoleSize : 1000000;
+    theFile.add_file( "hole", new char[holeSize](), holeSize );
+    for( int x = 0; x < 200; x++ )
+    {
+        stringstream    fileName;
+        fileName << "file" << setfill('0') << setw(3) << x;
+        theFile.add_file( fileName.str().c_str(), new_block( "data" ), 4 );
+    }
+    theFile.write();
+    theFile.add_file( std::string( 200, 't' ).c_str(), new_block( "data" ), 4 ); // Map gets too large for its block and moves into the hole.
+    theFile.delete_file( "hole" );
+    theFile.write();
+    
+    struct stats    statistics;
+    theFile.statistics( &statistics );
+    return statistics.map_bytes;
+}
+
+
+void    test_generation_growth()
+{
+    // Generations are varints, so map entries grow a byte when a file changes in generation 128:
+    uint64_t    mapSize = make_tightly_packed_map( "generationtest.boff", 0 );
+    make_tightly_packed_map( "generationtest.boff", mapSize );
+    file_disk   theFile;
+    theFile.open( "generationtest.boff" );
+    while( theFile.generation() < 130 )
+    {
+        theFile.set_file_contents( "file000", new_block( "more" ), 4 );
+        theFile.write();
+    }
+    for( int x = 0; x < 200; x++ )
+    {
+        stringstream    fileName;
+        fileName << "file" << setfill('0') << setw(3) << x;
+        theFile.set_file_contents( fileName.str().c_str(), new_block( "last" ), 4 );
+    }
+    theFile.write();
+    
+    file_disk   reopenedFile;
+    if( !reopenedFile.open( "generationtest.boff" ) || !reopenedFile.is_valid() )
+        cout << "error: Map overflowed its block when generations grew." << endl;
+    for( int x = 0; x < 200; x++ )
+    {
+        stringstream    fileName;
+        fileName << "file" << setfill('0') << setw(3) << x;
+        char        buffer[4] = {};
+        if( !reopenedFile.pread( fileName.str().c_str(), 0, sizeof(buffer), buffer ) || memcmp( buffer, "last", 4 ) != 0 )
+        {
+            cout << "error: " << fileName.str() << " was overwritten when generations grew." << endl;
+            break;
+        }
+    }
+    remove( "generationtest.boff" );
+}
+
+
 int main(int argc, const char * argv[])
 {
+    if( argc == 4 && strcmp( argv[1], "convert" ) == 0 )   // FileDisk convert <old file> <new file>
+    {
+        file_disk   oldFile;
+        if( !oldFile.open( argv[2], file_disk::read_only ) || !oldFile.write_copy( argv[3] ) )
+        {
+            cerr << "Couldn't convert " << argv[2] << " to " << argv[3] << "." << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if( (argc == 4 || argc == 5) && strcmp( argv[1], "replay" ) == 0 )  // FileDisk replay <trace> <new file> [realtime]
+    {
+        file_disk       newFile;
+        replay_result   result;
+        remove( argv[3] );
+        if( !newFile.open( argv[3] ) || !replay_trace( argv[2], newFile, argc == 5 && strcmp( argv[4], "realtime" ) == 0, &result ) )
+        {
+            cerr << "Couldn't replay " << argv[2] << " into " << argv[3] << "." << endl;
+            return 1;
+        }
+        result.print( cout );
+        return 0;
+    }
+    
+    if( argc == 3 && strcmp( argv[1], "bench" ) == 0 )
+    {
+        run_encryption_benchmark( argv[2] );
+        return 0;
+    }
+    
     test_indexes();
+    test_byte_order();
+    test_histogram();
+    test_growth_policy();
+    test_aligned_layout( 0 );
+    test_aligned_layout( file_disk::direct_io );
+    test_append();
+    test_read_many();
+    test_long_names();
+    test_old_format();
+    test_dedup();
+    test_inline();
+    test_batch();
+    test_write_back();
+    test_sharded();
+    test_read_ahead();
+    test_scan();
+    test_read_only_index();
+    test_encryption();
+    test_trim();
+    test_statistics();
+    test_trace();
+    test_async();
+    test_clone();
+    test_delta();
+    test_generation_growth();
     
     file_disk   theFile;
     if( !theFile.open("testfile.boff") )
@@ -169,5 +1674,9 @@ int main(int argc, const char * argv[])
         theFile.print( cout );
     }
     
+    struct metrics_snapshot    metrics;
+    theFile.metrics( &metrics );
+    metrics.print( cout );
+    
     return 0;
 }
@@ -0,0 +1,158 @@
+//
+//  metrics.cpp
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#include "metrics.h"
+
+
+using namespace std;
+
+
+namespace fld
+{
+
+static const char*  sOperationNames[op_count] = { "add", "set", "delete", "read", "commit", "compact", "write" };
+static const char*  sCounterNames[counter_count] = { "bytes_read", "bytes_written", "seeks", "cache_hits", "cache_misses", "read_ahead_bytes" };
+
+static std::atomic<uint64_t>    sNextCollectorSerial(1);
+
+
+metrics_collector::metrics_collector()
+    : mSerial(sNextCollectorSerial++)
+{
+
+}
+
+
+metrics_collector::~metrics_collector()
+{
+    for( auto& currShard : mShards )
+        delete currShard.second;
+}
+
+
+metrics_shard&  metrics_collector::shard()
+{
+    // Most of the time, a thread keeps talking to the same file_disk, so
+    //  remember the last shard we handed out and skip the lock:
+    static thread_local uint64_t        sLastSerial = 0;
+    static thread_local metrics_shard*  sLastShard = nullptr;
+    if( sLastSerial == mSerial )
+        return *sLastShard;
+
+    std::lock_guard<std::mutex> lock(mShardsLock);
+    std::thread::id             currThread = std::this_thread::get_id();
+    metrics_shard*              foundShard = nullptr;
+    for( auto& currShard : mShards )
+    {
+        if( currShard.first == currThread )
+        {
+            foundShard = currShard.second;
+            break;
+        }
+    }
+    if( !foundShard )
+    {
+        foundShard = new metrics_shard;
+        mShards.push_back( std::make_pair( currThread, foundShard ) );
+    }
+
+    sLastSerial = mSerial;
+    sLastShard = foundShard;
+
+    return *foundShard;
+}
+
+
+void    metrics_collector::snapshot( metrics_snapshot* outSnapshot ) const
+{
+    *outSnapshot = metrics_snapshot();
+
+    std::lock_guard<std::mutex> lock(mShardsLock);
+    for( auto& currShard : mShards )
+    {
+        for( size_t x = 0; x < op_count; x++ )
+            outSnapshot->latencies[x].merge( currShard.second->latencies[x] );
+        outSnapshot->free_list_scans.merge( currShard.second->free_list_scans );
+        for( size_t x = 0; x < counter_count; x++ )
+            outSnapshot->counters[x] += currShard.second->counters[x].load();
+    }
+}
+
+
+void    metrics_snapshot::print( std::ostream& output ) const
+{
+    for( size_t x = 0; x < op_count; x++ )
+    {
+        const histogram&    currHistogram = latencies[x];
+        uint64_t            numCalls = currHistogram.count();
+        output << sOperationNames[x] << ": " << numCalls << " calls";
+        if( numCalls > 0 )
+        {
+            output << ", mean " << (currHistogram.sum() / numCalls) << " ns"
+                    << ", p50 " << currHistogram.percentile(50) << " ns"
+                    << ", p99 " << currHistogram.percentile(99) << " ns"
+                    << ", p99.9 " << currHistogram.percentile(99.9) << " ns";
+        }
+        output << endl;
+    }
+
+    uint64_t    numScans = free_list_scans.count();
+    output << "free_list_scans: " << numScans << " scans";
+    if( numScans > 0 )
+        output << ", mean " << (free_list_scans.sum() / numScans) << " blocks, p99 " << free_list_scans.percentile(99) << " blocks";
+    output << endl;
+
+    for( size_t x = 0; x < counter_count; x++ )
+        output << sCounterNames[x] << ": " << counters[x] << endl;
+
+    uint64_t    numLookups = counters[counter_cache_hits] + counters[counter_cache_misses];
+    if( numLookups > 0 )
+        output << "cache_hit_rate: " << ((counters[counter_cache_hits] * 100.0) / numLookups) << "%" << endl;
+}
+
+
+static void print_histogram_json( std::ostream& output, const histogram& inHistogram )
+{
+    uint64_t    numValues = inHistogram.count();
+    output << "{\"count\":" << numValues << ",\"sum\":" << inHistogram.sum()
+            << ",\"p50\":" << inHistogram.percentile(50)
+            << ",\"p90\":" << inHistogram.percentile(90)
+            << ",\"p99\":" << inHistogram.percentile(99)
+            << ",\"p999\":" << inHistogram.percentile(99.9)
+            << ",\"buckets\":[";
+    bool    first = true;
+    for( size_t x = 0; x < histogram::bucket_count; x++ )  // Only non-empty buckets, as [ lowest value, count ] pairs.
+    {
+        if( inHistogram.bucket(x) == 0 )
+            continue;
+        if( !first )
+            output << ",";
+        output << "[" << histogram::lowest_value_in_bucket(x) << "," << inHistogram.bucket(x) << "]";
+        first = false;
+    }
+    output << "]}";
+}
+
+
+void    metrics_snapshot::print_json( std::ostream& output ) const
+{
+    output << "{\"latencies_ns\":{";
+    for( size_t x = 0; x < op_count; x++ )
+    {
+        if( x > 0 )
+            output << ",";
+        output << "\"" << sOperationNames[x] << "\":";
+        print_histogram_json( output, latencies[x] );
+    }
+    output << "},\"free_list_scans\":";
+    print_histogram_json( output, free_list_scans );
+    for( size_t x = 0; x < counter_count; x++ )
+        output << ",\"" << sCounterNames[x] << "\":" << counters[x];
+    output << "}" << endl;
+}
+
+} /* namespace fld */
@@ -0,0 +1,251 @@
+//
+//  metrics.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__metrics__
+#define __FileDisk__metrics__
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+
+namespace fld
+{
+
+enum metrics_operation
+{
+    op_add = 0,
+    op_set,
+    op_delete,
+    op_read,
+    op_commit,
+    op_compact,
+    op_write,       // append() and pwrite().
+    op_count        // Number of operations, not an operation itself.
+};
+
+
+enum metrics_counter
+{
+    counter_bytes_read = 0,
+    counter_bytes_written,
+    counter_seeks,
+    counter_cache_hits,     // read() served from a node's mCachedData.
+    counter_cache_misses,   // read() had to go to the file.
+    counter_read_ahead_bytes,   // Bytes we asked the OS to prefetch because reads looked sequential.
+    counter_count   // Number of counters, not a counter itself.
+};
+
+
+// Counter that is only ever written by one thread, but may be read by others
+//  while it is being written. Relaxed load + store is much cheaper than a
+//  locked read-modify-write, and good enough for statistics.
+class relaxed_counter
+{
+public:
+    relaxed_counter() : mValue(0) {}
+
+    uint64_t    load() const                { return mValue.load( std::memory_order_relaxed ); }
+    void        add( uint64_t inAmount )    { mValue.store( mValue.load( std::memory_order_relaxed ) +inAmount, std::memory_order_relaxed ); }
+    void        reset()                     { mValue.store( 0, std::memory_order_relaxed ); }
+
+protected:
+    std::atomic<uint64_t>   mValue;
+};
+
+
+// HDR-style histogram: values below 32 get a bucket each, above that each
+//  power of two is split into 16 linear sub-buckets, so every bucket is
+//  accurate to within ~6% of the values it holds.
+template<class Counter>
+class basic_histogram
+{
+public:
+    enum
+    {
+        sub_bucket_bits = 5,
+        sub_bucket_half = (1 << (sub_bucket_bits -1)),
+        bucket_count = (64 -sub_bucket_bits) * sub_bucket_half + (1 << sub_bucket_bits)
+    };
+
+    static size_t   bucket_for_value( uint64_t inValue );
+    static uint64_t lowest_value_in_bucket( size_t inBucket );
+
+    void        record( uint64_t inValue )  { mBuckets[bucket_for_value(inValue)].add( 1 ); mSum.add( inValue ); }
+
+    template<class OtherCounter>
+    void        merge( const basic_histogram<OtherCounter>& inOther );
+
+    uint64_t    count() const;
+    uint64_t    sum() const                 { return mSum.load(); }
+    uint64_t    percentile( double inPercent ) const;  // Approximate value below which inPercent (0...100) of recorded values lie.
+    uint64_t    bucket( size_t inBucket ) const { return mBuckets[inBucket].load(); }
+
+protected:
+    Counter     mBuckets[bucket_count];
+    Counter     mSum;
+
+    template<class OtherCounter> friend class basic_histogram;
+};
+
+
+class plain_counter
+{
+public:
+    plain_counter() : mValue(0) {}
+
+    uint64_t    load() const                { return mValue; }
+    void        add( uint64_t inAmount )    { mValue += inAmount; }
+    void        reset()                     { mValue = 0; }
+
+protected:
+    uint64_t    mValue;
+};
+
+
+typedef basic_histogram<plain_counter>  histogram;
+
+
+// What metrics() hands back: Counters from all threads added up.
+struct metrics_snapshot
+{
+    histogram   latencies[op_count];    // Nanoseconds per call, by metrics_operation.
+    histogram   free_list_scans;        // Number of free blocks looked at per allocation.
+    uint64_t    counters[counter_count];// Indexed by metrics_counter.
+
+    metrics_snapshot()  { memset( counters, 0, sizeof(counters) ); }
+
+    void    print( std::ostream& output ) const;
+    void    print_json( std::ostream& output ) const;
+};
+
+
+// One of these exists per thread per file_disk. Only the owning thread ever
+//  writes to it, everyone may read.
+struct metrics_shard
+{
+    basic_histogram<relaxed_counter>    latencies[op_count];
+    basic_histogram<relaxed_counter>    free_list_scans;
+    relaxed_counter                     counters[counter_count];
+};
+
+
+class metrics_collector
+{
+public:
+    metrics_collector();
+    ~metrics_collector();
+
+    void    record_latency( metrics_operation inOperation, uint64_t inNanoseconds ) { shard().latencies[inOperation].record( inNanoseconds ); }
+    void    record_free_list_scan( uint64_t inNumBlocksExamined )                   { shard().free_list_scans.record( inNumBlocksExamined ); }
+    void    add( metrics_counter inCounter, uint64_t inAmount )                     { shard().counters[inCounter].add( inAmount ); }
+
+    void    snapshot( metrics_snapshot* outSnapshot ) const;
+
+protected:
+    metrics_shard&  shard();    // The calling thread's shard, created on first use.
+
+    metrics_collector( const metrics_collector& ) = delete;
+    metrics_collector& operator =( const metrics_collector& ) = delete;
+
+protected:
+    uint64_t                            mSerial;        // Unique for every collector ever created, so thread-local caches never confuse a new collector with a deleted one at the same address.
+    mutable std::mutex                  mShardsLock;    // Protects mShards, not their contents.
+    std::vector<std::pair<std::thread::id,metrics_shard*>>  mShards;
+};
+
+
+// Records the time between its construction and destruction as the latency
+//  of one call to inOperation.
+class metrics_timer
+{
+public:
+    metrics_timer( metrics_collector& inCollector, metrics_operation inOperation )
+        : mCollector(inCollector), mOperation(inOperation), mStartTime(std::chrono::steady_clock::now()) {}
+    ~metrics_timer()    { mCollector.record_latency( mOperation, std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() -mStartTime ).count() ); }
+
+protected:
+    metrics_collector&                      mCollector;
+    metrics_operation                       mOperation;
+    std::chrono::steady_clock::time_point   mStartTime;
+};
+
+
+template<class Counter>
+size_t  basic_histogram<Counter>::bucket_for_value( uint64_t inValue )
+{
+    if( inValue < (1 << sub_bucket_bits) )
+        return (size_t) inValue;
+
+    int         highestBit = 63 -__builtin_clzll( inValue );
+    int         shift = highestBit -(sub_bucket_bits -1);
+    uint64_t    subBucket = inValue >> shift;   // Always between sub_bucket_half and 2 * sub_bucket_half.
+    return (size_t)( shift * sub_bucket_half + subBucket );
+}
+
+
+template<class Counter>
+uint64_t    basic_histogram<Counter>::lowest_value_in_bucket( size_t inBucket )
+{
+    if( inBucket < (1 << sub_bucket_bits) )
+        return inBucket;
+
+    size_t      shift = (inBucket / sub_bucket_half) -1;
+    uint64_t    subBucket = (inBucket % sub_bucket_half) + sub_bucket_half;
+    return subBucket << shift;
+}
+
+
+template<class Counter>
+template<class OtherCounter>
+void    basic_histogram<Counter>::merge( const basic_histogram<OtherCounter>& inOther )
+{
+    for( size_t x = 0; x < bucket_count; x++ )
+        mBuckets[x].add( inOther.mBuckets[x].load() );
+    mSum.add( inOther.mSum.load() );
+}
+
+
+template<class Counter>
+uint64_t    basic_histogram<Counter>::count() const
+{
+    uint64_t    total = 0;
+    for( size_t x = 0; x < bucket_count; x++ )
+        total += mBuckets[x].load();
+    return total;
+}
+
+
+template<class Counter>
+uint64_t    basic_histogram<Counter>::percentile( double inPercent ) const
+{
+    uint64_t    total = count();
+    if( total == 0 )
+        return 0;
+
+    uint64_t    wanted = (uint64_t)((inPercent / 100.0) * total + 0.5);
+    if( wanted < 1 )
+        wanted = 1;
+    uint64_t    seen = 0;
+    for( size_t x = 0; x < bucket_count; x++ )
+    {
+        seen += mBuckets[x].load();
+        if( seen >= wanted )
+            return lowest_value_in_bucket( x );
+    }
+
+    return lowest_value_in_bucket( bucket_count -1 );
+}
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__metrics__) */
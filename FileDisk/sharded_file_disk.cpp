@@ -0,0 +1,269 @@
+//
+//  sharded_file_disk.cpp
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#include "sharded_file_disk.h"
+#include "content_hash.h"
+#include <sstream>
+#include <algorithm>
+
+
+using namespace std;
+
+
+namespace fld
+{
+
+sharded_file_disk::sharded_file_disk()
+{
+    
+}
+
+
+sharded_file_disk::~sharded_file_disk()
+{
+    close();
+}
+
+
+void    sharded_file_disk::close()
+{
+    for( file_disk* currShard : mShards )
+        delete currShard;
+    mShards.clear();
+}
+
+
+bool    sharded_file_disk::open( const std::string& inPath, size_t inNumShards, file_disk::open_flags_t inFlags, const std::string& inKey )
+{
+    close();
+    if( inNumShards < 1 )
+        return false;
+    
+    for( size_t x = 0; x < inNumShards; x++ )
+        mShards.push_back( new file_disk );
+    
+    return on_all_shards( [&inPath,inFlags,&inKey,this]( size_t inShardIndex )
+    {
+        stringstream    shardPath;
+        shardPath << inPath << ".shard" << inShardIndex;
+        return mShards[inShardIndex]->open( shardPath.str(), inFlags, inKey );
+    } );
+}
+
+
+bool    sharded_file_disk::write()
+{
+    return on_all_shards( [this]( size_t inShardIndex ) { return mShards[inShardIndex]->write(); } );
+}
+
+
+bool    sharded_file_disk::compact()
+{
+    return on_all_shards( [this]( size_t inShardIndex ) { return mShards[inShardIndex]->compact(); } );
+}
+
+
+bool    sharded_file_disk::on_all_shards( const std::function<bool(size_t inShardIndex)>& inAction )
+{
+    if( mShards.size() == 0 )
+        return false;
+    
+    std::vector<char>           results( mShards.size(), false );
+    std::vector<std::thread>    threads;
+    threads.reserve( mShards.size() -1 );
+    for( size_t x = 1; x < mShards.size(); x++ )
+        threads.push_back( std::thread( [&inAction,&results,x]() { results[x] = inAction( x ); } ) );
+    results[0] = inAction( 0 ); // Might as well do one ourselves.
+    for( std::thread& currThread : threads )
+        currThread.join();
+    
+    return std::find( results.begin(), results.end(), false ) == results.end();
+}
+
+
+size_t  sharded_file_disk::shard_index_for_name( const char* inFileName ) const
+{
+    return (size_t)( content_hash( inFileName, strlen(inFileName) ) % mShards.size() );
+}
+
+
+bool    sharded_file_disk::add_file( const char* inFileName, char* inData, size_t dataSize, size_t blockSize )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->add_file( inFileName, inData, dataSize, blockSize );
+}
+
+
+bool    sharded_file_disk::set_file_contents( const char* inFileName, char* inData, size_t dataSize )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->set_file_contents( inFileName, inData, dataSize );
+}
+
+
+bool    sharded_file_disk::append( const char* inFileName, const char* inData, size_t dataSize )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->append( inFileName, inData, dataSize );
+}
+
+
+bool    sharded_file_disk::pwrite( const char* inFileName, uint64_t inOffset, const char* inData, size_t dataSize )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->pwrite( inFileName, inOffset, inData, dataSize );
+}
+
+
+bool    sharded_file_disk::pread( const char* inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, size_t* outBytesRead )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->pread( inFileName, inOffset, inNumBytes, outBuf, outBytesRead );
+}
+
+
+bool    sharded_file_disk::read_many( std::vector<read_request>& ioRequests )
+{
+    if( mShards.size() == 0 )
+        return false;
+    
+    std::vector<std::vector<read_request>>  requestsByShard( mShards.size() );
+    std::vector<std::vector<size_t>>        originalIndexes( mShards.size() );
+    for( size_t x = 0; x < ioRequests.size(); x++ )
+    {
+        size_t  shardIndex = shard_index_for_name( ioRequests[x].name.c_str() );
+        requestsByShard[shardIndex].push_back( ioRequests[x] );
+        originalIndexes[shardIndex].push_back( x );
+    }
+    
+    bool    allSucceeded = true;
+    for( size_t shardIndex = 0; shardIndex < mShards.size(); shardIndex++ )
+    {
+        if( requestsByShard[shardIndex].size() == 0 )
+            continue;
+        allSucceeded = mShards[shardIndex]->read_many( requestsByShard[shardIndex] ) && allSucceeded;
+        for( size_t x = 0; x < requestsByShard[shardIndex].size(); x++ )
+        {
+            read_request&   originalRequest = ioRequests[originalIndexes[shardIndex][x]];
+            originalRequest.bytes_read = requestsByShard[shardIndex][x].bytes_read;
+            originalRequest.succeeded = requestsByShard[shardIndex][x].succeeded;
+        }
+    }
+    
+    return allSucceeded;
+}
+
+
+bool    sharded_file_disk::delete_file( const char* inFileName )
+{
+    if( mShards.size() == 0 )
+        return false;
+    return mShards[shard_index_for_name( inFileName )]->delete_file( inFileName );
+}
+
+
+bool    sharded_file_disk::list_files( std::vector<std::string>* outFileNames )
+{
+    outFileNames->clear();
+    std::vector<std::string>    shardFileNames;
+    for( file_disk* currShard : mShards )
+    {
+        if( !currShard->list_files( &shardFileNames ) )
+            return false;
+        outFileNames->insert( outFileNames->end(), shardFileNames.begin(), shardFileNames.end() );
+    }
+    std::sort( outFileNames->begin(), outFileNames->end() );
+    
+    return true;
+}
+
+
+bool    sharded_file_disk::scan( const file_disk::scan_callback& inCallback )
+{
+    bool    keepGoing = true;
+    auto    callbackUntilStopped = [&inCallback,&keepGoing]( const std::string& inFileName, const char* inData, size_t inDataSize )
+    {
+        keepGoing = inCallback( inFileName, inData, inDataSize );
+        return keepGoing;
+    };
+    for( size_t x = 0; x < mShards.size() && keepGoing; x++ )
+    {
+        if( !mShards[x]->scan( callbackUntilStopped ) )
+            return false;
+    }
+    
+    return true;
+}
+
+
+bool    sharded_file_disk::statistics( struct stats* outStatistics )
+{
+    memset( outStatistics, 0, sizeof(struct stats) );
+    
+    for( file_disk* currShard : mShards )
+    {
+        struct stats    shardStatistics;
+        if( !currShard->statistics( &shardStatistics ) )
+            return false;
+        outStatistics->used_bytes += shardStatistics.used_bytes;
+        outStatistics->free_bytes += shardStatistics.free_bytes;
+        outStatistics->map_bytes += shardStatistics.map_bytes;
+        outStatistics->header_bytes += shardStatistics.header_bytes;
+        outStatistics->name_bytes += shardStatistics.name_bytes;
+        outStatistics->num_files += shardStatistics.num_files;
+        outStatistics->dedup_bytes += shardStatistics.dedup_bytes;
+        outStatistics->inline_bytes += shardStatistics.inline_bytes;
+        outStatistics->index_bytes += shardStatistics.index_bytes;
+        outStatistics->sparse_bytes += shardStatistics.sparse_bytes;
+        outStatistics->free_block_count += shardStatistics.free_block_count;
+        outStatistics->largest_free_block = std::max( outStatistics->largest_free_block, shardStatistics.largest_free_block );
+    }
+    
+    return true;
+}
+
+
+bool    sharded_file_disk::metrics( struct metrics_snapshot* outMetrics )
+{
+    *outMetrics = metrics_snapshot();
+    
+    for( file_disk* currShard : mShards )
+    {
+        metrics_snapshot    shardMetrics;
+        if( !currShard->metrics( &shardMetrics ) )
+            return false;
+        for( size_t x = 0; x < op_count; x++ )
+            outMetrics->latencies[x].merge( shardMetrics.latencies[x] );
+        outMetrics->free_list_scans.merge( shardMetrics.free_list_scans );
+        for( size_t x = 0; x < counter_count; x++ )
+            outMetrics->counters[x] += shardMetrics.counters[x];
+    }
+    
+    return true;
+}
+
+
+bool    sharded_file_disk::is_valid()
+{
+    if( mShards.size() == 0 )
+        return false;
+    
+    for( file_disk* currShard : mShards )
+    {
+        if( !currShard->is_valid() )
+            return false;
+    }
+    
+    return true;
+}
+
+} /* namespace fld */
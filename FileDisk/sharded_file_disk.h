@@ -0,0 +1,66 @@
+//
+//  sharded_file_disk.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__sharded_file_disk__
+#define __FileDisk__sharded_file_disk__
+
+#include "file_disk.h"
+#include <functional>
+
+
+namespace fld
+{
+
+// Spreads files over several file_disks ("shards") by a hash of their name, so
+//  threads working on different files mostly don't wait for each other, and
+//  write() and compact() can work on all shards at once. Each shard is its own
+//  file on disk, named <path>.shard<n>. Always open with the same number of
+//  shards, or files will be looked for in the wrong shard.
+class sharded_file_disk
+{
+public:
+    sharded_file_disk();
+    ~sharded_file_disk();
+    
+    bool            open( const std::string& inPath, size_t inNumShards, file_disk::open_flags_t inFlags = 0, const std::string& inKey = std::string() );
+    bool            write();    // Commits all shards in parallel.
+    bool            compact();  // Compacts all shards in parallel.
+    
+    size_t          shard_count() const                 { return mShards.size(); }
+    file_disk&      shard( size_t inIndex )             { return *mShards[inIndex]; }   // To change settings or start write-back on each shard.
+    size_t          shard_index_for_name( const char* inFileName ) const;
+    
+    // Same as on file_disk, but go to the shard that holds inFileName:
+    bool            add_file( const char* inFileName, char* inData, size_t dataSize, size_t blockSize = 0 );
+    bool            set_file_contents( const char* inFileName, char* inData, size_t dataSize );
+    bool            append( const char* inFileName, const char* inData, size_t dataSize );
+    bool            pwrite( const char* inFileName, uint64_t inOffset, const char* inData, size_t dataSize );
+    bool            pread( const char* inFileName, uint64_t inOffset, size_t inNumBytes, char* outBuf, size_t* outBytesRead = nullptr );
+    bool            read_many( std::vector<read_request>& ioRequests );    // Split up by shard, each shard's part is coalesced as usual.
+    bool            delete_file( const char* inFileName );
+    
+    // Combined over all shards:
+    bool            list_files( std::vector<std::string>* outFileNames );   // Sorted.
+    bool            scan( const file_disk::scan_callback& inCallback );    // One shard after the other, each in disk order.
+    bool            statistics( struct stats* outStatistics );
+    bool            metrics( struct metrics_snapshot* outMetrics );
+    bool            is_valid();
+    
+protected:
+    bool            on_all_shards( const std::function<bool(size_t inShardIndex)>& inAction );  // Runs inAction for every shard in its own thread, true if it succeeded for all.
+    void            close();
+    
+    sharded_file_disk( const sharded_file_disk& ) = delete;
+    sharded_file_disk& operator =( const sharded_file_disk& ) = delete;
+    
+protected:
+    std::vector<file_disk*>     mShards;
+};
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__sharded_file_disk__) */
@@ -0,0 +1,386 @@
+//
+//  trace.cpp
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#include "trace.h"
+#include "file_disk.h"
+#include "content_hash.h"
+#include "byte_order.h"
+#include <thread>
+#include <algorithm>
+
+
+using namespace std;
+
+
+namespace fld
+{
+
+// A trace starts with the version, followed by one record per call: The operation
+//  byte, varints for the nanoseconds since the previous record's start, the duration
+//  and the name length, the 8-byte name hash if the length isn't 0, then varints for
+//  offset, size and block size.
+static const uint32_t   TRACE_FORMAT_VERSION = 0x00000100;
+
+static const char*  sTraceOperationNames[trace_operation_count] = { "add", "set", "append", "pwrite", "read", "read_many", "read_part", "scan", "delete", "list", "write", "compact", "trim", "begin_batch", "commit", "abort" };
+
+
+std::string     trace_record::synthetic_name() const
+{
+    if( name_length == 0 )
+        return std::string();
+
+    // At least all 64 bits of the hash, 6 per character, so different names don't end up the same:
+    static const char*  sNameCharacters = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
+    std::string     name;
+    for( uint64_t remainingHash = name_hash, x = 0; x < 11; x++, remainingHash >>= 6 )
+        name.append( 1, sNameCharacters[remainingHash & 63] );
+    if( name.size() < name_length )
+        name.append( name_length -name.size(), '_' );
+    return name;
+}
+
+
+trace_recorder::trace_recorder()
+    : mPreviousStartTime(0)
+{
+
+}
+
+
+bool    trace_recorder::open( const std::string& inPath )
+{
+    std::lock_guard<std::mutex>     lock(mLock);
+
+    if( mFile.is_open() )
+        mFile.close();
+    mFile.clear();
+    mFile.open( inPath, ios::out | ios::binary | ios::trunc );
+    write_le( mFile, TRACE_FORMAT_VERSION );
+    mStartTime = std::chrono::steady_clock::now();
+    mPreviousStartTime = 0;
+
+    return !mFile.fail();
+}
+
+
+bool    trace_recorder::close()
+{
+    std::lock_guard<std::mutex>     lock(mLock);
+
+    if( !mFile.is_open() )
+        return true;
+    mFile.close();
+
+    return !mFile.fail();
+}
+
+
+uint64_t    trace_recorder::nanoseconds_since_start( std::chrono::steady_clock::time_point inTime ) const
+{
+    if( inTime < mStartTime )
+        return 0;   // Call started before we were opened.
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( inTime -mStartTime ).count();
+}
+
+
+void    trace_recorder::record( trace_operation inOperation, const char* inFileName, uint64_t inOffset, uint64_t inSize, uint64_t inBlockSize,
+                                std::chrono::steady_clock::time_point inStartTime, std::chrono::steady_clock::time_point inEndTime )
+{
+    std::lock_guard<std::mutex>     lock(mLock);
+
+    if( !mFile.is_open() )
+        return;
+
+    trace_record    theRecord = {};
+    theRecord.operation = inOperation;
+    theRecord.start_time = nanoseconds_since_start( inStartTime );
+    theRecord.duration = nanoseconds_since_start( inEndTime ) -theRecord.start_time;
+    theRecord.name_length = inFileName ? strlen(inFileName) : 0;
+    theRecord.name_hash = inFileName ? content_hash( inFileName, theRecord.name_length ) : 0;
+    theRecord.offset = inOffset;
+    theRecord.size = inSize;
+    theRecord.block_size = inBlockSize;
+    write_record( theRecord );
+}
+
+
+void    trace_recorder::record_read_many( const std::vector<read_request>& inRequests,
+                                          std::chrono::steady_clock::time_point inStartTime, std::chrono::steady_clock::time_point inEndTime )
+{
+    std::lock_guard<std::mutex>     lock(mLock);
+
+    if( !mFile.is_open() )
+        return;
+
+    trace_record    theRecord = {};
+    theRecord.operation = trace_read_many;
+    theRecord.start_time = nanoseconds_since_start( inStartTime );
+    theRecord.duration = nanoseconds_since_start( inEndTime ) -theRecord.start_time;
+    theRecord.size = inRequests.size();
+    write_record( theRecord );
+
+    // The parts are written while we hold the lock, so nobody else's records get between them:
+    for( const read_request& currRequest : inRequests )
+    {
+        trace_record    partRecord = {};
+        partRecord.operation = trace_read_part;
+        partRecord.start_time = theRecord.start_time;
+        partRecord.name_length = currRequest.name.size();
+        partRecord.name_hash = content_hash( currRequest.name.data(), currRequest.name.size() );
+        partRecord.offset = currRequest.offset;
+        partRecord.size = currRequest.length;
+        write_record( partRecord );
+    }
+}
+
+
+void    trace_recorder::write_record( const trace_record& inRecord )
+{
+    uint8_t     operation = (uint8_t) inRecord.operation;
+    mFile.write( (const char*) &operation, sizeof(operation) );
+    write_varint( mFile, (inRecord.start_time > mPreviousStartTime) ? (inRecord.start_time -mPreviousStartTime) : 0 );
+    mPreviousStartTime = std::max( mPreviousStartTime, inRecord.start_time );
+    write_varint( mFile, inRecord.duration );
+    write_varint( mFile, inRecord.name_length );
+    if( inRecord.name_length != 0 )
+        write_le( mFile, inRecord.name_hash );
+    write_varint( mFile, inRecord.offset );
+    write_varint( mFile, inRecord.size );
+    write_varint( mFile, inRecord.block_size );
+}
+
+
+bool    trace_reader::open( const std::string& inPath )
+{
+    mFile.open( inPath, ios::in | ios::binary );
+    mPreviousStartTime = 0;
+    mAtEnd = false;
+
+    uint32_t    version = 0;
+    if( !read_le( mFile, &version ) )
+        return false;
+    return (version & 0xffffff00) == (TRACE_FORMAT_VERSION & 0xffffff00);   // Only the minor version may differ.
+}
+
+
+bool    trace_reader::next( trace_record* outRecord )
+{
+    if( mFile.peek() == char_traits<char>::eof() )
+    {
+        mAtEnd = !mFile.bad();
+        return false;
+    }
+
+    *outRecord = trace_record();
+    uint8_t     operation = 0;
+    uint64_t    startDelta = 0;
+    if( !mFile.read( (char*) &operation, sizeof(operation) ) || operation >= trace_operation_count )
+        return false;
+    outRecord->operation = (trace_operation) operation;
+    if( !read_varint( mFile, &startDelta ) || !read_varint( mFile, &outRecord->duration )
+        || !read_varint( mFile, &outRecord->name_length ) )
+        return false;
+    if( outRecord->name_length != 0 && !read_le( mFile, &outRecord->name_hash ) )
+        return false;
+    if( !read_varint( mFile, &outRecord->offset ) || !read_varint( mFile, &outRecord->size )
+        || !read_varint( mFile, &outRecord->block_size ) )
+        return false;
+    mPreviousStartTime += startDelta;
+    outRecord->start_time = mPreviousStartTime;
+
+    return true;
+}
+
+
+trace_scope::~trace_scope()
+{
+    mDepth--;
+    if( !mRecorder )
+        return;
+
+    std::chrono::steady_clock::time_point   endTime = std::chrono::steady_clock::now();
+    if( mRequests )
+        mRecorder->record_read_many( *mRequests, mStartTime, endTime );
+    else
+        mRecorder->record( mOperation, mFileName, mOffset, mSize, mBlockSize, mStartTime, endTime );
+}
+
+
+// New data of inSize bytes. It starts with inSerial, so files don't all look the same
+//  to deduplication:
+static char*    new_synthetic_data( size_t inSize, uint64_t inSerial )
+{
+    char*   data = new char[inSize];
+    memset( data, 'a' +(inSerial % 26), inSize );
+    if( inSize >= sizeof(inSerial) )
+        store_le( data, inSerial );
+    return data;
+}
+
+
+bool    replay_trace( const std::string& inTracePath, file_disk& ioDisk, bool inRealTime, struct replay_result* outResult )
+{
+    *outResult = replay_result();
+
+    trace_reader    reader;
+    if( !reader.open( inTracePath ) )
+        return false;
+
+    std::vector<char>       buffer;     // For reads, and writes where the caller keeps ownership.
+    std::vector<read_request>   requests;
+    std::vector<std::string>    fileNames;
+    std::chrono::steady_clock::time_point   replayStartTime = std::chrono::steady_clock::now();
+    trace_record            currRecord;
+    while( reader.next( &currRecord ) )
+    {
+        if( inRealTime )
+            std::this_thread::sleep_until( replayStartTime +std::chrono::nanoseconds( currRecord.start_time ) );
+
+        // Collect the parts of a read_many() before we start the clock:
+        size_t      numBytes = (size_t) currRecord.size;
+        if( currRecord.operation == trace_read_many )
+        {
+            requests.resize( (size_t) currRecord.size );
+            numBytes = 0;
+            for( read_request& currRequest : requests )
+            {
+                trace_record    partRecord;
+                if( !reader.next( &partRecord ) || partRecord.operation != trace_read_part )
+                    return false;
+                currRequest.name = partRecord.synthetic_name();
+                currRequest.offset = partRecord.offset;
+                currRequest.length = (size_t) partRecord.size;
+                numBytes += currRequest.length;
+            }
+        }
+        if( currRecord.operation != trace_add && currRecord.operation != trace_set && buffer.size() < numBytes )
+            buffer.resize( numBytes );
+        if( currRecord.operation == trace_read_many )
+        {
+            char*   currBuffer = buffer.data();
+            for( read_request& currRequest : requests )
+            {
+                currRequest.buffer = currBuffer;
+                currBuffer += currRequest.length;
+            }
+        }
+        std::string     fileName = currRecord.synthetic_name();
+        uint64_t        serial = outResult->num_calls;
+
+        std::chrono::steady_clock::time_point   callStartTime = std::chrono::steady_clock::now();
+        bool            succeeded = true;
+        size_t          bytesRead = 0;
+        switch( currRecord.operation )
+        {
+            case trace_add:
+                succeeded = ioDisk.add_file( fileName.c_str(), new_synthetic_data( numBytes, serial ), numBytes, (size_t) currRecord.block_size );
+                outResult->bytes_written += numBytes;
+                break;
+            case trace_set:
+                succeeded = ioDisk.set_file_contents( fileName.c_str(), new_synthetic_data( numBytes, serial ), numBytes );
+                outResult->bytes_written += numBytes;
+                break;
+            case trace_append:
+                memset( buffer.data(), 'a' +(serial % 26), numBytes );
+                succeeded = ioDisk.append( fileName.c_str(), buffer.data(), numBytes );
+                outResult->bytes_written += numBytes;
+                break;
+            case trace_pwrite:
+                memset( buffer.data(), 'a' +(serial % 26), numBytes );
+                succeeded = ioDisk.pwrite( fileName.c_str(), currRecord.offset, buffer.data(), numBytes );
+                outResult->bytes_written += numBytes;
+                break;
+            case trace_read:
+                succeeded = ioDisk.pread( fileName.c_str(), currRecord.offset, numBytes, buffer.data(), &bytesRead );
+                outResult->bytes_read += bytesRead;
+                break;
+            case trace_read_many:
+                succeeded = ioDisk.read_many( requests );
+                for( const read_request& currRequest : requests )
+                    outResult->bytes_read += currRequest.bytes_read;
+                break;
+            case trace_scan:
+                succeeded = ioDisk.scan( [outResult]( const std::string& /*inFileName*/, const char* /*inData*/, size_t inDataSize )
+                {
+                    outResult->bytes_read += inDataSize;
+                    return true;
+                }, numBytes );
+                break;
+            case trace_delete:
+                succeeded = ioDisk.delete_file( fileName.c_str() );
+                break;
+            case trace_list:
+                succeeded = ioDisk.list_files( &fileNames );
+                break;
+            case trace_write:
+                succeeded = ioDisk.write();
+                break;
+            case trace_compact:
+                succeeded = ioDisk.compact();
+                break;
+            case trace_trim:
+                succeeded = ioDisk.trim( currRecord.size );
+                break;
+            case trace_begin_batch:
+                succeeded = ioDisk.begin_batch();
+                break;
+            case trace_commit:
+                succeeded = ioDisk.commit();
+                break;
+            case trace_abort:
+                ioDisk.abort();
+                break;
+            case trace_read_part:       // Only valid right after a trace_read_many.
+            case trace_operation_count:
+                return false;
+        }
+        std::chrono::steady_clock::time_point   callEndTime = std::chrono::steady_clock::now();
+
+        outResult->latencies[currRecord.operation].record( std::chrono::duration_cast<std::chrono::nanoseconds>( callEndTime -callStartTime ).count() );
+        outResult->recorded_latencies[currRecord.operation].record( currRecord.duration );
+        outResult->num_calls++;
+        if( !succeeded )
+            outResult->num_failed++;
+    }
+
+    outResult->elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() -replayStartTime ).count();
+    ioDisk.statistics( &outResult->statistics );
+
+    return reader.at_end();
+}
+
+
+void    replay_result::print( std::ostream& output ) const
+{
+    double      seconds = std::max( elapsed, (uint64_t)1 ) / 1000000000.0;
+    output << "calls: " << num_calls << " (" << num_failed << " failed) in " << (elapsed / 1000000) << " ms, "
+            << (uint64_t)(num_calls / seconds) << " calls/s" << endl;
+    output << "written: " << bytes_written << " bytes, " << (bytes_written / seconds / (1024 * 1024)) << " MB/s" << endl;
+    output << "read: " << bytes_read << " bytes, " << (bytes_read / seconds / (1024 * 1024)) << " MB/s" << endl;
+
+    for( size_t x = 0; x < trace_operation_count; x++ )
+    {
+        const histogram&    currHistogram = latencies[x];
+        uint64_t            numCalls = currHistogram.count();
+        if( numCalls == 0 )
+            continue;
+        output << sTraceOperationNames[x] << ": " << numCalls << " calls"
+                << ", p50 " << currHistogram.percentile(50) << " ns"
+                << ", p99 " << currHistogram.percentile(99) << " ns"
+                << ", p99.9 " << currHistogram.percentile(99.9) << " ns"
+                << " (recorded p50 " << recorded_latencies[x].percentile(50) << " ns"
+                << ", p99 " << recorded_latencies[x].percentile(99) << " ns)" << endl;
+    }
+
+    uint64_t    fileSize = statistics.used_bytes +statistics.free_bytes +statistics.map_bytes +statistics.header_bytes;
+    output << "file_size: " << fileSize << " bytes" << endl;
+    output << "free: " << statistics.free_bytes << " bytes (" << ((statistics.free_bytes * 100.0) / std::max( fileSize, (uint64_t)1 )) << "%)"
+            << " in " << statistics.free_block_count << " blocks, largest " << statistics.largest_free_block << " bytes" << endl;
+    output << "map: " << statistics.map_bytes << " bytes for " << statistics.num_files << " files" << endl;
+}
+
+} /* namespace fld */
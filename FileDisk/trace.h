@@ -0,0 +1,172 @@
+//
+//  trace.h
+//  FileDisk
+//
+//  Copyright (c) 2015 Uli Kusterer. All rights reserved.
+//
+
+#ifndef __FileDisk__trace__
+#define __FileDisk__trace__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+#include "metrics.h"
+#include "file_disk.h"
+
+
+namespace fld
+{
+
+// What a file_disk call in a trace was:
+enum trace_operation
+{
+    trace_add = 0,      // size is the data size, block_size what was passed to add_file().
+    trace_set,
+    trace_append,
+    trace_pwrite,
+    trace_read,         // pread().
+    trace_read_many,    // size is the number of trace_read_part records that follow, one per request.
+    trace_read_part,
+    trace_scan,         // size is the window size.
+    trace_delete,
+    trace_list,
+    trace_write,
+    trace_compact,
+    trace_trim,         // size is the minimum size of free blocks to trim.
+    trace_begin_batch,
+    trace_commit,
+    trace_abort,
+    trace_operation_count   // Number of operations, not an operation itself.
+};
+
+
+// One call as recorded. File names aren't recorded, only a hash and the length of
+//  the name, so traces of production data can be handed out:
+struct trace_record
+{
+    trace_operation     operation;
+    uint64_t            start_time; // Nanoseconds since recording started.
+    uint64_t            duration;   // Nanoseconds the call took.
+    uint64_t            name_hash;  // content_hash() of the name, 0 for calls without a name.
+    uint64_t            name_length;
+    uint64_t            offset;
+    uint64_t            size;
+    uint64_t            block_size;
+
+    std::string     synthetic_name() const; // Same for every record with this hash, and as long as the recorded name, but at least 11 characters.
+};
+
+
+// Writes every call file_disk::set_trace() hooked it up to into a file. Several
+//  file_disks may share one recorder.
+class trace_recorder
+{
+public:
+    trace_recorder();
+    ~trace_recorder()   { close(); }
+
+    bool    open( const std::string& inPath );
+    bool    close();
+
+    void    record( trace_operation inOperation, const char* inFileName, uint64_t inOffset, uint64_t inSize, uint64_t inBlockSize,
+                    std::chrono::steady_clock::time_point inStartTime, std::chrono::steady_clock::time_point inEndTime );
+    void    record_read_many( const std::vector<read_request>& inRequests,
+                    std::chrono::steady_clock::time_point inStartTime, std::chrono::steady_clock::time_point inEndTime );
+
+protected:
+    void    write_record( const trace_record& inRecord );
+    uint64_t    nanoseconds_since_start( std::chrono::steady_clock::time_point inTime ) const;
+
+    trace_recorder( const trace_recorder& ) = delete;
+    trace_recorder& operator =( const trace_recorder& ) = delete;
+
+protected:
+    std::mutex                              mLock;
+    std::ofstream                           mFile;
+    std::chrono::steady_clock::time_point   mStartTime;
+    uint64_t                                mPreviousStartTime; // Records store the time since the previous one, which is usually short.
+};
+
+
+class trace_reader
+{
+public:
+    trace_reader() : mPreviousStartTime(0), mAtEnd(false) {}
+
+    bool    open( const std::string& inPath );
+    bool    next( trace_record* outRecord );    // False at the end of the trace, or if it is damaged.
+    bool    at_end() const  { return mAtEnd; }  // Did next() return false because the trace ended, not because it's damaged?
+
+protected:
+    std::ifstream   mFile;
+    uint64_t        mPreviousStartTime;
+    bool            mAtEnd;
+};
+
+
+// Records one file_disk call when it goes out of scope. Calls file_disk makes to
+//  itself (e.g. trim() calling write()) are part of the outer call, so ioDepth
+//  counts how many of these are active and only the outermost one records.
+class trace_scope
+{
+public:
+    trace_scope( trace_recorder* inRecorder, unsigned& ioDepth, trace_operation inOperation, const char* inFileName = nullptr, uint64_t inOffset = 0, uint64_t inSize = 0, uint64_t inBlockSize = 0 )
+        : mRecorder( (ioDepth++ == 0) ? inRecorder : nullptr ), mDepth(ioDepth), mOperation(inOperation), mFileName(inFileName), mOffset(inOffset), mSize(inSize), mBlockSize(inBlockSize), mRequests(nullptr)
+    {
+        if( mRecorder )
+            mStartTime = std::chrono::steady_clock::now();
+    }
+    trace_scope( trace_recorder* inRecorder, unsigned& ioDepth, const std::vector<read_request>& inRequests )
+        : trace_scope( inRecorder, ioDepth, trace_read_many )
+    {
+        mRequests = &inRequests;
+    }
+    ~trace_scope();
+
+protected:
+    trace_recorder*                         mRecorder;  // nullptr if we're not tracing or are inside another call.
+    unsigned&                               mDepth;
+    trace_operation                         mOperation;
+    const char*                             mFileName;
+    uint64_t                                mOffset;
+    uint64_t                                mSize;
+    uint64_t                                mBlockSize;
+    const std::vector<read_request>*        mRequests;  // For trace_read_many.
+    std::chrono::steady_clock::time_point   mStartTime;
+};
+
+
+// What replay_trace() measured:
+struct replay_result
+{
+    replay_result() : num_calls(0), num_failed(0), bytes_written(0), bytes_read(0), elapsed(0) { memset( &statistics, 0, sizeof(statistics) ); }
+
+    uint64_t    num_calls;
+    uint64_t    num_failed;     // Calls that returned false. Non-zero is expected if they failed when recorded, too.
+    uint64_t    bytes_written;
+    uint64_t    bytes_read;
+    uint64_t    elapsed;        // Nanoseconds for the whole replay, including any pauses for real-time pacing.
+    histogram   latencies[trace_operation_count];           // Nanoseconds per call, by trace_operation.
+    histogram   recorded_latencies[trace_operation_count];  // Same, as recorded, for comparison.
+    struct stats    statistics; // Of the container after the replay, for judging fragmentation.
+
+    void    print( std::ostream& output ) const;
+};
+
+
+// Performs all calls in the trace at inTracePath on ioDisk, with made-up data of the
+//  recorded sizes. Open and set up ioDisk (e.g. set_deduplicate()) before calling this.
+//  If inRealTime is true, each call is made as long after the first as it was when it
+//  was recorded, otherwise they are made as fast as possible. Fails if the trace can't
+//  be read, not if individual calls fail.
+bool    replay_trace( const std::string& inTracePath, file_disk& ioDisk, bool inRealTime, struct replay_result* outResult );
+
+} /* namespace fld */
+
+#endif /* defined(__FileDisk__trace__) */